@@ -0,0 +1,138 @@
+#!/bin/sh
+# Benchmark the conversion pipeline on synthetic repositories.
+#
+#   ./bench.sh [results.json]
+#
+# Every repository is generated locally, so this runs offline. Each profile
+# is converted once with --summary, and the per-phase summaries are
+# collected into one JSON array (default .giga-bench/results.json).
+
+set -e
+
+SERVER=${SERVER:-./server}
+DIR=${BENCH_DIR:-.giga-bench}
+RESULTS=${1:-$DIR/results.json}
+
+# make_repo NAME FILES DEPTH FANOUT CONFLICTS LARGE_KB
+#
+# FILES .c modules, each including FANOUT shared headers that sit on top of
+# an include chain DEPTH headers deep. The first CONFLICTS modules define
+# the same static helper; when there are any, no public header shares its
+# module's name, so the conversion falls through to compile feedback.
+# LARGE_KB adds one generated source of roughly that size.
+make_repo() {
+    repo=$DIR/$1 files=$2 depth=$3 fanout=$4 conflicts=$5 large_kb=$6
+    rm -rf "$repo"
+    mkdir -p "$repo/include" "$repo/src"
+
+    i=0
+    while [ "$i" -lt "$depth" ]; do
+        {
+            echo "#ifndef LEVEL_${i}_H"
+            echo "#define LEVEL_${i}_H"
+            if [ "$i" -gt 0 ]; then
+                echo "#include \"level_$((i - 1)).h\""
+            fi
+            echo "#include <stddef.h>"
+            echo "typedef struct { size_t v[$((i + 1))]; } level_${i}_t;"
+            echo "#endif"
+        } > "$repo/include/level_$i.h"
+        i=$((i + 1))
+    done
+
+    i=0
+    while [ "$i" -lt "$fanout" ]; do
+        {
+            echo "#ifndef SHARED_${i}_H"
+            echo "#define SHARED_${i}_H"
+            if [ "$depth" -gt 0 ]; then
+                echo "#include \"level_$((depth - 1)).h\""
+            fi
+            echo "#include <string.h>"
+            echo "int shared_${i}_value(int x);"
+            echo "#endif"
+        } > "$repo/include/shared_$i.h"
+        i=$((i + 1))
+    done
+
+    i=0
+    while [ "$i" -lt "$files" ]; do
+        if [ "$conflicts" -gt 0 ]; then
+            header=api_$i.h
+        else
+            header=module_$i.h
+        fi
+        {
+            echo "#ifndef MODULE_${i}_H"
+            echo "#define MODULE_${i}_H"
+            echo "int module_${i}_run(int x);"
+            echo "#endif"
+        } > "$repo/include/$header"
+        {
+            echo "#include \"$header\""
+            j=0
+            while [ "$j" -lt "$fanout" ]; do
+                echo "#include \"shared_$(((i + j) % fanout)).h\""
+                j=$((j + 1))
+            done
+            echo "#include <stdlib.h>"
+            if [ "$i" -lt "$conflicts" ]; then
+                echo "static int helper(int x) { return x + $i; }"
+            else
+                echo "static int helper_$i(int x) { return x + $i; }"
+            fi
+            echo "int module_${i}_run(int x) {"
+            if [ "$i" -lt "$conflicts" ]; then
+                echo "    return helper(x) * 2;"
+            else
+                echo "    return helper_$i(x) * 2;"
+            fi
+            echo "}"
+        } > "$repo/src/module_$i.c"
+        i=$((i + 1))
+    done
+
+    if [ "$large_kb" -gt 0 ]; then
+        echo "long large_first(void);" > "$repo/include/large.h"
+        awk -v kb="$large_kb" 'BEGIN {
+            n = int(kb * 1024 / 40)
+            for (i = 0; i < n; i++)
+                printf "static const long large_%08d = %08dL;\n", i, i
+            print "#include \"large.h\""
+            print "long large_first(void) { return large_00000000; }"
+        }' > "$repo/src/large.c"
+    fi
+}
+
+# name files depth fanout conflicts large_kb
+PROFILES="
+small 50 3 2 0 0
+wide 1000 3 4 0 0
+deep 200 40 2 0 0
+conflicts 40 2 2 8 0
+large 10 2 2 0 8192
+"
+
+mkdir -p "$DIR"
+printf '[\n' > "$RESULTS"
+first=1
+echo "$PROFILES" | while read -r name files depth fanout conflicts large_kb; do
+    [ -n "$name" ] || continue
+    make_repo "$name" "$files" "$depth" "$fanout" "$conflicts" "$large_kb"
+    "$SERVER" "$DIR/$name" -o "$DIR/$name.h" \
+        --summary "$DIR/$name.json" > /dev/null
+    printf '  %s  %s\n' "$name" \
+        "$(grep '"wall_seconds"' "$DIR/$name.json" | tr -d ' ,')"
+    if [ "$first" -eq 0 ]; then
+        printf ',\n' >> "$RESULTS"
+    fi
+    first=0
+    printf '{ "profile": "%s", "files": %s, "depth": %s, "fanout": %s, ' \
+        "$name" "$files" "$depth" "$fanout" >> "$RESULTS"
+    printf '"conflicts": %s, "large_kb": %s,\n  "summary": ' \
+        "$conflicts" "$large_kb" >> "$RESULTS"
+    cat "$DIR/$name.json" >> "$RESULTS"
+    printf '}' >> "$RESULTS"
+done
+printf '\n]\n' >> "$RESULTS"
+echo "results: $RESULTS"
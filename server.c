@@ -2,24 +2,56 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <json-c/json.h>
 #include <limits.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #define PORT 8080
 #define TEMP_DIR "/tmp/c_converter"
 #define BUFFER_SIZE 4096
-#define MAX_INCLUDES 512
-#define MAX_FILES 512
 #define MAX_HEADER_LEN 256
 #define MAX_PATH_LEN 1024
+#define LISTEN_BACKLOG 128
+#define MAX_CONNECTIONS 1024
+#define MAX_REQUEST_HEADER 16384
+#define MAX_REQUEST_BODY 65536
+#define KEEPALIVE_TIMEOUT 30 /* seconds a connection may sit idle */
+#define MAX_EVENTS 64
+#define WORKER_THREADS 4
+#define WORKER_QUEUE_SIZE 64
+#define MAX_JOBS 256
+#define MAX_JOB_PROGRESS 128
+#define GIT_SHA_LEN 40
+
+/* Bump whenever the generated output changes so stale cache entries are
+   never served. */
+#define CONVERTER_VERSION "10"
+
+/* Variants of one file's segment kept per key, for files whose output
+   depends on which headers were inlined before them. */
+#define MAX_SEGMENT_VARIANTS 4
 
 #define MAX_SYSTEM_PATHS 8
 
@@ -37,7 +69,10 @@ void add_system_path(const char *path) {
     g_system_path_count++;
 }
 
+void system_header_cache_invalidate(void);
+
 void init_system_paths(void) {
+    system_header_cache_invalidate();
     add_system_path("/usr/include");
     add_system_path("/usr/local/include");
 
@@ -52,6 +87,187 @@ void init_system_paths(void) {
     }
 }
 
+typedef struct Job Job;
+
+void job_add_progress(Job *job, const char *message);
+
+/* Job whose conversion is running on this thread, if any. Progress messages
+   are mirrored into it so clients can poll them. */
+static __thread Job *t_current_job = NULL;
+
+/* Prepended to progress messages printed by this thread, so the output of
+   concurrent batch conversions can be told apart. */
+static __thread const char *t_log_prefix = NULL;
+
+void log_progress(const char *fmt, ...) {
+    char message[MAX_PATH_LEN + 128];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(message, sizeof(message), fmt, ap);
+    va_end(ap);
+
+    if (t_log_prefix)
+        printf("[%s] %s\n", t_log_prefix, message);
+    else
+        printf("%s\n", message);
+    if (t_current_job)
+        job_add_progress(t_current_job, message);
+}
+
+/* Pipeline phases that are timed separately. */
+typedef enum {
+    PHASE_CLONE = 0,
+    PHASE_WALK,
+    PHASE_STRATEGY,
+    PHASE_GENERATE,
+    PHASE_COMPILE,
+    PHASE_WRITE,
+    PHASE_COUNT
+} Phase;
+
+static const char *const g_phase_names[PHASE_COUNT] = {
+    "clone", "walk", "strategy", "generate", "compile", "write"};
+
+/* Time spent, and work done, in each phase of one conversion. */
+typedef struct {
+    double seconds[PHASE_COUNT];
+    int calls[PHASE_COUNT];
+    long files[PHASE_COUNT];
+    long long bytes[PHASE_COUNT];
+} ConversionStats;
+
+/* Stats of the conversion running on this thread, if anyone asked. */
+static __thread ConversionStats *t_stats = NULL;
+
+/* Process-wide metrics, exported at GET /metrics and by --stats: a latency
+   histogram per phase plus a few counters. Updated from every worker, so
+   guarded by g_metrics_lock. */
+#define METRIC_BUCKETS 11
+
+static const double g_metric_buckets[METRIC_BUCKETS] = {
+    0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30, 60};
+
+typedef struct {
+    unsigned long long buckets[METRIC_BUCKETS]; /* non-cumulative */
+    unsigned long long count;
+    double sum;
+} Histogram;
+
+typedef enum {
+    COUNTER_REQUESTS = 0,
+    COUNTER_CACHE_HITS,
+    COUNTER_GCC_RUNS,
+    COUNTER_RETRIES,
+    COUNTER_FILES_INLINED,
+    COUNTER_BYTES_EMITTED,
+    COUNTER_PREDICTED_CONFLICTS,
+    COUNTER_COUNT
+} Counter;
+
+static const char *const g_counter_names[COUNTER_COUNT] = {
+    "giga_http_requests_total",   "giga_cache_hits_total",
+    "giga_gcc_invocations_total", "giga_compile_retries_total",
+    "giga_files_inlined_total",   "giga_bytes_emitted_total",
+    "giga_predicted_conflicts_total"};
+
+static const char *const g_counter_help[COUNTER_COUNT] = {
+    "HTTP requests handled.",
+    "Conversions served from the header cache.",
+    "gcc syntax checks run by compile feedback.",
+    "Compile-feedback rounds after the first check.",
+    "Files inlined into generated headers, candidates included.",
+    "Bytes of generated header written, candidates included.",
+    "Source files excluded for symbol collisions before compiling."};
+
+static pthread_mutex_t g_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static Histogram g_phase_histograms[PHASE_COUNT];
+static unsigned long long g_counters[COUNTER_COUNT];
+
+void metrics_count(Counter counter, unsigned long long n) {
+    pthread_mutex_lock(&g_metrics_lock);
+    g_counters[counter] += n;
+    pthread_mutex_unlock(&g_metrics_lock);
+}
+
+void metrics_observe(Phase phase, double seconds) {
+    Histogram *h = &g_phase_histograms[phase];
+    int bucket = 0;
+    while (bucket < METRIC_BUCKETS && seconds > g_metric_buckets[bucket])
+        bucket++;
+    pthread_mutex_lock(&g_metrics_lock);
+    if (bucket < METRIC_BUCKETS)
+        h->buckets[bucket]++;
+    h->count++;
+    h->sum += seconds;
+    pthread_mutex_unlock(&g_metrics_lock);
+}
+
+/* Write every metric to out in the Prometheus text exposition format. */
+void metrics_write(FILE *out) {
+    pthread_mutex_lock(&g_metrics_lock);
+    Histogram histograms[PHASE_COUNT];
+    unsigned long long counters[COUNTER_COUNT];
+    memcpy(histograms, g_phase_histograms, sizeof(histograms));
+    memcpy(counters, g_counters, sizeof(counters));
+    pthread_mutex_unlock(&g_metrics_lock);
+
+    fprintf(out, "# HELP giga_phase_duration_seconds Time spent in each "
+                 "conversion phase.\n"
+                 "# TYPE giga_phase_duration_seconds histogram\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        unsigned long long cumulative = 0;
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            cumulative += histograms[p].buckets[b];
+            fprintf(out,
+                    "giga_phase_duration_seconds_bucket{phase=\"%s\","
+                    "le=\"%g\"} %llu\n",
+                    g_phase_names[p], g_metric_buckets[b], cumulative);
+        }
+        fprintf(out,
+                "giga_phase_duration_seconds_bucket{phase=\"%s\","
+                "le=\"+Inf\"} %llu\n"
+                "giga_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n"
+                "giga_phase_duration_seconds_count{phase=\"%s\"} %llu\n",
+                g_phase_names[p], histograms[p].count, g_phase_names[p],
+                histograms[p].sum, g_phase_names[p], histograms[p].count);
+    }
+    for (int c = 0; c < COUNTER_COUNT; c++)
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                g_counter_names[c], g_counter_help[c], g_counter_names[c],
+                g_counter_names[c], counters[c]);
+}
+
+double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Account one run of phase that began at started (monotonic_seconds), both
+   in the metrics and in this thread's conversion stats. */
+void stats_record(Phase phase, double started, long files, long long bytes) {
+    double elapsed = monotonic_seconds() - started;
+    metrics_observe(phase, elapsed);
+    if (!t_stats)
+        return;
+    t_stats->seconds[phase] += elapsed;
+    t_stats->calls[phase]++;
+    t_stats->files[phase] += files;
+    t_stats->bytes[phase] += bytes;
+}
+
+/* How a conversion lays out its header. Everything here changes the
+   output, so it is part of the conversion cache key. */
+typedef struct {
+    int stb;   /* .c bodies only under <GUARD>_IMPLEMENTATION */
+    int prune; /* leave out code the public headers do not reach */
+    const char *const *roots; /* if any, emit only what these need */
+    int root_count;
+    int shards; /* if above 1, split the implementation into this many */
+} ConvertOptions;
+
+#define MAX_SLICE_ROOTS 256
+
 typedef struct {
     char *git_url;
     char *repo_name;
@@ -59,8 +275,12 @@ typedef struct {
     int c_files_count;
     int header_files_count;
     char *header_filename;
+    char *work_dir;
+    char *strategy;
     char *error;
+    int cached;
     int success;
+    char content_hash[17]; /* set once the header has been compressed */
 } ConversionResult;
 
 typedef enum {
@@ -68,44 +288,393 @@ typedef enum {
     INCLUDE_LOCAL,  // #include "file.h"
     INCLUDE_SYSTEM, // #include <file.h>
     INCLUDE_IF,     // #if / #ifdef / #ifndef
-    INCLUDE_ENDIF   // #endif
+    INCLUDE_ELSE,   // #elif / #else
+    INCLUDE_ENDIF,  // #endif
+    INCLUDE_DEFINE  // #define / #undef
 } IncludeType;
 
+/* Whether a stretch of a file is compiled, as far as the file itself can
+   tell: conditions on macros it never defines are unknown. */
+typedef enum { REACH_LIVE = 0, REACH_DEAD, REACH_UNKNOWN } Reach;
+
 void free_result(ConversionResult *result);
 
+#define FNV_OFFSET 14695981039346656037ULL
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t hash_string(const char *str) {
+    return hash_bytes(FNV_OFFSET, str, strlen(str) + 1);
+}
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+/* Bump allocator for strings that live as long as their owning structure;
+   everything is released at once by arena_free. */
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock *block = arena->head;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (!block)
+            return NULL;
+        block->next = arena->head;
+        block->used = 0;
+        block->size = block_size;
+        arena->head = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char *arena_strdup(Arena *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    if (copy)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+/* Open-addressing hash set of strings interned in an arena. items keeps
+   insertion order, which is the order includes are emitted in, and an
+   item's position there is stable, so callers can keep parallel arrays
+   indexed by strset_index. */
+typedef struct {
+    int *slots;      /* 0 for empty, otherwise index into items + 1 */
+    size_t capacity; /* power of two, 0 until first insert */
+    const char **items;
+    int count;
+    int items_capacity;
+    Arena *arena;
+} StrSet;
+
+void strset_init(StrSet *set, Arena *arena) {
+    memset(set, 0, sizeof(*set));
+    set->arena = arena;
+}
+
+void strset_free(StrSet *set) {
+    free(set->slots);
+    free(set->items);
+    set->slots = NULL;
+    set->items = NULL;
+    set->capacity = 0;
+    set->count = 0;
+    set->items_capacity = 0;
+}
+
+int *strset_slot(const StrSet *set, const char *str) {
+    size_t mask = set->capacity - 1;
+    size_t i = (size_t)hash_string(str) & mask;
+    while (set->slots[i] && strcmp(set->items[set->slots[i] - 1], str) != 0)
+        i = (i + 1) & mask;
+    return &set->slots[i];
+}
+
+/* Returns the position of str in items, or -1 if it is not in the set. */
+int strset_index(const StrSet *set, const char *str) {
+    if (set->capacity == 0)
+        return -1;
+    return *strset_slot(set, str) - 1;
+}
+
+/* Returns the interned copy of str, or NULL if it is not in the set. */
+const char *strset_get(const StrSet *set, const char *str) {
+    int index = strset_index(set, str);
+    return index < 0 ? NULL : set->items[index];
+}
+
+int strset_contains(const StrSet *set, const char *str) {
+    return strset_index(set, str) >= 0;
+}
+
+int strset_grow(StrSet *set) {
+    size_t capacity = set->capacity ? set->capacity * 2 : 64;
+    int *slots = calloc(capacity, sizeof(*slots));
+    if (!slots)
+        return 0;
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+    for (int i = 0; i < set->count; i++)
+        *strset_slot(set, set->items[i]) = i + 1;
+    return 1;
+}
+
+/* Returns 1 if str was added, 0 if it was already present or on allocation
+   failure. */
+int strset_add(StrSet *set, const char *str) {
+    if ((size_t)(set->count + 1) * 2 > set->capacity && !strset_grow(set))
+        return 0;
+    int *slot = strset_slot(set, str);
+    if (*slot)
+        return 0;
+    if (set->count == set->items_capacity) {
+        int capacity = set->items_capacity ? set->items_capacity * 2 : 64;
+        const char **items = realloc(set->items, capacity * sizeof(*items));
+        if (!items)
+            return 0;
+        set->items = items;
+        set->items_capacity = capacity;
+    }
+    const char *copy = arena_strdup(set->arena, str);
+    if (!copy)
+        return 0;
+    set->items[set->count++] = copy;
+    *slot = set->count;
+    return 1;
+}
+
+/* Where an #include resolved to. Computed on first use and kept on the
+   directive, since it only depends on the including file and the repo. */
+typedef enum {
+    TARGET_UNRESOLVED = 0,
+    TARGET_REPO,     // inlined from the repository
+    TARGET_STANDARD, // found in a system include directory
+    TARGET_EXTERNAL  // left for the user's include path
+} IncludeTarget;
+
+/* One preprocessor line that matters to the generator or to main()
+   detection. Offsets are into the owning file's data; next is past any
+   backslash-continued lines. */
+typedef struct {
+    size_t start; /* first byte of the line */
+    size_t next;  /* first byte after its newline */
+    IncludeType type;
+    Reach reach; /* of the directive itself */
+    Reach body;  /* of the text after it, up to the next directive */
+    const char *header;
+    IncludeTarget target;
+    const char *resolved; /* absolute path when target is TARGET_REPO */
+} Directive;
+
+typedef enum { SYMBOL_ORDINARY, SYMBOL_TAG, SYMBOL_MACRO } SymbolSpace;
+
+/* A name a source file defines at file scope. text_id is a hash of the
+   definition for typedefs and macros, which may be repeated word for word;
+   it is 0 for everything that may only be defined once. external is set
+   for functions and objects the linker sees. [start, end) are the bytes of
+   the declaration or function definition the name comes from; both are 0
+   for macros. */
+typedef struct {
+    const char *name;
+    SymbolSpace space;
+    int is_static;
+    int external;
+    uint64_t text_id;
+    size_t start, end;
+} Symbol;
+
+/* A source file parsed once per conversion. data is always NUL-terminated
+   at data[size]; map_size is non-zero when data is a private mapping rather
+   than a heap copy. */
+typedef struct {
+    const char *path;
+    char *data; /* NULL if the file could not be read */
+    size_t size;
+    size_t map_size;
+    Directive *directives;
+    int directive_count;
+    int defines_main;    /* -1 until source_defines_main has run */
+    uint64_t content_id; /* hash of data, 0 until source_blob_id needs it */
+    Symbol *symbols;     /* NULL until source_symbols has run */
+    int symbol_count;
+    const char **renames; /* old and new name pairs of clashing statics */
+    int rename_count;
+    size_t *drops; /* start and end pairs of pruned definitions, in order */
+    int drop_count;
+} SourceFile;
+
+/* Every file found by the repository walk, keyed by its lexically
+   normalized path relative to root. canonical[i] is the resolved path of
+   paths.items[i], so include lookups need no syscalls. */
+typedef struct {
+    StrSet paths;
+    const char **canonical;
+    int capacity;
+    uint64_t file_set_id; /* order-independent hash of every entry */
+    char root[PATH_MAX];  /* canonical repository root, empty until built */
+} HeaderIndex;
+
+/* How generating a segment met one of its dependencies. */
+enum {
+    DEP_SKIPPED = 0,    /* already inlined earlier in the output */
+    DEP_INLINED = 1,    /* inlined by this segment */
+    DEP_CONDITIONAL = 2 /* copied in place under an undecided condition */
+};
+
+/* One top-level file's generated text, reusable wherever the headers it
+   reached are in the same state. deps lists every repository header the
+   file's includes reached, in first-reached order, with whether it was
+   inlined here (and the blob it was inlined from) or skipped because an
+   earlier file had inlined it. system lists its includes that went to the
+   preamble. */
+typedef struct Segment {
+    struct Segment *next; /* another variant for the same key */
+    const char *text;
+    size_t len;
+    int dep_count;
+    const char **deps; /* relative to the repository root */
+    uint64_t *dep_ids;
+    unsigned char *dep_inlined; /* a DEP_* value */
+    int system_count;
+    const char **system;
+} Segment;
+
+/* Per-job source model: every file the generator touches, read and indexed
+   once and shared by every strategy and compile-feedback round. Files are
+   arena-allocated so pointers to them stay valid as the table grows. */
+typedef struct {
+    SourceFile **slots;
+    size_t capacity; /* power of two, 0 until first insert */
+    int count;
+    size_t bytes_loaded;
+    HeaderIndex headers;
+    StrSet blob_paths; /* relative paths with a git blob id in blob_ids */
+    uint64_t *blob_ids;
+    int blob_capacity;
+    StrSet segment_keys; /* keys looked up so far; chains in segments */
+    Segment **segments;
+    int segment_capacity;
+    int segments_reused;
+    int segments_built;
+    Arena arena;
+} SourceCache;
+
+/* What a file's generation touched, gathered while it is emitted so the
+   result can be stored as a Segment. */
+typedef struct {
+    StrSet deps;
+    unsigned char *dep_inlined;
+    int dep_capacity;
+    StrSet system;
+    int uncacheable; /* reached a file outside the repository root */
+} SegmentRecord;
+
+#define MAX_CONDITIONAL_DEPTH 32
+
 typedef struct {
-    char standard[MAX_INCLUDES][MAX_HEADER_LEN];
-    int standard_count;
-    char external[MAX_INCLUDES][MAX_HEADER_LEN];
-    int external_count;
-    char inlined[MAX_FILES][MAX_PATH_LEN];
-    int inlined_count;
+    Arena arena;
+    StrSet standard;
+    StrSet external;
+    StrSet inlined;
+    SourceCache *sources;
+    SegmentRecord *record; /* non-NULL while a segment is being built */
+    const ConvertOptions *options;
+    const char *open_files[MAX_CONDITIONAL_DEPTH]; /* conditional inlines */
+    int open_count;
     char repo_dir[MAX_PATH_LEN];
 } ConversionContext;
 
+/* Growable list of paths. The strings live in the list's own arena, so
+   pointers to them stay valid until filelist_free even if the entry is
+   removed. */
 typedef struct {
-    char paths[MAX_FILES][MAX_PATH_LEN];
+    char **paths;
     int count;
+    int capacity;
+    Arena arena;
 } FileList;
 
+void filelist_add(FileList *list, const char *path) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        char **paths = realloc(list->paths, capacity * sizeof(*paths));
+        if (!paths)
+            return;
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    char *copy = arena_strdup(&list->arena, path);
+    if (copy)
+        list->paths[list->count++] = copy;
+}
+
+void filelist_free(FileList *list) {
+    free(list->paths);
+    arena_free(&list->arena);
+    memset(list, 0, sizeof(*list));
+}
+
 #define MAX_RETRY 10
 
 typedef struct {
-    char source[MAX_PATH_LEN];
+    const char *source;
+    int shard; /* implementation shard the lines are in, 0 if unsharded */
     int start_line;
     int end_line;
 } SourceMapping;
 
 typedef struct {
-    SourceMapping entries[MAX_FILES];
+    SourceMapping *entries;
     int count;
+    int capacity;
 } LineMap;
 
+void linemap_add(LineMap *map, const char *source, int shard,
+                 int start_line, int end_line) {
+    if (map->count == map->capacity) {
+        int capacity = map->capacity ? map->capacity * 2 : 64;
+        SourceMapping *entries =
+            realloc(map->entries, capacity * sizeof(*entries));
+        if (!entries)
+            return;
+        map->entries = entries;
+        map->capacity = capacity;
+    }
+    SourceMapping *sm = &map->entries[map->count++];
+    sm->source = source;
+    sm->shard = shard;
+    sm->start_line = start_line;
+    sm->end_line = end_line;
+}
+
+void linemap_free(LineMap *map) {
+    free(map->entries);
+    memset(map, 0, sizeof(*map));
+}
+
 int file_exists(const char *path) {
     struct stat st;
     return (stat(path, &st) == 0 && S_ISREG(st.st_mode));
 }
 
+/* Size of the file at path in bytes, or 0 if it cannot be stat'd. */
+long long path_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long)st.st_size : 0;
+}
+
 int create_directory(const char *path) { return mkdir(path, 0755); }
 
 void cleanup_directory(const char *path) {
@@ -114,6 +683,72 @@ void cleanup_directory(const char *path) {
     system(command);
 }
 
+/* Root of the persistent caches. Whatever they hold ends up in generated
+   headers, so the root is private to the user; it is empty when no such
+   directory could be set up, which turns caching off. */
+static char g_cache_root[MAX_PATH_LEN];
+
+/* Create path with mode 0700 if it is missing. Returns 1 if it is then a
+   directory of ours that no one else can write to. */
+int private_directory(const char *path) {
+    struct stat st;
+    if (mkdir(path, 0700) != 0 && errno != EEXIST)
+        return 0;
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode) &&
+           st.st_uid == getuid() && !(st.st_mode & 022);
+}
+
+/* Whether path is a regular file of ours that no one else can write. */
+int file_trusted(const char *path) {
+    struct stat st;
+    return lstat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+           st.st_uid == getuid() && !(st.st_mode & 022);
+}
+
+/* Set the cache root to dir or, if dir is NULL, $XDG_CACHE_HOME/giga-header
+   or ~/.cache/giga-header. */
+void cache_root_init(const char *dir) {
+    char base[MAX_PATH_LEN], path[MAX_PATH_LEN];
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    g_cache_root[0] = '\0';
+    if (dir) {
+        snprintf(path, sizeof(path), "%s", dir);
+    } else {
+        if (xdg && *xdg)
+            snprintf(base, sizeof(base), "%s", xdg);
+        else if (home && *home)
+            snprintf(base, sizeof(base), "%s/.cache", home);
+        else
+            return;
+        mkdir(base, 0700);
+        snprintf(path, sizeof(path), "%s/giga-header", base);
+    }
+    if (!private_directory(path)) {
+        fprintf(stderr, "warning: %s is not a private directory; "
+                        "caching is off\n",
+                path);
+        return;
+    }
+    snprintf(g_cache_root, sizeof(g_cache_root), "%s", path);
+}
+
+/* Put in path the directory name under the cache root, creating it if
+   needed. Returns 0 if caching is off or it is not private. */
+int cache_directory(const char *name, char *path, size_t path_size) {
+    if (!g_cache_root[0])
+        return 0;
+    snprintf(path, path_size, "%s/%s", g_cache_root, name);
+    return private_directory(path);
+}
+
+/* Create a private scratch directory under TEMP_DIR for one conversion, so
+   concurrent jobs never share a clone target or temp files. */
+int create_job_directory(char *path, size_t path_size) {
+    create_directory(TEMP_DIR);
+    snprintf(path, path_size, "%s/job-XXXXXX", TEMP_DIR);
+    return mkdtemp(path) != NULL;
+}
+
 char *extract_repo_name(const char *git_url) {
     const char *last_slash = strrchr(git_url, '/');
     if (!last_slash)
@@ -206,15 +841,31 @@ int validate_github_url(const char *url) {
     return 1;
 }
 
-int verify_github_repo(const char *url) {
+/* Check that the repository exists and resolve its HEAD commit into sha,
+   which must hold at least GIT_SHA_LEN + 1 bytes. */
+int verify_github_repo(const char *url, char *sha) {
 
     if (!validate_github_url(url))
         return 0;
     char command[512];
-    snprintf(command, sizeof(command),
-             "git ls-remote \"%s\" HEAD >/dev/null 2>&1", url);
-    int status = system(command);
-    return (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    snprintf(command, sizeof(command), "git ls-remote \"%s\" HEAD 2>/dev/null",
+             url);
+    FILE *fp = popen(command, "r");
+    if (!fp)
+        return 0;
+
+    char line[256] = "";
+    char *got = fgets(line, sizeof(line), fp);
+    int status = pclose(fp);
+    if (!got || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return 0;
+
+    size_t len = strspn(line, "0123456789abcdef");
+    if (len != GIT_SHA_LEN)
+        return 0;
+    memcpy(sha, line, GIT_SHA_LEN);
+    sha[GIT_SHA_LEN] = '\0';
+    return 1;
 }
 
 int clone_repository(const char *git_url, const char *target_dir) {
@@ -224,6 +875,177 @@ int clone_repository(const char *git_url, const char *target_dir) {
     return (system(command) == 0);
 }
 
+int copy_file(const char *src, const char *dst) {
+    FILE *in = fopen(src, "rb");
+    if (!in)
+        return 0;
+    FILE *out = fopen(dst, "wb");
+    if (!out) {
+        fclose(in);
+        return 0;
+    }
+    char buf[BUFFER_SIZE];
+    size_t n;
+    int ok = 1;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) {
+            ok = 0;
+            break;
+        }
+    }
+    fclose(in);
+    if (fclose(out) != 0)
+        ok = 0;
+    if (!ok)
+        remove(dst);
+    return ok;
+}
+
+/* Place a copy of src at dst, as a hard link when both are on the same file
+   system. */
+int link_or_copy_file(const char *src, const char *dst) {
+    if (link(src, dst) == 0)
+        return 1;
+    return copy_file(src, dst);
+}
+
+/* rename(), falling back to a copy when src and dst are on different file
+   systems. */
+int move_file(const char *src, const char *dst) {
+    if (rename(src, dst) == 0)
+        return 1;
+    if (!link_or_copy_file(src, dst))
+        return 0;
+    remove(src);
+    return 1;
+}
+
+int run_command(const char *command) {
+    int status = system(command);
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/* Derive "<owner>__<repo>" from a validated GitHub URL. */
+int mirror_name_for_url(const char *git_url, char *name, size_t name_size) {
+    const char *path = git_url + strlen("https://github.com/");
+    size_t j = 0;
+    for (size_t i = 0; path[i] && j + 2 < name_size; i++) {
+        if (path[i] == '/') {
+            if (path[i + 1] == '\0')
+                break;
+            name[j++] = '_';
+            name[j++] = '_';
+        } else {
+            name[j++] = path[i];
+        }
+    }
+    name[j] = '\0';
+    if (j >= 4 && strcmp(name + j - 4, ".git") == 0)
+        name[j - 4] = '\0';
+    return name[0] != '\0';
+}
+
+/* Path of the bare mirror kept for git_url. Returns 0 if caching is off. */
+int mirror_path(const char *git_url, char *mirror, size_t mirror_size) {
+    char name[256], dir[MAX_PATH_LEN];
+    if (!mirror_name_for_url(git_url, name, sizeof(name)) ||
+        !cache_directory("mirrors", dir, sizeof(dir)))
+        return 0;
+    snprintf(mirror, mirror_size, "%s/%s.git", dir, name);
+    return 1;
+}
+
+/* Every fetch is shallow and adds objects that later fetches never
+   reuse. After a fetch, git's own thresholds decide whether the mirror is
+   garbage collected; these are the loose object and pack counts. */
+#define MIRROR_GC_LOOSE 2048
+#define MIRROR_GC_PACKS 32
+
+/* Materialize commit sha of git_url into target_dir through a long-lived bare
+   mirror in the cache root. The first request for a repository creates the
+   mirror; later ones fetch only the objects they are missing, or nothing at
+   all when the commit is already present. Fetches are serialized per mirror
+   with flock so concurrent jobs (and processes) can share it; checkouts use a
+   private index file and only read the mirror. A collection keeps the
+   commit the remote HEAD was last fetched at; other commits go once they
+   are an hour old, so jobs still checking them out are not affected. */
+int mirror_checkout(const char *git_url, const char *sha,
+                    const char *target_dir) {
+    char mirror[MAX_PATH_LEN], lock_path[MAX_PATH_LEN];
+    char command[MAX_PATH_LEN * 3];
+
+    if (!mirror_path(git_url, mirror, sizeof(mirror)))
+        return 0;
+    snprintf(lock_path, sizeof(lock_path), "%.*s.lock",
+             (int)(strlen(mirror) - 4), mirror);
+
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0600);
+    if (lock_fd < 0)
+        return 0;
+    flock(lock_fd, LOCK_EX);
+
+    int ok = 1;
+    char head_path[MAX_PATH_LEN];
+    snprintf(head_path, sizeof(head_path), "%s/HEAD", mirror);
+    if (!file_exists(head_path)) {
+        cleanup_directory(mirror);
+        snprintf(command, sizeof(command),
+                 "git init -q --bare \"%s\" && "
+                 "git -C \"%s\" config gc.auto 0 && "
+                 "git -C \"%s\" remote add origin \"%s\"",
+                 mirror, mirror, mirror, git_url);
+        ok = run_command(command);
+    }
+
+    snprintf(command, sizeof(command),
+             "git -C \"%s\" cat-file -e %s^{commit} 2>/dev/null", mirror, sha);
+    if (ok && !run_command(command)) {
+        snprintf(command, sizeof(command),
+                 "git -C \"%s\" fetch -q --depth 1 origin "
+                 "+HEAD:refs/heads/giga-head 2>/dev/null",
+                 mirror);
+        ok = run_command(command);
+
+        /* HEAD may have moved since ls-remote; ask for the commit itself. */
+        snprintf(command, sizeof(command),
+                 "git -C \"%s\" cat-file -e %s^{commit} 2>/dev/null", mirror,
+                 sha);
+        if (ok && !run_command(command)) {
+            snprintf(command, sizeof(command),
+                     "git -C \"%s\" fetch -q --depth 1 origin %s 2>/dev/null",
+                     mirror, sha);
+            ok = run_command(command);
+        }
+        if (ok) {
+            snprintf(command, sizeof(command),
+                     "git -C \"%s\" -c gc.auto=%d -c gc.autoPackLimit=%d "
+                     "-c gc.autoDetach=false gc -q --auto "
+                     "--prune=1.hour.ago 2>/dev/null",
+                     mirror, MIRROR_GC_LOOSE, MIRROR_GC_PACKS);
+            run_command(command);
+        }
+    }
+
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+    if (!ok)
+        return 0;
+
+    create_directory(target_dir);
+    snprintf(command, sizeof(command),
+             "export GIT_INDEX_FILE=\"%s/.giga-index\" && "
+             "git --git-dir=\"%s\" --work-tree=\"%s\" read-tree %s && "
+             "git --git-dir=\"%s\" --work-tree=\"%s\" checkout-index -a -f "
+             "2>/dev/null",
+             target_dir, mirror, target_dir, sha, mirror, target_dir);
+    ok = run_command(command);
+
+    char index_path[MAX_PATH_LEN];
+    snprintf(index_path, sizeof(index_path), "%s/.giga-index", target_dir);
+    remove(index_path);
+    return ok;
+}
+
 int is_c_file(const char *filename) {
     const char *ext = strrchr(filename, '.');
     if (!ext)
@@ -238,35 +1060,9 @@ int is_header_file(const char *filename) {
     return (strcmp(ext, ".h") == 0);
 }
 
-void scan_directory(const char *dir_path, int *c_files, int *header_files) {
-    DIR *dir = opendir(dir_path);
-    if (!dir)
-        return;
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-        if (strcmp(entry->d_name, ".git") == 0)
-            continue;
-
-        if (entry->d_type == DT_REG) {
-            if (is_c_file(entry->d_name))
-                (*c_files)++;
-            else if (is_header_file(entry->d_name))
-                (*header_files)++;
-        } else if (entry->d_type == DT_DIR) {
-            char sub_path[MAX_PATH_LEN];
-            snprintf(sub_path, sizeof(sub_path), "%s/%s", dir_path,
-                     entry->d_name);
-            scan_directory(sub_path, c_files, header_files);
-        }
-    }
-
-    closedir(dir);
-}
-
-char *read_file_content(const char *filepath) {
+/* Read a whole file; *length, if given, receives its size. The content is
+   NUL-terminated either way. */
+char *read_file_bytes(const char *filepath, size_t *length) {
     FILE *file = fopen(filepath, "r");
     if (!file)
         return NULL;
@@ -290,54 +1086,93 @@ char *read_file_content(const char *filepath) {
     content[read_size] = '\0';
     fclose(file);
 
+    if (length)
+        *length = read_size;
     return content;
 }
 
+char *read_file_content(const char *filepath) {
+    return read_file_bytes(filepath, NULL);
+}
+
+/* Process-wide memo of header_exists_on_system answers. Jobs on every
+   worker share it, so it is guarded by a mutex; it is dropped whenever the
+   search paths change and when it grows past MAX_SYSTEM_HEADER_CACHE names,
+   since repositories decide which names get looked up. */
+#define MAX_SYSTEM_HEADER_CACHE 4096
+
+static pthread_mutex_t g_system_headers_lock = PTHREAD_MUTEX_INITIALIZER;
+static Arena g_system_headers_arena;
+static StrSet g_system_headers_found = {.arena = &g_system_headers_arena};
+static StrSet g_system_headers_missing = {.arena = &g_system_headers_arena};
+
+void system_header_cache_invalidate(void) {
+    pthread_mutex_lock(&g_system_headers_lock);
+    strset_free(&g_system_headers_found);
+    strset_free(&g_system_headers_missing);
+    arena_free(&g_system_headers_arena);
+    pthread_mutex_unlock(&g_system_headers_lock);
+}
+
 int header_exists_on_system(const char *header) {
+    pthread_mutex_lock(&g_system_headers_lock);
+    int known = strset_contains(&g_system_headers_found, header)     ? 1
+                : strset_contains(&g_system_headers_missing, header) ? 0
+                                                                     : -1;
+    pthread_mutex_unlock(&g_system_headers_lock);
+    if (known >= 0)
+        return known;
+
     char path[MAX_PATH_LEN];
     struct stat st;
-    for (int i = 0; i < g_system_path_count; i++) {
+    int found = 0;
+    for (int i = 0; i < g_system_path_count && !found; i++) {
         snprintf(path, sizeof(path), "%s/%s", g_system_paths[i], header);
-        if (stat(path, &st) == 0)
-            return 1;
+        found = stat(path, &st) == 0;
     }
-    return 0;
-}
 
-int include_list_contains(char list[][MAX_HEADER_LEN], int count,
-                          const char *item) {
-    for (int i = 0; i < count; i++) {
-        if (strcmp(list[i], item) == 0)
-            return 1;
+    pthread_mutex_lock(&g_system_headers_lock);
+    if (g_system_headers_found.count + g_system_headers_missing.count >=
+        MAX_SYSTEM_HEADER_CACHE) {
+        strset_free(&g_system_headers_found);
+        strset_free(&g_system_headers_missing);
+        arena_free(&g_system_headers_arena);
     }
-    return 0;
+    strset_add(found ? &g_system_headers_found : &g_system_headers_missing,
+               header);
+    pthread_mutex_unlock(&g_system_headers_lock);
+    return found;
 }
 
-void include_list_add(char list[][MAX_HEADER_LEN], int *count,
-                      const char *item) {
-    if (*count >= MAX_INCLUDES)
-        return;
-    if (include_list_contains(list, *count, item))
+ConversionContext *context_create(const char *repo_dir,
+                                  SourceCache *sources) {
+    ConversionContext *ctx = calloc(1, sizeof(ConversionContext));
+    if (!ctx)
+        return NULL;
+    ctx->sources = sources;
+    strset_init(&ctx->standard, &ctx->arena);
+    strset_init(&ctx->external, &ctx->arena);
+    strset_init(&ctx->inlined, &ctx->arena);
+    strncpy(ctx->repo_dir, repo_dir, MAX_PATH_LEN - 1);
+    return ctx;
+}
+
+void context_free(ConversionContext *ctx) {
+    if (!ctx)
         return;
-    strncpy(list[*count], item, MAX_HEADER_LEN - 1);
-    list[*count][MAX_HEADER_LEN - 1] = '\0';
-    (*count)++;
+    strset_free(&ctx->standard);
+    strset_free(&ctx->external);
+    strset_free(&ctx->inlined);
+    arena_free(&ctx->arena);
+    free(ctx);
 }
 
 int is_file_inlined(ConversionContext *ctx, const char *path) {
-    for (int i = 0; i < ctx->inlined_count; i++) {
-        if (strcmp(ctx->inlined[i], path) == 0)
-            return 1;
-    }
-    return 0;
+    return strset_contains(&ctx->inlined, path);
 }
 
 void mark_file_inlined(ConversionContext *ctx, const char *path) {
-    if (ctx->inlined_count >= MAX_FILES)
-        return;
-    strncpy(ctx->inlined[ctx->inlined_count], path, MAX_PATH_LEN - 1);
-    ctx->inlined[ctx->inlined_count][MAX_PATH_LEN - 1] = '\0';
-    ctx->inlined_count++;
+    strset_add(&ctx->inlined, path);
 }
 
 void get_file_directory(const char *filepath, char *dir, size_t dir_size) {
@@ -350,389 +1185,2202 @@ void get_file_directory(const char *filepath, char *dir, size_t dir_size) {
         strncpy(dir, ".", dir_size);
 }
 
-int find_header_in_repo(ConversionContext *ctx, const char *include_path,
-                        const char *current_dir, char *resolved) {
-    char candidate[MAX_PATH_LEN];
-    char real[PATH_MAX];
-
-    const char *search_bases[] = {current_dir, ctx->repo_dir, NULL};
-    const char *sub_dirs[] = {"include", "src", "lib", NULL};
-
-    for (int i = 0; search_bases[i] != NULL; i++) {
-        snprintf(candidate, sizeof(candidate), "%s/%s", search_bases[i],
-                 include_path);
-        if (file_exists(candidate) && realpath(candidate, real)) {
-            strncpy(resolved, real, MAX_PATH_LEN - 1);
-            resolved[MAX_PATH_LEN - 1] = '\0';
-            return 1;
+/* Lexically normalize the relative path in into out: empty and "."
+   components are dropped and ".." removes the previous one. Returns 0 if
+   the path climbs above its starting point or does not fit. */
+int normalize_relative_path(const char *in, char *out, size_t out_size) {
+    size_t len = 0;
+    const char *p = in;
+    while (*p) {
+        const char *slash = strchr(p, '/');
+        size_t part = slash ? (size_t)(slash - p) : strlen(p);
+        if (part == 0 || (part == 1 && p[0] == '.')) {
+            /* nothing */
+        } else if (part == 2 && p[0] == '.' && p[1] == '.') {
+            if (len == 0)
+                return 0;
+            while (len > 0 && out[len - 1] != '/')
+                len--;
+            if (len > 0)
+                len--;
+        } else {
+            if (len + (len > 0) + part + 1 > out_size)
+                return 0;
+            if (len > 0)
+                out[len++] = '/';
+            memcpy(out + len, p, part);
+            len += part;
+        }
+        p += part;
+        if (*p == '/')
+            p++;
+    }
+    if (out_size == 0)
+        return 0;
+    out[len] = '\0';
+    return 1;
+}
+
+/* Start an empty index for the repository at repo_dir. */
+void header_index_init(HeaderIndex *index, Arena *arena,
+                       const char *repo_dir) {
+    strset_init(&index->paths, arena);
+    if (!realpath(repo_dir, index->root))
+        index->root[0] = '\0';
+}
+
+void header_index_add(HeaderIndex *index, const char *rel,
+                      const char *canonical) {
+    if (!strset_add(&index->paths, rel))
+        return;
+    int i = index->paths.count - 1;
+    if (i >= index->capacity) {
+        int capacity = index->capacity ? index->capacity * 2 : 256;
+        const char **grown =
+            realloc(index->canonical, capacity * sizeof(*grown));
+        if (!grown) {
+            index->paths.count--; /* keep the parallel arrays in step */
+            return;
         }
+        index->canonical = grown;
+        index->capacity = capacity;
     }
+    index->canonical[i] = arena_strdup(index->paths.arena, canonical);
+    /* A sum, so the id does not depend on the order the walk found files. */
+    index->file_set_id += hash_bytes(hash_string(rel), canonical,
+                                     strlen(canonical));
+}
+
+/* Look up dir/name (dir relative to the root, possibly empty) in the index
+   and copy the canonical path to resolved. */
+int header_index_find(HeaderIndex *index, const char *dir, const char *name,
+                      char *resolved) {
+    char joined[MAX_PATH_LEN], rel[MAX_PATH_LEN];
+    snprintf(joined, sizeof(joined), "%s%s%s", dir, *dir ? "/" : "", name);
+    if (!normalize_relative_path(joined, rel, sizeof(rel)))
+        return 0;
+    int i = strset_index(&index->paths, rel);
+    if (i < 0 || !index->canonical[i])
+        return 0;
+    strncpy(resolved, index->canonical[i], MAX_PATH_LEN - 1);
+    resolved[MAX_PATH_LEN - 1] = '\0';
+    return 1;
+}
+
+/* Resolve a quoted include the way the compiler would be asked to: next to
+   the including file, then at the repository root and its include/, src/
+   and lib/ directories. Lookups go through the job's header index; the
+   disk is only consulted for a directory outside the indexed tree. */
+int find_header_in_repo(ConversionContext *ctx, const char *include_path,
+                        const char *current_dir, char *resolved) {
+    HeaderIndex *index = &ctx->sources->headers;
+    const char *sub_dirs[] = {"", "include", "src", "lib", NULL};
 
-    for (int i = 0; sub_dirs[i] != NULL; i++) {
-        snprintf(candidate, sizeof(candidate), "%s/%s/%s", ctx->repo_dir,
-                 sub_dirs[i], include_path);
-        if (file_exists(candidate) && realpath(candidate, real)) {
-            strncpy(resolved, real, MAX_PATH_LEN - 1);
-            resolved[MAX_PATH_LEN - 1] = '\0';
+    if (index->root[0]) {
+        size_t root_len = strlen(index->root);
+        const char *rel_dir = NULL;
+        if (strncmp(current_dir, index->root, root_len) == 0 &&
+            (current_dir[root_len] == '/' || current_dir[root_len] == '\0'))
+            rel_dir = current_dir + root_len + (current_dir[root_len] == '/');
+
+        if (rel_dir && header_index_find(index, rel_dir, include_path, resolved))
             return 1;
+        if (!rel_dir) {
+            char candidate[MAX_PATH_LEN];
+            char real[PATH_MAX];
+            snprintf(candidate, sizeof(candidate), "%s/%s", current_dir,
+                     include_path);
+            if (file_exists(candidate) && realpath(candidate, real)) {
+                strncpy(resolved, real, MAX_PATH_LEN - 1);
+                resolved[MAX_PATH_LEN - 1] = '\0';
+                return 1;
+            }
+        }
+        for (int i = 0; sub_dirs[i] != NULL; i++) {
+            if (header_index_find(index, sub_dirs[i], include_path, resolved))
+                return 1;
         }
     }
 
     return 0;
 }
 
-IncludeType parse_include_line(const char *line, char *header,
+/* Classify the line [line, line + len), which need not be NUL-terminated. */
+IncludeType parse_include_line(const char *line, size_t len, char *header,
                                size_t header_size) {
     const char *p = line;
-    while (*p == ' ' || *p == '\t')
+    const char *end = line + len;
+    while (p < end && (*p == ' ' || *p == '\t'))
         p++;
 
-    if (*p != '#')
+    if (p == end || *p != '#')
         return INCLUDE_NONE;
     p++;
-    while (*p == ' ' || *p == '\t')
+    while (p < end && (*p == ' ' || *p == '\t'))
         p++;
 
-    if (((strncmp(p, "ifdef", 5) == 0) && isspace(p[5])) ||
-        ((strncmp(p, "ifndef", 6) == 0) && isspace(p[6])) ||
-        ((strncmp(p, "if", 2) == 0) && isspace(p[2]))) {
-
-        const char *macro_start = p;
-        while (*macro_start && !isspace(*macro_start))
-            macro_start++;
-        while (*macro_start == ' ' || *macro_start == '\t')
-            macro_start++;
-        const char *known[] = {"_WIN32",    "__linux__",   "__APPLE__",
-                               "__unix__",  "__cplusplus", "__GNUC__",
-                               "__clang__", "_MSC_VER",    "NDEBUG",
-                               "DEBUG",     NULL};
-        for (int i = 0; known[i]; ++i) {
-            size_t len = strlen(known[i]);
-            if (strncmp(macro_start, known[i], len) == 0 &&
-                !isalnum(macro_start[len]) && macro_start[len] != '_') {
-                return INCLUDE_IF;
-            }
-        }
-        return INCLUDE_NONE;
-    }
-
-    if ((strncmp(p, "endif", 5) == 0)) {
-        return INCLUDE_ENDIF;
+    const char *word = p;
+    while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+        p++;
+    size_t word_len = (size_t)(p - word);
+    const struct {
+        const char *word;
+        IncludeType type;
+    } conditionals[] = {
+        {"if", INCLUDE_IF},        {"ifdef", INCLUDE_IF},
+        {"ifndef", INCLUDE_IF},    {"elif", INCLUDE_ELSE},
+        {"elifdef", INCLUDE_ELSE}, {"elifndef", INCLUDE_ELSE},
+        {"else", INCLUDE_ELSE},    {"endif", INCLUDE_ENDIF},
+        {"define", INCLUDE_DEFINE}, {"undef", INCLUDE_DEFINE},
+    };
+    for (size_t i = 0; i < sizeof(conditionals) / sizeof(conditionals[0]);
+         i++) {
+        if (strlen(conditionals[i].word) == word_len &&
+            strncmp(word, conditionals[i].word, word_len) == 0)
+            return conditionals[i].type;
     }
+    p = word;
 
-    if (strncmp(p, "include", 7) != 0)
+    if ((size_t)(end - p) < 7 || strncmp(p, "include", 7) != 0)
         return INCLUDE_NONE;
     p += 7;
-    while (*p == ' ' || *p == '\t')
+    while (p < end && (*p == ' ' || *p == '\t'))
         p++;
 
-    char open_char, close_char;
+    char close_char;
     int type;
-    if (*p == '"') {
-        open_char = '"';
+    if (p < end && *p == '"') {
         close_char = '"';
         type = INCLUDE_LOCAL;
-    } else if (*p == '<') {
-        open_char = '<';
+    } else if (p < end && *p == '<') {
         close_char = '>';
         type = INCLUDE_SYSTEM;
     } else {
         return INCLUDE_NONE;
     }
-    (void)open_char;
 
     p++;
-    const char *end = strchr(p, close_char);
-    if (!end)
+    const char *close = memchr(p, close_char, (size_t)(end - p));
+    if (!close)
         return INCLUDE_NONE;
 
-    size_t len = (size_t)(end - p);
-    if (len >= header_size)
-        len = header_size - 1;
-    memcpy(header, p, len);
-    header[len] = '\0';
+    size_t name_len = (size_t)(close - p);
+    if (name_len >= header_size)
+        name_len = header_size - 1;
+    memcpy(header, p, name_len);
+    header[name_len] = '\0';
     return type;
 }
 
-void process_file_with_context(ConversionContext *ctx, const char *filepath,
-                               FILE *output) {
-    char *content = read_file_content(filepath);
-    if (!content)
-        return;
-
-    char file_dir[MAX_PATH_LEN];
-    get_file_directory(filepath, file_dir, sizeof(file_dir));
+/* Copy the directive at [line, end) into keyword and, with continuations
+   joined and comments blanked, its operands into text. Returns 0 if either
+   does not fit. */
+int directive_text(const char *line, const char *end, char *keyword,
+                   size_t keyword_size, char *text, size_t text_size) {
+    const char *p = memchr(line, '#', (size_t)(end - line));
+    if (!p)
+        return 0;
+    p++;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    size_t k = 0;
+    while (p < end && (isalnum((unsigned char)*p) || *p == '_')) {
+        if (k + 1 >= keyword_size)
+            return 0;
+        keyword[k++] = *p++;
+    }
+    keyword[k] = '\0';
 
-    char *pos = content;
-    int pp_depth = 0;
+    size_t n = 0;
+    while (p < end && *p != '\n') {
+        if (*p == '\\' && (p + 1 < end && p[1] == '\n')) {
+            p += 2;
+            continue;
+        }
+        if (*p == '\\' && p + 2 < end && p[1] == '\r' && p[2] == '\n') {
+            p += 3;
+            continue;
+        }
+        if (*p == '/' && p + 1 < end && p[1] == '/')
+            break;
+        char c = *p++;
+        if (c == '/' && p < end && *p == '*') {
+            const char *close = memmem(p + 1, (size_t)(end - p - 1), "*/", 2);
+            p = close ? close + 2 : end;
+            c = ' ';
+        } else if (c == '\r') {
+            continue;
+        }
+        if (n + 1 >= text_size)
+            return 0;
+        text[n++] = c;
+    }
+    while (n > 0 && isspace((unsigned char)text[n - 1]))
+        n--;
+    text[n] = '\0';
+    return 1;
+}
 
-    while (*pos) {
-        char *newline = strchr(pos, '\n');
-        size_t line_len = newline ? (size_t)(newline - pos) : strlen(pos);
+typedef enum {
+    MACRO_UNSEEN = 0, /* never defined or undefined in this file */
+    MACRO_DEFINED,
+    MACRO_UNDEFINED,
+    MACRO_UNSURE /* changed under a condition that could not be decided */
+} MacroState;
 
-        char line[4096];
-        if (line_len >= sizeof(line))
-            line_len = sizeof(line) - 1;
-        memcpy(line, pos, line_len);
-        line[line_len] = '\0';
+/* Macros a file defines, as seen while its directives are evaluated. */
+typedef struct {
+    StrSet names;
+    MacroState *states;
+    const char **bodies; /* NULL for function-like macros */
+    int capacity;
+    Arena arena;
+} MacroTable;
+
+MacroState macro_get(MacroTable *macros, const char *name, const char **body) {
+    int i = strset_index(&macros->names, name);
+    if (i < 0)
+        return MACRO_UNSEEN;
+    if (body)
+        *body = macros->bodies[i];
+    return macros->states[i];
+}
 
-        char header[MAX_HEADER_LEN];
-        int include_type = parse_include_line(line, header, sizeof(header));
-        if (include_type == INCLUDE_IF) {
-            pp_depth++;
-        } else if (include_type == INCLUDE_ENDIF && pp_depth > 0) {
-            pp_depth--;
-        }
-
-        if (include_type == INCLUDE_LOCAL && pp_depth == 0) {
-            char resolved[MAX_PATH_LEN];
-            if (find_header_in_repo(ctx, header, file_dir, resolved)) {
-                if (!is_file_inlined(ctx, resolved)) {
-                    mark_file_inlined(ctx, resolved);
-                    fprintf(output, "\n/* --- Inlined: %s --- */\n", header);
-                    process_file_with_context(ctx, resolved, output);
-                    fprintf(output, "/* --- End: %s --- */\n\n", header);
-                }
-            } else {
-                if (header_exists_on_system(header))
-                    include_list_add(ctx->standard, &ctx->standard_count,
-                                     header);
-                else
-                    include_list_add(ctx->external, &ctx->external_count,
-                                     header);
+void macro_set(MacroTable *macros, const char *name, MacroState state,
+               const char *body) {
+    int i = strset_index(&macros->names, name);
+    if (i < 0) {
+        if (!strset_add(&macros->names, name))
+            return;
+        i = macros->names.count - 1;
+        if (i >= macros->capacity) {
+            int capacity = macros->capacity ? macros->capacity * 2 : 64;
+            MacroState *states =
+                realloc(macros->states, capacity * sizeof(*states));
+            if (states)
+                macros->states = states;
+            const char **bodies =
+                realloc(macros->bodies, capacity * sizeof(*bodies));
+            if (bodies)
+                macros->bodies = bodies;
+            if (!states || !bodies) {
+                macros->names.count--; /* keep the arrays in step */
+                return;
             }
-        } else if (include_type == INCLUDE_SYSTEM && pp_depth == 0) {
-            if (header_exists_on_system(header))
-                include_list_add(ctx->standard, &ctx->standard_count, header);
-            else
-                include_list_add(ctx->external, &ctx->external_count, header);
-        } else {
-            fprintf(output, "%s\n", line);
+            macros->capacity = capacity;
         }
-
-        pos = newline ? newline + 1 : pos + line_len;
     }
+    macros->states[i] = state;
+    macros->bodies[i] = body ? arena_strdup(&macros->arena, body) : NULL;
+}
 
-    free(content);
+/* A value of a preprocessor expression; known is 0 when it depends on
+   something the file does not decide. */
+typedef struct {
+    long long value;
+    int known;
+} PPValue;
+
+typedef struct {
+    const char *p;
+    MacroTable *macros;
+    int depth; /* macro expansion depth, to stop runaway recursion */
+    int failed;
+} PPParser;
+
+#define MAX_MACRO_EXPANSION 16
+
+static const PPValue pp_unknown = {0, 0};
+
+PPValue pp_expression(PPParser *pp);
+
+void pp_skip_space(PPParser *pp) {
+    while (isspace((unsigned char)*pp->p))
+        pp->p++;
 }
 
-void collect_source_files(const char *dir_path, FileList *c_files,
-                          FileList *h_files) {
-    DIR *dir = opendir(dir_path);
-    if (!dir)
-        return;
+/* Read an identifier at pp->p into name. Returns 0 if there is none. */
+int pp_identifier(PPParser *pp, char *name, size_t name_size) {
+    pp_skip_space(pp);
+    const char *start = pp->p;
+    if (!isalpha((unsigned char)*start) && *start != '_')
+        return 0;
+    while (isalnum((unsigned char)*pp->p) || *pp->p == '_')
+        pp->p++;
+    size_t len = (size_t)(pp->p - start);
+    if (len >= name_size)
+        return 0;
+    memcpy(name, start, len);
+    name[len] = '\0';
+    return 1;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-        if (strcmp(entry->d_name, ".git") == 0)
-            continue;
+/* Value of a macro used in an expression: its body evaluated in turn, 0 if
+   the file undefined it, unknown otherwise. */
+PPValue pp_macro_value(PPParser *pp, const char *name) {
+    const char *body = NULL;
+    MacroState state = macro_get(pp->macros, name, &body);
+    if (state == MACRO_UNDEFINED)
+        return (PPValue){0, 1};
+    if (state != MACRO_DEFINED || !body || !*body ||
+        pp->depth >= MAX_MACRO_EXPANSION)
+        return pp_unknown;
+
+    PPParser inner = {body, pp->macros, pp->depth + 1, 0};
+    PPValue value = pp_expression(&inner);
+    pp_skip_space(&inner);
+    if (inner.failed || *inner.p)
+        return pp_unknown;
+    return value;
+}
 
-        char path[MAX_PATH_LEN];
-        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+PPValue pp_unary(PPParser *pp) {
+    pp_skip_space(pp);
+    char c = *pp->p;
+    if (c == '!' || c == '~' || c == '-' || c == '+') {
+        pp->p++;
+        PPValue v = pp_unary(pp);
+        if (!v.known)
+            return v;
+        if (c == '!')
+            v.value = !v.value;
+        else if (c == '~')
+            v.value = ~v.value;
+        else if (c == '-')
+            v.value = (long long)(0ULL - (unsigned long long)v.value);
+        return v;
+    }
+    if (c == '(') {
+        pp->p++;
+        PPValue v = pp_expression(pp);
+        pp_skip_space(pp);
+        if (*pp->p != ')') {
+            pp->failed = 1;
+            return pp_unknown;
+        }
+        pp->p++;
+        return v;
+    }
+    if (isdigit((unsigned char)c)) {
+        char *end;
+        errno = 0;
+        unsigned long long v = strtoull(pp->p, &end, 0);
+        pp->p = end;
+        while (*pp->p == 'u' || *pp->p == 'U' || *pp->p == 'l' ||
+               *pp->p == 'L')
+            pp->p++;
+        if (errno || isalnum((unsigned char)*pp->p) || *pp->p == '.') {
+            pp->failed = 1;
+            return pp_unknown;
+        }
+        return (PPValue){(long long)v, 1};
+    }
+    if (c == '\'') {
+        /* Only plain one-character literals; escapes are left unknown. */
+        if (pp->p[1] && pp->p[1] != '\\' && pp->p[1] != '\'' &&
+            pp->p[2] == '\'') {
+            long long v = (unsigned char)pp->p[1];
+            pp->p += 3;
+            return (PPValue){v, 1};
+        }
+        pp->failed = 1;
+        return pp_unknown;
+    }
 
-        if (entry->d_type == DT_REG) {
-            char real[PATH_MAX];
-            if (is_c_file(entry->d_name) && c_files->count < MAX_FILES) {
-                if (realpath(path, real)) {
-                    strncpy(c_files->paths[c_files->count], real,
-                            MAX_PATH_LEN - 1);
-                    c_files->paths[c_files->count][MAX_PATH_LEN - 1] = '\0';
-                    c_files->count++;
-                }
-            } else if (is_header_file(entry->d_name) &&
-                       h_files->count < MAX_FILES) {
-                if (realpath(path, real)) {
-                    strncpy(h_files->paths[h_files->count], real,
-                            MAX_PATH_LEN - 1);
-                    h_files->paths[h_files->count][MAX_PATH_LEN - 1] = '\0';
-                    h_files->count++;
-                }
-            }
-        } else if (entry->d_type == DT_DIR) {
-            collect_source_files(path, c_files, h_files);
+    char name[256];
+    if (!pp_identifier(pp, name, sizeof(name))) {
+        pp->failed = 1;
+        return pp_unknown;
+    }
+    if (strcmp(name, "defined") == 0) {
+        pp_skip_space(pp);
+        int paren = *pp->p == '(';
+        if (paren)
+            pp->p++;
+        if (!pp_identifier(pp, name, sizeof(name))) {
+            pp->failed = 1;
+            return pp_unknown;
+        }
+        pp_skip_space(pp);
+        if (paren && *pp->p++ != ')') {
+            pp->failed = 1;
+            return pp_unknown;
         }
+        MacroState state = macro_get(pp->macros, name, NULL);
+        if (state == MACRO_DEFINED)
+            return (PPValue){1, 1};
+        if (state == MACRO_UNDEFINED)
+            return (PPValue){0, 1};
+        return pp_unknown;
     }
 
-    closedir(dir);
+    pp_skip_space(pp);
+    if (*pp->p == '(') {
+        /* A function-like macro call: skip its arguments. */
+        int depth = 0;
+        do {
+            if (*pp->p == '(')
+                depth++;
+            else if (*pp->p == ')')
+                depth--;
+            else if (!*pp->p) {
+                pp->failed = 1;
+                return pp_unknown;
+            }
+            pp->p++;
+        } while (depth > 0);
+        return pp_unknown;
+    }
+    return pp_macro_value(pp, name);
 }
 
-void remove_from_filelist(FileList *list, const char *path) {
-    for (int i = 0; i < list->count; i++) {
-        if (strcmp(list->paths[i], path) == 0) {
-            for (int j = i; j < list->count - 1; j++)
-                strncpy(list->paths[j], list->paths[j + 1], MAX_PATH_LEN);
-            list->count--;
-            return;
+/* Binary operators by precedence, longest spelling first where one is a
+   prefix of another. */
+static const struct {
+    const char *op;
+    int prec;
+} pp_operators[] = {
+    {"||", 1}, {"&&", 2}, {"==", 6}, {"!=", 6}, {"<=", 7}, {">=", 7},
+    {"<<", 8}, {">>", 8}, {"|", 3},  {"^", 4},  {"&", 5},  {"<", 7},
+    {">", 7},  {"+", 9},  {"-", 9},  {"*", 10}, {"/", 10}, {"%", 10},
+};
+
+PPValue pp_apply(const char *op, PPValue a, PPValue b) {
+    if (strcmp(op, "&&") == 0) {
+        if ((a.known && !a.value) || (b.known && !b.value))
+            return (PPValue){0, 1};
+        return a.known && b.known ? (PPValue){1, 1} : pp_unknown;
+    }
+    if (strcmp(op, "||") == 0) {
+        if ((a.known && a.value) || (b.known && b.value))
+            return (PPValue){1, 1};
+        return a.known && b.known ? (PPValue){0, 1} : pp_unknown;
+    }
+    if (!a.known || !b.known)
+        return pp_unknown;
+
+    unsigned long long x = (unsigned long long)a.value;
+    unsigned long long y = (unsigned long long)b.value;
+    long long v;
+    switch (op[0]) {
+    case '|':
+        v = (long long)(x | y);
+        break;
+    case '^':
+        v = (long long)(x ^ y);
+        break;
+    case '&':
+        v = (long long)(x & y);
+        break;
+    case '=':
+        v = a.value == b.value;
+        break;
+    case '!':
+        v = a.value != b.value;
+        break;
+    case '<':
+    case '>':
+        if (op[1] == op[0]) {
+            if (b.value < 0 || b.value > 63)
+                return pp_unknown;
+            v = op[0] == '<' ? (long long)(x << b.value) : a.value >> b.value;
+        } else if (op[0] == '<') {
+            v = op[1] == '=' ? a.value <= b.value : a.value < b.value;
+        } else {
+            v = op[1] == '=' ? a.value >= b.value : a.value > b.value;
         }
+        break;
+    case '+':
+        v = (long long)(x + y);
+        break;
+    case '-':
+        v = (long long)(x - y);
+        break;
+    case '*':
+        v = (long long)(x * y);
+        break;
+    default: /* '/' and '%' */
+        if (b.value == 0 || (a.value == LLONG_MIN && b.value == -1))
+            return pp_unknown;
+        v = op[0] == '/' ? a.value / b.value : a.value % b.value;
+        break;
     }
+    return (PPValue){v, 1};
 }
 
-int try_compile(const char *header_path, char *error_buf, size_t error_size) {
-    char command[MAX_PATH_LEN + 64];
-    snprintf(command, sizeof(command), "gcc -fsyntax-only -x c \"%s\" 2>&1",
-             header_path);
+PPValue pp_binary(PPParser *pp, int min_prec) {
+    PPValue lhs = pp_unary(pp);
+    while (!pp->failed) {
+        pp_skip_space(pp);
+        size_t i, count = sizeof(pp_operators) / sizeof(pp_operators[0]);
+        for (i = 0; i < count; i++) {
+            size_t len = strlen(pp_operators[i].op);
+            if (strncmp(pp->p, pp_operators[i].op, len) == 0)
+                break;
+        }
+        if (i == count || pp_operators[i].prec < min_prec)
+            break;
+        pp->p += strlen(pp_operators[i].op);
+        PPValue rhs = pp_binary(pp, pp_operators[i].prec + 1);
+        lhs = pp_apply(pp_operators[i].op, lhs, rhs);
+    }
+    return lhs;
+}
 
-    FILE *fp = popen(command, "r");
-    if (!fp) {
-        error_buf[0] = '\0';
-        return -1;
+PPValue pp_expression(PPParser *pp) {
+    PPValue cond = pp_binary(pp, 1);
+    pp_skip_space(pp);
+    if (pp->failed || *pp->p != '?')
+        return cond;
+    pp->p++;
+    PPValue a = pp_expression(pp);
+    pp_skip_space(pp);
+    if (*pp->p != ':') {
+        pp->failed = 1;
+        return pp_unknown;
     }
+    pp->p++;
+    PPValue b = pp_expression(pp);
+    if (cond.known)
+        return cond.value ? a : b;
+    if (a.known && b.known && a.value == b.value)
+        return a;
+    return pp_unknown;
+}
 
-    size_t total = 0;
-    char buf[512];
-    while (fgets(buf, sizeof(buf), fp)) {
-        size_t len = strlen(buf);
-        if (total + len < error_size - 1) {
-            memcpy(error_buf + total, buf, len);
-            total += len;
+typedef enum { COND_FALSE, COND_TRUE, COND_UNKNOWN } CondResult;
+
+/* Decide the condition of an #if, #ifdef, #elif, ... whose operands are
+   text. #else is always true. */
+CondResult evaluate_condition(const char *keyword, const char *text,
+                              MacroTable *macros) {
+    if (strcmp(keyword, "else") == 0)
+        return COND_TRUE;
+    if (strstr(keyword, "def")) {
+        PPParser pp = {text, macros, 0, 0};
+        char name[256];
+        if (!pp_identifier(&pp, name, sizeof(name)))
+            return COND_UNKNOWN;
+        MacroState state = macro_get(macros, name, NULL);
+        if (state != MACRO_DEFINED && state != MACRO_UNDEFINED)
+            return COND_UNKNOWN;
+        int defined = state == MACRO_DEFINED;
+        int negated = strstr(keyword, "ndef") != NULL;
+        return defined != negated ? COND_TRUE : COND_FALSE;
+    }
+
+    PPParser pp = {text, macros, 0, 0};
+    PPValue v = pp_expression(&pp);
+    pp_skip_space(&pp);
+    if (pp.failed || *pp.p || !v.known)
+        return COND_UNKNOWN;
+    return v.value ? COND_TRUE : COND_FALSE;
+}
+
+/* The macro an include guard opening with this directive would define:
+   "#ifndef X" or "#if !defined(X)". */
+int guard_macro(const char *keyword, const char *text, char *name,
+                size_t name_size) {
+    PPParser pp = {text, NULL, 0, 0};
+    if (strcmp(keyword, "if") == 0) {
+        pp_skip_space(&pp);
+        if (*pp.p++ != '!' || !pp_identifier(&pp, name, name_size) ||
+            strcmp(name, "defined") != 0)
+            return 0;
+        pp_skip_space(&pp);
+        int paren = *pp.p == '(';
+        if (paren)
+            pp.p++;
+        if (!pp_identifier(&pp, name, name_size))
+            return 0;
+        pp_skip_space(&pp);
+        if (paren && *pp.p++ != ')')
+            return 0;
+    } else if (strcmp(keyword, "ifndef") != 0 ||
+               !pp_identifier(&pp, name, name_size)) {
+        return 0;
+    }
+    pp_skip_space(&pp);
+    return *pp.p == '\0';
+}
+
+typedef struct {
+    Reach parent;
+    int taken;       /* an earlier branch was certainly taken */
+    int maybe_taken; /* an earlier branch may have been taken */
+} CondFrame;
+
+/* Work out which stretches of sf are compiled by following its
+   conditionals, #defines and #undefs in order. Only what the file itself
+   decides is known: an include guard counts as taken, and conditions on
+   macros the file never sets are unknown. */
+void source_evaluate(SourceFile *sf) {
+    MacroTable macros;
+    memset(&macros, 0, sizeof(macros));
+    strset_init(&macros.names, &macros.arena);
+    CondFrame *stack = NULL;
+    int depth = 0, stack_capacity = 0, seen_conditional = 0;
+    Reach reach = REACH_LIVE;
+
+    char keyword[16], text[4096], name[256];
+    for (int i = 0; i < sf->directive_count; i++) {
+        Directive *d = &sf->directives[i];
+        d->reach = reach;
+        if (d->type == INCLUDE_LOCAL || d->type == INCLUDE_SYSTEM) {
+            d->body = reach;
+            continue;
+        }
+
+        int parsed = directive_text(sf->data + d->start, sf->data + d->next,
+                                    keyword, sizeof(keyword), text,
+                                    sizeof(text));
+        if (d->type == INCLUDE_DEFINE) {
+            PPParser pp = {text, &macros, 0, 0};
+            if (reach != REACH_DEAD && parsed &&
+                pp_identifier(&pp, name, sizeof(name))) {
+                if (reach == REACH_UNKNOWN)
+                    macro_set(&macros, name, MACRO_UNSURE, NULL);
+                else if (strcmp(keyword, "undef") == 0)
+                    macro_set(&macros, name, MACRO_UNDEFINED, NULL);
+                else if (*pp.p == '(')
+                    macro_set(&macros, name, MACRO_DEFINED, NULL);
+                else
+                    macro_set(&macros, name, MACRO_DEFINED, pp.p);
+            }
+        } else if (d->type == INCLUDE_IF) {
+            if (depth == stack_capacity) {
+                stack_capacity = stack_capacity ? stack_capacity * 2 : 16;
+                CondFrame *grown =
+                    realloc(stack, stack_capacity * sizeof(*stack));
+                if (!grown)
+                    break;
+                stack = grown;
+            }
+            CondResult cond = COND_UNKNOWN;
+            if (parsed && !seen_conditional && i + 1 < sf->directive_count &&
+                sf->directives[i + 1].type == INCLUDE_DEFINE &&
+                guard_macro(keyword, text, name, sizeof(name))) {
+                /* An include guard. The generator inlines each file once,
+                   so its guarded region is always compiled. */
+                char next_keyword[16], next_text[sizeof(text)], guard[256];
+                Directive *def = &sf->directives[i + 1];
+                PPParser pp = {next_text, NULL, 0, 0};
+                if (directive_text(sf->data + def->start,
+                                   sf->data + def->next, next_keyword,
+                                   sizeof(next_keyword), next_text,
+                                   sizeof(next_text)) &&
+                    strcmp(next_keyword, "define") == 0 &&
+                    pp_identifier(&pp, guard, sizeof(guard)) &&
+                    strcmp(guard, name) == 0)
+                    cond = COND_TRUE;
+            }
+            if (cond == COND_UNKNOWN && parsed)
+                cond = evaluate_condition(keyword, text, &macros);
+            seen_conditional = 1;
+
+            CondFrame *frame = &stack[depth++];
+            frame->parent = reach;
+            frame->taken = cond == COND_TRUE;
+            frame->maybe_taken = cond != COND_FALSE;
+            reach = reach == REACH_DEAD || cond == COND_FALSE ? REACH_DEAD
+                    : cond == COND_UNKNOWN                   ? REACH_UNKNOWN
+                                                             : reach;
+        } else if (d->type == INCLUDE_ELSE && depth > 0) {
+            CondFrame *frame = &stack[depth - 1];
+            d->reach = frame->parent;
+            CondResult cond = frame->taken ? COND_FALSE
+                              : parsed ? evaluate_condition(keyword, text,
+                                                            &macros)
+                                       : COND_UNKNOWN;
+            if (frame->parent == REACH_DEAD || cond == COND_FALSE)
+                reach = REACH_DEAD;
+            else if (cond == COND_UNKNOWN || frame->maybe_taken)
+                reach = REACH_UNKNOWN;
+            else
+                reach = frame->parent;
+            if (cond == COND_TRUE)
+                frame->taken = 1;
+            if (cond != COND_FALSE)
+                frame->maybe_taken = 1;
+        } else if (d->type == INCLUDE_ENDIF && depth > 0) {
+            reach = stack[--depth].parent;
+            d->reach = reach;
         }
+        d->body = reach;
     }
-    error_buf[total] = '\0';
 
-    int status = pclose(fp);
-    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    free(stack);
+    strset_free(&macros.names);
+    free(macros.states);
+    free(macros.bodies);
+    arena_free(&macros.arena);
 }
 
-int find_conflicting_source(const char *error_output, LineMap *map,
-                            char *source_path, size_t path_size) {
-    const char *patterns[] = {"redefinition of", "conflicting types", NULL};
-    const char *found = NULL;
+/* Load path into sf. Files are mapped privately when the page tail past the
+   end of the file provides the terminating NUL; files that end exactly on a
+   page boundary, and empty files, are read into the heap instead. */
+void source_file_load(SourceFile *sf, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+
+    size_t size = (size_t)st.st_size;
+    long page = sysconf(_SC_PAGESIZE);
+    if (size > 0 && page > 0 && size % (size_t)page != 0) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, size, MADV_SEQUENTIAL);
+            close(fd);
+            sf->data = map;
+            sf->size = size;
+            sf->map_size = size;
+            return;
+        }
+    }
 
-    for (int i = 0; patterns[i]; i++) {
-        found = strstr(error_output, patterns[i]);
-        if (found)
+    char *data = malloc(size + 1);
+    size_t got = 0;
+    while (data && got < size) {
+        ssize_t n = read(fd, data + got, size - got);
+        if (n <= 0)
             break;
+        got += (size_t)n;
     }
-    if (!found)
-        return 0;
+    close(fd);
+    if (!data)
+        return;
+    data[got] = '\0';
+    sf->data = data;
+    sf->size = got;
+}
 
-    /* Walk backwards from the pattern match to find the line number.
-       gcc format: "file.h:LINE:COL: error: ..." */
-    const char *line_start = found;
-    while (line_start > error_output && *(line_start - 1) != '\n')
-        line_start--;
+/* Record the directives in sf. Only lines whose first non-blank character
+   is '#' are looked at, and memchr finds those without touching the bytes
+   in between. */
+void source_index(SourceFile *sf, Arena *arena) {
+    const char *data = sf->data;
+    const char *end = data + sf->size;
+    const char *p = data;
+    int capacity = 0;
+
+    while (p < end && (p = memchr(p, '#', (size_t)(end - p))) != NULL) {
+        const char *line = p;
+        while (line > data && (line[-1] == ' ' || line[-1] == '\t'))
+            line--;
+        if (line > data && line[-1] != '\n') {
+            p++;
+            continue;
+        }
+        const char *newline = memchr(p, '\n', (size_t)(end - p));
+        const char *line_end = newline ? newline : end;
 
-    /* Extract line number: skip filename, then parse number after first colon
-     */
-    const char *first_colon = strchr(line_start, ':');
-    if (!first_colon)
-        return 0;
-    int error_line = atoi(first_colon + 1);
-    if (error_line <= 0)
-        return 0;
+        char header[MAX_HEADER_LEN];
+        IncludeType type = parse_include_line(line, (size_t)(line_end - line),
+                                              header, sizeof(header));
+        /* A directive runs on over backslash-continued lines. */
+        while (newline && (newline[-1] == '\\' ||
+                           (newline[-1] == '\r' && newline - 1 > p &&
+                            newline[-2] == '\\')))
+            newline = memchr(newline + 1, '\n', (size_t)(end - newline - 1));
+        const char *next = newline ? newline + 1 : end;
+        p = next;
+        if (type == INCLUDE_NONE)
+            continue;
 
-    /* Look up which source file owns this line */
-    for (int i = 0; i < map->count; i++) {
-        if (error_line >= map->entries[i].start_line &&
-            error_line <= map->entries[i].end_line) {
-            strncpy(source_path, map->entries[i].source, path_size - 1);
-            source_path[path_size - 1] = '\0';
-            return 1;
+        if (sf->directive_count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            Directive *grown =
+                realloc(sf->directives, capacity * sizeof(*grown));
+            if (!grown)
+                return;
+            sf->directives = grown;
         }
+        Directive *d = &sf->directives[sf->directive_count++];
+        memset(d, 0, sizeof(*d));
+        d->start = (size_t)(line - data);
+        d->next = (size_t)(next - data);
+        d->type = type;
+        if (type == INCLUDE_LOCAL || type == INCLUDE_SYSTEM)
+            d->header = arena_strdup(arena, header);
     }
-    return 0;
+    source_evaluate(sf);
 }
 
-/* Strategy 1: Parse build system files to find library sources */
-FileList filter_by_build_system(const char *repo_dir, FileList *all_c) {
-    FileList result;
-    memset(&result, 0, sizeof(result));
+SourceFile **source_cache_slot(SourceCache *cache, const char *path) {
+    size_t mask = cache->capacity - 1;
+    size_t i = (size_t)hash_string(path) & mask;
+    while (cache->slots[i] && strcmp(cache->slots[i]->path, path) != 0)
+        i = (i + 1) & mask;
+    return &cache->slots[i];
+}
 
-    char path[MAX_PATH_LEN];
-    char *content = NULL;
+int source_cache_grow(SourceCache *cache) {
+    size_t old_capacity = cache->capacity;
+    SourceFile **old = cache->slots;
+    size_t capacity = old_capacity ? old_capacity * 2 : 64;
+    SourceFile **slots = calloc(capacity, sizeof(*slots));
+    if (!slots)
+        return 0;
+    cache->slots = slots;
+    cache->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i])
+            *source_cache_slot(cache, old[i]->path) = old[i];
+    }
+    free(old);
+    return 1;
+}
 
-    /* Try CMakeLists.txt */
-    snprintf(path, sizeof(path), "%s/CMakeLists.txt", repo_dir);
-    content = read_file_content(path);
-    if (content) {
-        /* Look for add_library(name file1.c file2.c ...) */
-        char *p = content;
-        while ((p = strstr(p, "add_library")) != NULL) {
-            char *paren = strchr(p, '(');
-            if (!paren) {
-                p++;
-                continue;
+/* Return the parsed file at path, reading and indexing it on first use.
+   Returns NULL if the file cannot be read; the failure is cached too. */
+SourceFile *source_cache_get(SourceCache *cache, const char *path) {
+    if (cache->capacity > 0) {
+        SourceFile *sf = *source_cache_slot(cache, path);
+        if (sf)
+            return sf->data ? sf : NULL;
+    }
+    if ((size_t)(cache->count + 1) * 2 > cache->capacity &&
+        !source_cache_grow(cache))
+        return NULL;
+    SourceFile *sf = arena_alloc(&cache->arena, sizeof(*sf));
+    if (!sf)
+        return NULL;
+    memset(sf, 0, sizeof(*sf));
+    sf->path = arena_strdup(&cache->arena, path);
+    if (!sf->path)
+        return NULL;
+    sf->defines_main = -1;
+    *source_cache_slot(cache, path) = sf;
+    cache->count++;
+    source_file_load(sf, path);
+    if (!sf->data)
+        return NULL;
+    cache->bytes_loaded += sf->size;
+    source_index(sf, &cache->arena);
+    return sf;
+}
+
+/* Resolve the include at d, memoizing the answer on the directive. */
+IncludeTarget source_resolve_include(ConversionContext *ctx, SourceFile *sf,
+                                     Directive *d) {
+    if (d->target != TARGET_UNRESOLVED)
+        return d->target;
+
+    char resolved[MAX_PATH_LEN];
+    if (d->type == INCLUDE_LOCAL) {
+        char file_dir[MAX_PATH_LEN];
+        get_file_directory(sf->path, file_dir, sizeof(file_dir));
+        if (find_header_in_repo(ctx, d->header, file_dir, resolved)) {
+            d->resolved = arena_strdup(&ctx->sources->arena, resolved);
+            if (d->resolved) {
+                d->target = TARGET_REPO;
+                return d->target;
             }
-            char *close = strchr(paren, ')');
-            if (!close) {
-                p++;
-                continue;
+        }
+    }
+    d->target = header_exists_on_system(d->header) ? TARGET_STANDARD
+                                                   : TARGET_EXTERNAL;
+    return d->target;
+}
+
+/* Whether sf defines main() in code its own conditionals keep. A definition
+   looks like "main" followed by optional blanks and '(', preceded by a line
+   start, blank or '*'; whether that point is compiled is taken from the
+   directive index. */
+int source_defines_main(SourceFile *sf) {
+    if (sf->defines_main >= 0)
+        return sf->defines_main;
+
+    const char *content = sf->data;
+    const char *end = content + sf->size;
+    const char *p = content;
+    int next_directive = 0;
+    Reach reach = REACH_LIVE;
+    sf->defines_main = 0;
+
+    while ((p = memmem(p, (size_t)(end - p), "main", 4)) != NULL) {
+        const char *after = p + 4;
+        while (*after == ' ' || *after == '\t')
+            after++;
+        if (*after == '(' &&
+            (p == content || p[-1] == '\n' || p[-1] == ' ' || p[-1] == '\t' ||
+             p[-1] == '*')) {
+            size_t offset = (size_t)(p - content);
+            for (; next_directive < sf->directive_count &&
+                   sf->directives[next_directive].start < offset;
+                 next_directive++)
+                reach = sf->directives[next_directive].body;
+            /* A main() under a condition the file does not decide is
+               assumed to be optional, as with test drivers. */
+            if (reach == REACH_LIVE) {
+                sf->defines_main = 1;
+                break;
             }
+        }
+        p = after;
+    }
+    return sf->defines_main;
+}
 
-            /* Skip library name (first token after paren) */
-            char *tok = paren + 1;
-            while (*tok == ' ' || *tok == '\t' || *tok == '\n')
-                tok++;
-            while (*tok && *tok != ' ' && *tok != '\t' && *tok != '\n' &&
-                   *tok != ')')
-                tok++;
+typedef enum { TOKEN_IDENT, TOKEN_PUNCT, TOKEN_LITERAL } TokenKind;
 
-            /* Extract .c filenames */
-            while (tok < close) {
-                while (*tok == ' ' || *tok == '\t' || *tok == '\n')
-                    tok++;
-                if (tok >= close)
-                    break;
-                char *end = tok;
-                while (*end && *end != ' ' && *end != '\t' && *end != '\n' &&
-                       *end != ')')
-                    end++;
-                size_t len = (size_t)(end - tok);
-                char fname[MAX_PATH_LEN];
-                if (len > 0 && len < sizeof(fname)) {
-                    memcpy(fname, tok, len);
-                    fname[len] = '\0';
+typedef struct {
+    TokenKind kind;
+    unsigned len;
+    size_t start; /* offset into the file's data */
+} Token;
+
+/* Split the code of sf into tokens, leaving out comments, preprocessor
+   lines and text the file's own conditionals exclude. Returns the number
+   of tokens in *tokens (malloc'd), or -1 on allocation failure. */
+int source_tokenize(SourceFile *sf, Token **tokens) {
+    const char *data = sf->data, *end = data + sf->size, *p = data;
+    Token *list = NULL;
+    int count = 0, capacity = 0, next_directive = 0, line_start = 1;
+    Reach reach = REACH_LIVE;
+
+    while (p < end) {
+        const char *start = p;
+        char c = *p;
+        if (c == '\n') {
+            line_start = 1;
+            p++;
+            continue;
+        }
+        if (isspace((unsigned char)c) || (c == '\\' && p + 1 < end &&
+                                          (p[1] == '\n' || p[1] == '\r'))) {
+            p++;
+            continue;
+        }
+        if (c == '/' && p + 1 < end && p[1] == '/') {
+            while (p < end && *p != '\n')
+                p++;
+            continue;
+        }
+        if (c == '/' && p + 1 < end && p[1] == '*') {
+            const char *close = memmem(p + 2, (size_t)(end - p - 2), "*/", 2);
+            p = close ? close + 2 : end;
+            continue;
+        }
+        if (c == '#' && line_start) {
+            size_t offset = (size_t)(p - data);
+            for (; next_directive < sf->directive_count &&
+                   sf->directives[next_directive].start <= offset;
+                 next_directive++)
+                reach = sf->directives[next_directive].body;
+            while (p < end && *p != '\n') {
+                if (*p == '\\' && p + 1 < end && p[1] == '\n')
+                    p++;
+                else if (*p == '/' && p + 1 < end && p[1] == '*') {
+                    const char *close =
+                        memmem(p + 2, (size_t)(end - p - 2), "*/", 2);
+                    p = close ? close + 1 : end - 1;
+                }
+                p++;
+            }
+            continue;
+        }
+        line_start = 0;
 
-                    /* Skip keywords like STATIC, SHARED, MODULE */
-                    if (strcmp(fname, "STATIC") != 0 &&
-                        strcmp(fname, "SHARED") != 0 &&
-                        strcmp(fname, "MODULE") != 0 &&
-                        strcmp(fname, "OBJECT") != 0) {
-                        /* Check if this matches a .c file */
-                        const char *ext = strrchr(fname, '.');
-                        if (ext && strcmp(ext, ".c") == 0) {
-                            /* Get the basename */
-                            const char *base = strrchr(fname, '/');
-                            base = base ? base + 1 : fname;
+        TokenKind kind;
+        if (isalpha((unsigned char)c) || c == '_' || c == '$') {
+            while (p < end && (isalnum((unsigned char)*p) || *p == '_' ||
+                               *p == '$'))
+                p++;
+            kind = TOKEN_IDENT;
+        } else if (isdigit((unsigned char)c) ||
+                   (c == '.' && p + 1 < end &&
+                    isdigit((unsigned char)p[1]))) {
+            while (p < end && (isalnum((unsigned char)*p) || *p == '.' ||
+                               *p == '_' ||
+                               ((*p == '+' || *p == '-') &&
+                                strchr("eEpP", p[-1]))))
+                p++;
+            kind = TOKEN_LITERAL;
+        } else if (c == '"' || c == '\'') {
+            p++;
+            while (p < end && *p != c && *p != '\n')
+                p += *p == '\\' && p + 1 < end ? 2 : 1;
+            if (p < end && *p == c)
+                p++;
+            kind = TOKEN_LITERAL;
+        } else {
+            p++;
+            kind = TOKEN_PUNCT;
+        }
+        if (reach == REACH_DEAD)
+            continue;
 
-                            for (int i = 0; i < all_c->count; i++) {
-                                const char *cbase =
-                                    strrchr(all_c->paths[i], '/');
-                                cbase = cbase ? cbase + 1 : all_c->paths[i];
-                                if (strcmp(cbase, base) == 0 &&
-                                    result.count < MAX_FILES) {
-                                    strncpy(result.paths[result.count],
-                                            all_c->paths[i], MAX_PATH_LEN - 1);
-                                    result.count++;
-                                }
-                            }
-                        }
-                    }
-                }
-                tok = end;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            Token *grown = realloc(list, capacity * sizeof(*list));
+            if (!grown) {
+                free(list);
+                return -1;
             }
-            p = close + 1;
+            list = grown;
         }
-        free(content);
-        if (result.count > 0)
-            return result;
+        list[count].kind = kind;
+        list[count].start = (size_t)(start - data);
+        list[count].len = (unsigned)(p - start);
+        count++;
     }
+    *tokens = list;
+    return count;
+}
 
-    /* Try Makefile / makefile */
-    const char *makefiles[] = {"Makefile", "makefile", NULL};
-    for (int m = 0; makefiles[m]; m++) {
-        snprintf(path, sizeof(path), "%s/%s", repo_dir, makefiles[m]);
-        content = read_file_content(path);
-        if (!content)
-            continue;
+static const char *const c_keywords[] = {
+    "_Alignas",   "_Atomic",     "_Bool",      "_Complex",   "_Noreturn",
+    "_Thread_local", "__attribute__", "__declspec", "__extension__",
+    "__inline",   "__inline__",  "__restrict", "__restrict__", "auto",
+    "break",      "case",        "char",       "const",      "continue",
+    "default",    "do",          "double",     "else",       "enum",
+    "extern",     "float",       "for",        "goto",       "if",
+    "inline",     "int",         "long",       "register",   "restrict",
+    "return",     "short",       "signed",     "sizeof",     "static",
+    "struct",     "switch",      "typedef",    "union",      "unsigned",
+    "void",       "volatile",    "while"};
+
+/* Tokens of one file, with the helpers the declaration scanner needs. */
+typedef struct {
+    SourceFile *sf;
+    Token *tokens;
+    int count;
+    Symbol *symbols;
+    int symbol_count;
+    int symbol_capacity;
+    StrSet seen; /* space and name of every symbol recorded */
+    Arena *arena;
+    size_t span_start, span_end; /* of the declaration being scanned */
+} SymbolScan;
+
+int token_is(SymbolScan *scan, int i, const char *text) {
+    if (i < 0 || i >= scan->count)
+        return 0;
+    Token *t = &scan->tokens[i];
+    return t->len == strlen(text) &&
+           memcmp(scan->sf->data + t->start, text, t->len) == 0;
+}
 
-        /* Look for SRCS=, SOURCES=, SRC=, OBJS= lines */
-        const char *prefixes[] = {"SRCS", "SOURCES", "SRC", "OBJS", NULL};
-        char *line = content;
-        while (*line) {
-            char *nl = strchr(line, '\n');
+int token_is_keyword(SymbolScan *scan, int i) {
+    Token *t = &scan->tokens[i];
+    for (size_t k = 0; k < sizeof(c_keywords) / sizeof(c_keywords[0]); k++)
+        if (t->len == strlen(c_keywords[k]) &&
+            memcmp(scan->sf->data + t->start, c_keywords[k], t->len) == 0)
+            return 1;
+    return 0;
+}
+
+/* An identifier that can name something, rather than a keyword. */
+int token_is_name(SymbolScan *scan, int i) {
+    return i >= 0 && i < scan->count &&
+           scan->tokens[i].kind == TOKEN_IDENT && !token_is_keyword(scan, i);
+}
+
+int token_opens(SymbolScan *scan, int i) {
+    return scan->tokens[i].kind == TOKEN_PUNCT &&
+           strchr("([{", scan->sf->data[scan->tokens[i].start]);
+}
+
+/* Index just past the bracket group opening at i. */
+int skip_group(SymbolScan *scan, int i) {
+    int depth = 0;
+    for (; i < scan->count; i++) {
+        if (scan->tokens[i].kind != TOKEN_PUNCT)
+            continue;
+        char c = scan->sf->data[scan->tokens[i].start];
+        if (c == '(' || c == '[' || c == '{')
+            depth++;
+        else if ((c == ')' || c == ']' || c == '}') && --depth == 0)
+            return i + 1;
+    }
+    return scan->count;
+}
+
+/* Record a symbol; returns it, or NULL if the file already has one by
+   that name. */
+Symbol *symbol_push(SymbolScan *scan, const char *name, size_t len,
+                    SymbolSpace space, int is_static, uint64_t text_id) {
+    char key[300];
+    if (len + 3 > sizeof(key))
+        return NULL;
+    key[0] = "otm"[space];
+    key[1] = ':';
+    memcpy(key + 2, name, len);
+    key[len + 2] = '\0';
+    if (!strset_add(&scan->seen, key))
+        return NULL; /* e.g. both branches of an undecided #if */
+    if (scan->symbol_count == scan->symbol_capacity) {
+        int capacity = scan->symbol_capacity ? scan->symbol_capacity * 2 : 32;
+        Symbol *grown =
+            realloc(scan->symbols, capacity * sizeof(*scan->symbols));
+        if (!grown)
+            return NULL;
+        scan->symbols = grown;
+        scan->symbol_capacity = capacity;
+    }
+    char *copy = arena_alloc(scan->arena, len + 1);
+    if (!copy)
+        return NULL;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    Symbol *sym = &scan->symbols[scan->symbol_count++];
+    *sym = (Symbol){copy, space, is_static, 0, text_id, scan->span_start,
+                    scan->span_end};
+    return sym;
+}
+
+Symbol *symbol_add(SymbolScan *scan, int token, SymbolSpace space,
+                   int is_static, uint64_t text_id) {
+    Token *t = &scan->tokens[token];
+    return symbol_push(scan, scan->sf->data + t->start, t->len, space,
+                       is_static, text_id);
+}
+
+/* Make the symbols recorded next belong to the tokens [from, last]. */
+void scan_span(SymbolScan *scan, int from, int last) {
+    if (from > last || last >= scan->count)
+        return;
+    scan->span_start = scan->tokens[from].start;
+    scan->span_end = scan->tokens[last].start + scan->tokens[last].len;
+}
+
+/* Record the tags defined in [from, to), and for enums their constants. */
+void scan_tags(SymbolScan *scan, int from, int to) {
+    for (int i = from; i + 1 < to; i++) {
+        int is_enum = token_is(scan, i, "enum");
+        if (!is_enum && !token_is(scan, i, "struct") &&
+            !token_is(scan, i, "union"))
+            continue;
+        int open = i + 1;
+        if (token_is_name(scan, open)) {
+            if (!token_is(scan, open + 1, "{"))
+                continue;
+            symbol_add(scan, open, SYMBOL_TAG, 0, 0);
+            open++;
+        } else if (!token_is(scan, open, "{")) {
+            continue;
+        }
+        if (!is_enum)
+            continue;
+        int close = skip_group(scan, open) - 1;
+        for (int j = open + 1; j < close; j++) {
+            if (token_is_name(scan, j))
+                symbol_add(scan, j, SYMBOL_ORDINARY, 0, 0);
+            /* Skip to the next enumerator. */
+            while (j < close && !token_is(scan, j, ","))
+                j = token_opens(scan, j) ? skip_group(scan, j) : j + 1;
+        }
+    }
+}
+
+/* The name a declarator in [from, to) declares: the identifier after "(*"
+   for pointers to functions, otherwise the last identifier outside
+   brackets that is not a keyword or followed by '(' (attributes, macro
+   calls, or a function's own name). Returns -1 if there is none. */
+int declarator_name(SymbolScan *scan, int from, int to) {
+    int name = -1;
+    for (int i = from; i < to;) {
+        if (token_is(scan, i, "(")) {
+            int j = i + 1;
+            while (token_is(scan, j, "*"))
+                j++;
+            if (j > i + 1 && token_is_name(scan, j))
+                return j;
+            i = skip_group(scan, i);
+        } else if (token_opens(scan, i)) {
+            i = skip_group(scan, i);
+        } else {
+            if (token_is_name(scan, i) && !token_is(scan, i + 1, "("))
+                name = i;
+            i++;
+        }
+    }
+    return name;
+}
+
+/* Hash of the tokens in [from, to), so that two spellings of a definition
+   differing only in layout and comments compare equal. */
+uint64_t tokens_id(SymbolScan *scan, int from, int to) {
+    uint64_t hash = FNV_OFFSET;
+    for (int i = from; i < to; i++) {
+        hash = hash_bytes(hash, scan->sf->data + scan->tokens[i].start,
+                          scan->tokens[i].len);
+        hash = hash_bytes(hash, " ", 1);
+    }
+    return hash | 1;
+}
+
+/* Record what the declaration in [from, to), ended by ';', defines:
+   typedef names, initialized variables and static variables. Prototypes,
+   extern declarations and tentative definitions of external variables
+   (which C merges) define nothing that can clash. */
+void scan_declaration(SymbolScan *scan, int from, int to) {
+    int is_typedef = 0, is_static = 0;
+    for (int i = from; i < to;) {
+        if (token_opens(scan, i)) {
+            i = skip_group(scan, i);
+            continue;
+        }
+        is_typedef |= token_is(scan, i, "typedef");
+        is_static |= token_is(scan, i, "static");
+        i++;
+    }
+    scan_tags(scan, from, to);
+    uint64_t text_id = is_typedef ? tokens_id(scan, from, to) : 0;
+
+    for (int start = from; start < to;) {
+        int end = start, assign = -1;
+        while (end < to && !token_is(scan, end, ",")) {
+            if (assign < 0 && token_is(scan, end, "="))
+                assign = end;
+            end = token_opens(scan, end) ? skip_group(scan, end) : end + 1;
+        }
+        int name = declarator_name(scan, start, assign >= 0 ? assign : end);
+        Symbol *sym = NULL;
+        if (name >= 0 && (is_typedef || is_static || assign >= 0))
+            sym = symbol_add(scan, name, SYMBOL_ORDINARY,
+                             is_static && !is_typedef, text_id);
+        if (sym)
+            sym->external = !is_typedef && !is_static;
+        start = end + 1;
+    }
+}
+
+/* Record the function defined by the header in [from, to), which is
+   followed by its body: the name before the last parenthesized group that
+   is not an attribute. */
+void scan_function(SymbolScan *scan, int from, int to) {
+    int name = -1, is_static = 0, is_inline = 0, is_extern = 0;
+    for (int i = from; i < to;) {
+        if (token_is(scan, i, "(")) {
+            if (token_is_name(scan, i - 1))
+                name = i - 1;
+            i = skip_group(scan, i);
+            continue;
+        }
+        if (token_opens(scan, i)) {
+            i = skip_group(scan, i);
+            continue;
+        }
+        is_static |= token_is(scan, i, "static");
+        is_inline |= token_is(scan, i, "inline");
+        is_extern |= token_is(scan, i, "extern");
+        i++;
+    }
+    Symbol *sym =
+        name >= 0 ? symbol_add(scan, name, SYMBOL_ORDINARY, is_static, 0)
+                  : NULL;
+    /* A plain C99 inline definition emits no symbol of its own. */
+    if (sym)
+        sym->external = !is_static && (!is_inline || is_extern);
+}
+
+/* Record the macros sf defines outside excluded code, with the text of
+   each definition. A macro the file also #undefs is left out: the file
+   manages its scope itself. */
+void scan_macros(SymbolScan *scan) {
+    SourceFile *sf = scan->sf;
+    Arena undef_arena = {0};
+    StrSet undefined;
+    strset_init(&undefined, &undef_arena);
+    int first = scan->symbol_count;
+
+    char keyword[16], text[4096], name[256];
+    for (int i = 0; i < sf->directive_count; i++) {
+        Directive *d = &sf->directives[i];
+        if (d->type != INCLUDE_DEFINE || d->reach == REACH_DEAD ||
+            !directive_text(sf->data + d->start, sf->data + d->next, keyword,
+                            sizeof(keyword), text, sizeof(text)))
+            continue;
+        PPParser pp = {text, NULL, 0, 0};
+        if (!pp_identifier(&pp, name, sizeof(name)))
+            continue;
+        if (strcmp(keyword, "undef") == 0) {
+            strset_add(&undefined, name);
+            continue;
+        }
+        /* Runs of blanks compare equal so layout does not matter. */
+        uint64_t id = FNV_OFFSET;
+        for (const char *p = pp.p; *p; p++) {
+            if (isspace((unsigned char)*p)) {
+                while (isspace((unsigned char)p[1]))
+                    p++;
+                id = hash_bytes(id, " ", 1);
+            } else {
+                id = hash_bytes(id, p, 1);
+            }
+        }
+        symbol_push(scan, name, strlen(name), SYMBOL_MACRO, 0, id | 1);
+    }
+
+    int kept = first;
+    for (int i = first; i < scan->symbol_count; i++)
+        if (!strset_contains(&undefined, scan->symbols[i].name))
+            scan->symbols[kept++] = scan->symbols[i];
+    scan->symbol_count = kept;
+    strset_free(&undefined);
+    arena_free(&undef_arena);
+}
+
+/* The names sf defines at file scope, found by a light scan of its
+   top-level declarations: functions with bodies, variables, typedefs,
+   struct, union and enum tags, enum constants and macros. Computed once
+   and kept on sf. Returns the number of symbols in *symbols. */
+int source_symbols(SourceCache *cache, SourceFile *sf, Symbol **symbols) {
+    if (sf->symbols) {
+        *symbols = sf->symbols;
+        return sf->symbol_count;
+    }
+
+    Arena seen_arena = {0};
+    SymbolScan scan = {sf, NULL, 0, NULL, 0, 0, {0}, &cache->arena, 0, 0};
+    strset_init(&scan.seen, &seen_arena);
+    scan.count = source_tokenize(sf, &scan.tokens);
+    int start = 0;
+    for (int i = 0; i < scan.count;) {
+        if (token_is(&scan, i, ";")) {
+            scan_span(&scan, start, i);
+            scan_declaration(&scan, start, i);
+            start = ++i;
+        } else if (token_is(&scan, i, "}")) {
+            start = ++i; /* closes extern "C" { */
+        } else if (!token_is(&scan, i, "{")) {
+            i = token_opens(&scan, i) ? skip_group(&scan, i) : i + 1;
+        } else if (i - start == 2 && token_is(&scan, start, "extern") &&
+                   scan.tokens[start + 1].kind == TOKEN_LITERAL) {
+            start = ++i;
+        } else if (i > start && (token_is(&scan, i - 1, "=") ||
+                                 token_is(&scan, i - 1, "struct") ||
+                                 token_is(&scan, i - 1, "union") ||
+                                 token_is(&scan, i - 1, "enum") ||
+                                 (token_is_name(&scan, i - 1) &&
+                                  (token_is(&scan, i - 2, "struct") ||
+                                   token_is(&scan, i - 2, "union") ||
+                                   token_is(&scan, i - 2, "enum"))))) {
+            /* An initializer or a type's body; the declaration goes on. */
+            i = skip_group(&scan, i);
+        } else {
+            scan_span(&scan, start, skip_group(&scan, i) - 1);
+            scan_tags(&scan, start, i);
+            scan_function(&scan, start, i);
+            start = i = skip_group(&scan, i);
+        }
+    }
+    scan.span_start = scan.span_end = 0;
+    scan_macros(&scan);
+    free(scan.tokens);
+    strset_free(&scan.seen);
+    arena_free(&seen_arena);
+
+    /* Keep a non-NULL array so an empty result is remembered too. */
+    if (!scan.symbols)
+        scan.symbols = malloc(sizeof(*scan.symbols));
+    sf->symbols = scan.symbols;
+    sf->symbol_count = scan.symbol_count;
+    *symbols = sf->symbols;
+    return sf->symbol_count;
+}
+
+void source_cache_free(SourceCache *cache) {
+    for (size_t i = 0; i < cache->capacity; i++) {
+        SourceFile *sf = cache->slots[i];
+        if (!sf)
+            continue;
+        if (sf->map_size)
+            munmap(sf->data, sf->map_size);
+        else
+            free(sf->data);
+        free(sf->directives);
+        free(sf->symbols);
+    }
+    free(cache->slots);
+    strset_free(&cache->headers.paths);
+    free(cache->headers.canonical);
+    strset_free(&cache->blob_paths);
+    free(cache->blob_ids);
+    strset_free(&cache->segment_keys);
+    free(cache->segments);
+    arena_free(&cache->arena);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/* Output sink for the generator. With out == NULL nothing is written and
+   only the include lists in the context are collected, which is how the
+   preamble is computed before the body is streamed. */
+typedef struct {
+    FILE *out;
+    int lines; /* newlines written so far */
+    size_t bytes;
+    int failed; /* part of the output could not be produced */
+} Emitter;
+
+void emit_write(Emitter *em, const char *data, size_t len) {
+    if (!em->out)
+        return;
+    fwrite(data, 1, len, em->out);
+    em->bytes += len;
+    const char *end = data + len;
+    while ((data = memchr(data, '\n', (size_t)(end - data))) != NULL) {
+        em->lines++;
+        data++;
+    }
+}
+
+void emit_printf(Emitter *em, const char *fmt, ...) {
+    if (!em->out)
+        return;
+    char buf[MAX_PATH_LEN + 64];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if ((size_t)len >= sizeof(buf))
+        len = (int)sizeof(buf) - 1;
+    emit_write(em, buf, (size_t)len);
+}
+
+/* Path of an absolute path relative to the repository root, or NULL if it
+   lies outside it. */
+const char *source_relative(SourceCache *cache, const char *path) {
+    size_t root_len = strlen(cache->headers.root);
+    if (root_len == 0 || strncmp(path, cache->headers.root, root_len) != 0 ||
+        path[root_len] != '/')
+        return NULL;
+    return path + root_len + 1;
+}
+
+/* Identify the current contents of rel: its git blob id when the checkout
+   came from a known commit, otherwise a hash of the file. Returns 0 if the
+   file cannot be read. */
+uint64_t source_blob_id(SourceCache *cache, const char *rel) {
+    int index = strset_index(&cache->blob_paths, rel);
+    if (index >= 0)
+        return cache->blob_ids[index];
+
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", cache->headers.root, rel);
+    SourceFile *sf = source_cache_get(cache, path);
+    if (!sf)
+        return 0;
+    if (!sf->content_id)
+        sf->content_id = hash_bytes(FNV_OFFSET, sf->data, sf->size) | 1;
+    return sf->content_id;
+}
+
+/* Record the git blob ids of every file in treeish, so unchanged files can
+   be recognised without reading them. Only valid when the checkout is an
+   unmodified copy of treeish. */
+void source_cache_load_blobs(SourceCache *cache, const char *git_dir,
+                             const char *treeish) {
+    char command[MAX_PATH_LEN * 2];
+    snprintf(command, sizeof(command),
+             "git --git-dir=\"%s\" ls-tree -r -z --full-tree %s 2>/dev/null",
+             git_dir, treeish);
+    FILE *fp = popen(command, "r");
+    if (!fp)
+        return;
+
+    /* Each entry is "<mode> <type> <object>\t<path>\0". */
+    char *entry = NULL;
+    size_t entry_size = 0;
+    ssize_t len;
+    while ((len = getdelim(&entry, &entry_size, '\0', fp)) > 0) {
+        char *tab = strchr(entry, '\t');
+        char *type = strchr(entry, ' ');
+        if (!tab || !type || strncmp(type + 1, "blob ", 5) != 0)
+            continue;
+        char id[17];
+        memcpy(id, type + 6, 16);
+        id[16] = '\0';
+        if (!strset_add(&cache->blob_paths, tab + 1))
+            continue;
+        int i = cache->blob_paths.count - 1;
+        if (i >= cache->blob_capacity) {
+            int capacity = cache->blob_capacity ? cache->blob_capacity * 2 : 256;
+            uint64_t *grown =
+                realloc(cache->blob_ids, capacity * sizeof(*grown));
+            if (!grown) {
+                cache->blob_paths.count--; /* keep the arrays in step */
+                break;
+            }
+            cache->blob_ids = grown;
+            cache->blob_capacity = capacity;
+        }
+        /* Keep ids odd so they never collide with "unknown". */
+        cache->blob_ids[i] = strtoull(id, NULL, 16) | 1;
+    }
+    free(entry);
+    pclose(fp);
+}
+
+/* Note that generating the current segment reached the repository header
+   path, and how (a DEP_* value). Only the first time counts, since later
+   hits are decided by the segment itself, except that a header copied
+   under a condition and then inlined outright is recorded as inlined. */
+void segment_record_dep(ConversionContext *ctx, const char *path,
+                        int inlined) {
+    SegmentRecord *record = ctx->record;
+    const char *rel = source_relative(ctx->sources, path);
+    if (!rel || strchr(rel, '\n')) {
+        record->uncacheable = 1;
+        return;
+    }
+    int i = strset_index(&record->deps, rel);
+    if (i >= 0) {
+        if (inlined == DEP_INLINED &&
+            record->dep_inlined[i] == DEP_CONDITIONAL)
+            record->dep_inlined[i] = DEP_INLINED;
+        return;
+    }
+    if (!strset_add(&record->deps, rel))
+        return;
+    i = record->deps.count - 1;
+    if (i >= record->dep_capacity) {
+        int capacity = record->dep_capacity ? record->dep_capacity * 2 : 64;
+        unsigned char *grown = realloc(record->dep_inlined, (size_t)capacity);
+        if (!grown) {
+            record->uncacheable = 1;
+            return;
+        }
+        record->dep_inlined = grown;
+        record->dep_capacity = capacity;
+    }
+    record->dep_inlined[i] = (unsigned char)inlined;
+}
+
+/* The name src gives the identifier [name, name + len) in the output, or
+   NULL if it keeps its own. */
+const char *source_renamed(SourceFile *src, const char *name, size_t len) {
+    for (int i = 0; i < src->rename_count; i++) {
+        const char *from = src->renames[2 * i];
+        if (strncmp(from, name, len) == 0 && from[len] == '\0')
+            return src->renames[2 * i + 1];
+    }
+    return NULL;
+}
+
+/* Write src's bytes [from, to) to em with its renamed statics replaced.
+   Comments, literals and member names (after '.' or "->", or declared in
+   a struct or union body) are left as they are. */
+void emit_renamed(Emitter *em, SourceFile *src, size_t from, size_t to) {
+    const char *p = src->data + from, *end = src->data + to, *plain = p;
+    if (!src->rename_count || !em->out) {
+        emit_write(em, p, to - from);
+        return;
+    }
+    const char *member = NULL; /* just after the last '.' or "->" */
+    unsigned long long members = 0; /* bit per open brace: a member list */
+    int depth = 0, after_tag = 0;   /* after "struct" or "union" [name] */
+    while (p < end) {
+        char c = *p;
+        if (c == '/' && p + 1 < end && p[1] == '/') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (c == '/' && p + 1 < end && p[1] == '*') {
+            const char *close = memmem(p + 2, (size_t)(end - p - 2), "*/", 2);
+            p = close ? close + 2 : end;
+        } else if (c == '"' || c == '\'') {
+            p++;
+            while (p < end && *p != c && *p != '\n')
+                p += *p == '\\' && p + 1 < end ? 2 : 1;
+            if (p < end && *p == c)
+                p++;
+        } else if (isdigit((unsigned char)c)) {
+            while (p < end && (isalnum((unsigned char)*p) || *p == '.' ||
+                               *p == '_'))
+                p++;
+        } else if (isalpha((unsigned char)c) || c == '_') {
+            const char *name = p;
+            while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+                p++;
+            size_t len = (size_t)(p - name);
+            int in_members = depth > 0 && depth <= 64 &&
+                             (members >> (depth - 1) & 1);
+            const char *to_name = name == member || in_members
+                                      ? NULL
+                                      : source_renamed(src, name, len);
+            int tag_keyword = (len == 6 && strncmp(name, "struct", 6) == 0) ||
+                              (len == 5 && strncmp(name, "union", 5) == 0);
+            after_tag = tag_keyword ? 1 : after_tag == 1 ? 2 : 0;
+            if (to_name) {
+                emit_write(em, plain, (size_t)(name - plain));
+                emit_write(em, to_name, strlen(to_name));
+                plain = p;
+            }
+        } else {
+            p++;
+            if (isspace((unsigned char)c))
+                continue;
+            if (c == '{') {
+                depth++;
+                if (depth <= 64) {
+                    unsigned long long bit = 1ULL << (depth - 1);
+                    members = after_tag ? members | bit : members & ~bit;
+                }
+            } else if (c == '}' && depth > 0) {
+                depth--;
+            } else if (c == '.' ||
+                       (c == '>' && p - 2 >= src->data && p[-2] == '-')) {
+                member = p;
+                while (member < end && (*member == ' ' || *member == '\t'))
+                    member++;
+            }
+            after_tag = 0;
+        }
+    }
+    emit_write(em, plain, (size_t)(end - plain));
+}
+
+/* Write src's bytes [from, to) to em without its pruned definitions. */
+void emit_source(Emitter *em, SourceFile *src, size_t from, size_t to) {
+    for (int i = 0; i < src->drop_count && from < to; i++) {
+        size_t start = src->drops[2 * i], end = src->drops[2 * i + 1];
+        if (start >= to)
+            break;
+        if (end <= from)
+            continue;
+        if (start > from)
+            emit_renamed(em, src, from, start);
+        from = end;
+    }
+    if (from < to)
+        emit_renamed(em, src, from, to);
+}
+
+void process_file_with_context(ConversionContext *ctx, const char *filepath,
+                               Emitter *em, int conditional);
+
+/* Copy the repository file path in place of an include the file cannot
+   decide, as its own conditional keeps it. It stays uninlined, so a later
+   unconditional include still brings it in; open_files stops cycles. */
+void inline_conditional(ConversionContext *ctx, const char *path,
+                        const char *header, Emitter *em) {
+    for (int i = 0; i < ctx->open_count; i++)
+        if (strcmp(ctx->open_files[i], path) == 0)
+            return;
+    if (ctx->open_count == MAX_CONDITIONAL_DEPTH)
+        return;
+    ctx->open_files[ctx->open_count++] = path;
+    emit_printf(em, "\n/* --- Inlined: %s --- */\n", header);
+    process_file_with_context(ctx, path, em, 1);
+    emit_printf(em, "/* --- End: %s --- */\n", header);
+    ctx->open_count--;
+}
+
+/* Inline filepath into em from its parsed form: the bytes between handled
+   include lines are written as raw slices of the cached source, and each
+   include is followed through its memoized resolution. Includes in code
+   the file's own conditionals exclude are left alone; those under
+   conditions it cannot decide, or anywhere in a file copied in under one
+   (conditional), stay where they are. */
+void process_file_with_context(ConversionContext *ctx, const char *filepath,
+                               Emitter *em, int conditional) {
+    SourceFile *src = source_cache_get(ctx->sources, filepath);
+    if (!src)
+        return;
+    /* Renames and drops are in the key of the file's own segment only. */
+    if ((src->rename_count || src->drop_count) && ctx->record &&
+        ctx->record->deps.count)
+        ctx->record->uncacheable = 1;
+
+    const char *data = src->data;
+    size_t span = 0; /* first byte not yet written */
+
+    for (int i = 0; i < src->directive_count; i++) {
+        Directive *d = &src->directives[i];
+        if ((d->type != INCLUDE_LOCAL && d->type != INCLUDE_SYSTEM) ||
+            d->reach == REACH_DEAD)
+            continue;
+        int in_place = conditional || d->reach == REACH_UNKNOWN;
+        IncludeTarget target = source_resolve_include(ctx, src, d);
+        if (in_place && target != TARGET_REPO)
+            continue;
+
+        emit_source(em, src, span, d->start);
+        span = d->next;
+
+        int inlined =
+            target == TARGET_REPO && is_file_inlined(ctx, d->resolved);
+        if (target == TARGET_REPO && ctx->record)
+            segment_record_dep(ctx, d->resolved,
+                               inlined     ? DEP_SKIPPED
+                               : in_place ? DEP_CONDITIONAL
+                                          : DEP_INLINED);
+        switch (target) {
+        case TARGET_REPO:
+            if (inlined)
+                break;
+            if (in_place) {
+                inline_conditional(ctx, d->resolved, d->header, em);
+                break;
+            }
+            mark_file_inlined(ctx, d->resolved);
+            emit_printf(em, "\n/* --- Inlined: %s --- */\n", d->header);
+            process_file_with_context(ctx, d->resolved, em, 0);
+            emit_printf(em, "/* --- End: %s --- */\n\n", d->header);
+            break;
+        case TARGET_STANDARD:
+            strset_add(&ctx->standard, d->header);
+            if (ctx->record)
+                strset_add(&ctx->record->system, d->header);
+            break;
+        default:
+            strset_add(&ctx->external, d->header);
+            if (ctx->record)
+                strset_add(&ctx->record->system, d->header);
+            break;
+        }
+    }
+
+    emit_source(em, src, span, src->size);
+    if (span < src->size && data[src->size - 1] != '\n')
+        emit_write(em, "\n", 1);
+}
+
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Sort paths so output does not depend on directory order. */
+void filelist_sort(FileList *list) {
+    if (list->count > 1)
+        qsort(list->paths, (size_t)list->count, sizeof(*list->paths),
+              compare_paths);
+}
+
+#define MAX_WALK_THREADS 8
+
+/* Directories still to be read, shared by all walker threads. active
+   counts directories being read, which may still push more; the walk is
+   over once both are zero. */
+typedef struct {
+    int root_fd;
+    const char *root;
+    char **pending; /* paths relative to root */
+    int pending_count;
+    int pending_capacity;
+    int active;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} WalkQueue;
+
+/* What one walker thread found; merged after the walk. index_rel and
+   index_canonical are parallel. */
+typedef struct {
+    WalkQueue *queue;
+    FileList c_files;
+    FileList h_files;
+    FileList index_rel;
+    FileList index_canonical;
+} Walker;
+
+void walk_push(WalkQueue *queue, const char *rel) {
+    char *copy = strdup(rel);
+    if (!copy)
+        return;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->pending_count == queue->pending_capacity) {
+        int capacity = queue->pending_capacity ? queue->pending_capacity * 2
+                                               : 64;
+        char **grown = realloc(queue->pending, capacity * sizeof(*grown));
+        if (!grown) {
+            pthread_mutex_unlock(&queue->lock);
+            free(copy);
+            return;
+        }
+        queue->pending = grown;
+        queue->pending_capacity = capacity;
+    }
+    queue->pending[queue->pending_count++] = copy;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Take a directory to read, waiting while others may still produce one.
+   Returns NULL once the walk is over. */
+char *walk_pop(WalkQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->pending_count == 0 && queue->active > 0)
+        pthread_cond_wait(&queue->cond, &queue->lock);
+    char *rel = NULL;
+    if (queue->pending_count > 0) {
+        rel = queue->pending[--queue->pending_count];
+        queue->active++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return rel;
+}
+
+void walk_finish(WalkQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    if (--queue->active == 0 && queue->pending_count == 0)
+        pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Read one directory relative to the root fd. Subdirectories are queued
+   for any walker; symlinked directories are never entered, so root/rel is
+   already canonical for every regular file and needs no realpath. */
+void walk_directory(Walker *walker, const char *rel_dir) {
+    WalkQueue *queue = walker->queue;
+    int fd = openat(queue->root_fd, *rel_dir ? rel_dir : ".",
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (strcmp(entry->d_name, ".git") == 0)
+            continue;
+
+        struct stat st;
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = S_ISREG(st.st_mode)   ? DT_REG
+                   : S_ISDIR(st.st_mode) ? DT_DIR
+                   : S_ISLNK(st.st_mode) ? DT_LNK
+                                         : DT_UNKNOWN;
+        }
+
+        char rel[MAX_PATH_LEN], path[MAX_PATH_LEN];
+        snprintf(rel, sizeof(rel), "%s%s%s", rel_dir, *rel_dir ? "/" : "",
+                 entry->d_name);
+        snprintf(path, sizeof(path), "%s/%s", queue->root, rel);
+
+        if (type == DT_REG) {
+            filelist_add(&walker->index_rel, rel);
+            filelist_add(&walker->index_canonical, path);
+            if (is_c_file(entry->d_name))
+                filelist_add(&walker->c_files, path);
+            else if (is_header_file(entry->d_name))
+                filelist_add(&walker->h_files, path);
+        } else if (type == DT_LNK) {
+            char real[PATH_MAX];
+            if (fstatat(fd, entry->d_name, &st, 0) == 0 &&
+                S_ISREG(st.st_mode) && realpath(path, real)) {
+                filelist_add(&walker->index_rel, rel);
+                filelist_add(&walker->index_canonical, real);
+            }
+        } else if (type == DT_DIR) {
+            walk_push(queue, rel);
+        }
+    }
+
+    closedir(dir);
+}
+
+void *walker_main(void *arg) {
+    Walker *walker = arg;
+    char *rel;
+    while ((rel = walk_pop(walker->queue)) != NULL) {
+        walk_directory(walker, rel);
+        free(rel);
+        walk_finish(walker->queue);
+    }
+    return NULL;
+}
+
+/* Everything known about a checked-out repository: its .c and .h files in
+   sorted order and the per-job source model with its header index. */
+typedef struct {
+    SourceCache sources;
+    FileList c_files;
+    FileList h_files;
+} RepoScan;
+
+/* Walk repo_dir once with a pool of threads sharing one directory queue,
+   filling the file lists and the header index. Returns 0 if the directory
+   cannot be opened. */
+int repo_scan(RepoScan *scan, const char *repo_dir) {
+    double began = monotonic_seconds();
+    memset(scan, 0, sizeof(*scan));
+    strset_init(&scan->sources.blob_paths, &scan->sources.arena);
+    strset_init(&scan->sources.segment_keys, &scan->sources.arena);
+    HeaderIndex *index = &scan->sources.headers;
+    header_index_init(index, &scan->sources.arena, repo_dir);
+    if (!index->root[0])
+        return 0;
+
+    WalkQueue queue = {0};
+    queue.root = index->root;
+    queue.root_fd = open(index->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (queue.root_fd < 0)
+        return 0;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+    walk_push(&queue, "");
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cpus < 1                  ? 1
+                : cpus > MAX_WALK_THREADS ? MAX_WALK_THREADS
+                                          : (int)cpus;
+    Walker walkers[MAX_WALK_THREADS];
+    pthread_t threads[MAX_WALK_THREADS];
+    memset(walkers, 0, sizeof(walkers));
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        walkers[i].queue = &queue;
+        if (i > 0 &&
+            pthread_create(&threads[i], NULL, walker_main, &walkers[i]) != 0)
+            break;
+        started++;
+    }
+    walker_main(&walkers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < started; i++) {
+        Walker *w = &walkers[i];
+        for (int j = 0; j < w->c_files.count; j++)
+            filelist_add(&scan->c_files, w->c_files.paths[j]);
+        for (int j = 0; j < w->h_files.count; j++)
+            filelist_add(&scan->h_files, w->h_files.paths[j]);
+        for (int j = 0; j < w->index_rel.count; j++)
+            header_index_add(index, w->index_rel.paths[j],
+                             w->index_canonical.paths[j]);
+        filelist_free(&w->c_files);
+        filelist_free(&w->h_files);
+        filelist_free(&w->index_rel);
+        filelist_free(&w->index_canonical);
+    }
+    filelist_sort(&scan->c_files);
+    filelist_sort(&scan->h_files);
+
+    free(queue.pending);
+    pthread_cond_destroy(&queue.cond);
+    pthread_mutex_destroy(&queue.lock);
+    close(queue.root_fd);
+    stats_record(PHASE_WALK, began, index->paths.count, 0);
+    return 1;
+}
+
+void repo_scan_free(RepoScan *scan) {
+    filelist_free(&scan->c_files);
+    filelist_free(&scan->h_files);
+    source_cache_free(&scan->sources);
+}
+
+void remove_from_filelist(FileList *list, const char *path) {
+    for (int i = 0; i < list->count; i++) {
+        if (strcmp(list->paths[i], path) == 0) {
+            memmove(&list->paths[i], &list->paths[i + 1],
+                    (size_t)(list->count - i - 1) * sizeof(*list->paths));
+            list->count--;
+            return;
+        }
+    }
+}
+
+/* Start gcc on header_path in the background; its diagnostics are read back
+   with finish_compile. Several of these can run at once. A non-NULL define
+   is passed as -D so guarded code is checked too. */
+FILE *start_compile(const char *header_path, const char *define) {
+    char command[MAX_PATH_LEN + 384];
+    snprintf(command, sizeof(command),
+             "gcc -fsyntax-only %s%s -x c \"%s\" 2>&1", define ? "-D" : "",
+             define ? define : "", header_path);
+    return popen(command, "r");
+}
+
+/* Collect all of gcc's output into a malloc'd string and return its exit
+   status. */
+int finish_compile(FILE *fp, char **errors) {
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buf, &size);
+    char chunk[BUFFER_SIZE];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        if (out)
+            fwrite(chunk, 1, n, out);
+    }
+    if (out)
+        fclose(out);
+    *errors = buf ? buf : strdup("");
+
+    int status = pclose(fp);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int try_compile(const char *header_path, const char *define, char **errors) {
+    FILE *fp = start_compile(header_path, define);
+    if (!fp) {
+        *errors = strdup("");
+        return -1;
+    }
+    return finish_compile(fp, errors);
+}
+
+const char *linemap_lookup(LineMap *map, int line) {
+    int lo = 0, hi = map->count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (line < map->entries[mid].start_line)
+            hi = mid - 1;
+        else if (line > map->entries[mid].end_line)
+            lo = mid + 1;
+        else
+            return map->entries[mid].source;
+    }
+    return NULL;
+}
+
+/* Add to conflicts every source file that owns a "redefinition" or
+   "conflicting types" error in gcc's output for header_path. Returns the
+   total number of errors reported. */
+int find_conflicting_sources(const char *error_output, const char *header_path,
+                             LineMap *map, StrSet *conflicts) {
+    const char *patterns[] = {"redefinition of", "conflicting types", NULL};
+    size_t path_len = strlen(header_path);
+    int error_count = 0;
+
+    const char *line = error_output;
+    while (*line) {
+        const char *nl = strchr(line, '\n');
+        size_t len = nl ? (size_t)(nl - line) : strlen(line);
+
+        /* gcc format: "file.h:LINE:COL: error: ..." */
+        if (len > path_len && strncmp(line, header_path, path_len) == 0 &&
+            line[path_len] == ':') {
+            const char *msg = memmem(line, len, ": error: ", 9);
+            if (msg) {
+                error_count++;
+                for (int i = 0; patterns[i]; i++) {
+                    if (!memmem(msg, len - (size_t)(msg - line), patterns[i],
+                                strlen(patterns[i])))
+                        continue;
+                    const char *source =
+                        linemap_lookup(map, atoi(line + path_len + 1));
+                    if (source)
+                        strset_add(conflicts, source);
+                    break;
+                }
+            }
+        }
+        line = nl ? nl + 1 : line + len;
+    }
+    return error_count;
+}
+
+/* Append every file in all_c whose basename is base, skipping paths that are
+   already in seen. */
+void add_files_by_basename(FileList *result, StrSet *seen, FileList *all_c,
+                           const char *base) {
+    for (int i = 0; i < all_c->count; i++) {
+        const char *cbase = strrchr(all_c->paths[i], '/');
+        cbase = cbase ? cbase + 1 : all_c->paths[i];
+        if (strcmp(cbase, base) == 0 && strset_add(seen, all_c->paths[i]))
+            filelist_add(result, all_c->paths[i]);
+    }
+}
+
+/* Strategy 1: Parse build system files to find library sources */
+void filter_by_build_system(const char *repo_dir, FileList *all_c,
+                            FileList *result) {
+    Arena seen_arena = {0};
+    StrSet seen;
+    strset_init(&seen, &seen_arena);
+
+    char path[MAX_PATH_LEN];
+    char *content = NULL;
+
+    /* Try CMakeLists.txt */
+    snprintf(path, sizeof(path), "%s/CMakeLists.txt", repo_dir);
+    content = read_file_content(path);
+    if (content) {
+        /* Look for add_library(name file1.c file2.c ...) */
+        char *p = content;
+        while ((p = strstr(p, "add_library")) != NULL) {
+            char *paren = strchr(p, '(');
+            if (!paren) {
+                p++;
+                continue;
+            }
+            char *close = strchr(paren, ')');
+            if (!close) {
+                p++;
+                continue;
+            }
+
+            /* Skip library name (first token after paren) */
+            char *tok = paren + 1;
+            while (*tok == ' ' || *tok == '\t' || *tok == '\n')
+                tok++;
+            while (*tok && *tok != ' ' && *tok != '\t' && *tok != '\n' &&
+                   *tok != ')')
+                tok++;
+
+            /* Extract .c filenames */
+            while (tok < close) {
+                while (*tok == ' ' || *tok == '\t' || *tok == '\n')
+                    tok++;
+                if (tok >= close)
+                    break;
+                char *end = tok;
+                while (*end && *end != ' ' && *end != '\t' && *end != '\n' &&
+                       *end != ')')
+                    end++;
+                size_t len = (size_t)(end - tok);
+                char fname[MAX_PATH_LEN];
+                if (len > 0 && len < sizeof(fname)) {
+                    memcpy(fname, tok, len);
+                    fname[len] = '\0';
+
+                    /* Skip keywords like STATIC, SHARED, MODULE */
+                    if (strcmp(fname, "STATIC") != 0 &&
+                        strcmp(fname, "SHARED") != 0 &&
+                        strcmp(fname, "MODULE") != 0 &&
+                        strcmp(fname, "OBJECT") != 0) {
+                        /* Check if this matches a .c file */
+                        const char *ext = strrchr(fname, '.');
+                        if (ext && strcmp(ext, ".c") == 0) {
+                            /* Get the basename */
+                            const char *base = strrchr(fname, '/');
+                            base = base ? base + 1 : fname;
+                            add_files_by_basename(result, &seen, all_c, base);
+                        }
+                    }
+                }
+                tok = end;
+            }
+            p = close + 1;
+        }
+        free(content);
+        if (result->count > 0)
+            goto done;
+    }
+
+    /* Try Makefile / makefile */
+    const char *makefiles[] = {"Makefile", "makefile", NULL};
+    for (int m = 0; makefiles[m]; m++) {
+        snprintf(path, sizeof(path), "%s/%s", repo_dir, makefiles[m]);
+        content = read_file_content(path);
+        if (!content)
+            continue;
+
+        /* Look for SRCS=, SOURCES=, SRC=, OBJS= lines */
+        const char *prefixes[] = {"SRCS", "SOURCES", "SRC", "OBJS", NULL};
+        char *line = content;
+        while (*line) {
+            char *nl = strchr(line, '\n');
             size_t llen = nl ? (size_t)(nl - line) : strlen(line);
             char lbuf[4096];
             if (llen >= sizeof(lbuf))
@@ -740,700 +3388,3171 @@ FileList filter_by_build_system(const char *repo_dir, FileList *all_c) {
             memcpy(lbuf, line, llen);
             lbuf[llen] = '\0';
 
-            for (int pi = 0; prefixes[pi]; pi++) {
-                char *var = strstr(lbuf, prefixes[pi]);
-                if (!var)
+            for (int pi = 0; prefixes[pi]; pi++) {
+                char *var = strstr(lbuf, prefixes[pi]);
+                if (!var)
+                    continue;
+                /* Skip to after '=' */
+                char *eq = strchr(var, '=');
+                if (!eq)
+                    continue;
+                eq++;
+                while (*eq == ' ' || *eq == '\t')
+                    eq++;
+
+                /* Extract filenames from this line */
+                char *tok = eq;
+                while (*tok) {
+                    while (*tok == ' ' || *tok == '\t' || *tok == '\\')
+                        tok++;
+                    if (!*tok)
+                        break;
+                    char *end = tok;
+                    while (*end && *end != ' ' && *end != '\t' && *end != '\\')
+                        end++;
+                    size_t tlen = (size_t)(end - tok);
+                    char fname[MAX_PATH_LEN];
+                    if (tlen > 0 && tlen < sizeof(fname)) {
+                        memcpy(fname, tok, tlen);
+                        fname[tlen] = '\0';
+
+                        /* Convert .o to .c */
+                        char *ext = strrchr(fname, '.');
+                        if (ext && strcmp(ext, ".o") == 0) {
+                            ext[1] = 'c';
+                            ext[2] = '\0';
+                        }
+
+                        if (ext && (strcmp(strrchr(fname, '.'), ".c") == 0)) {
+                            const char *base = strrchr(fname, '/');
+                            base = base ? base + 1 : fname;
+                            add_files_by_basename(result, &seen, all_c, base);
+                        }
+                    }
+                    tok = end;
+                }
+            }
+            line = nl ? nl + 1 : line + llen;
+        }
+        free(content);
+        if (result->count > 0)
+            goto done;
+    }
+
+    /* Try meson.build */
+    snprintf(path, sizeof(path), "%s/meson.build", repo_dir);
+    content = read_file_content(path);
+    if (content) {
+        const char *lib_funcs[] = {"library(", "static_library(",
+                                   "shared_library(", NULL};
+        for (int lf = 0; lib_funcs[lf]; lf++) {
+            char *p = content;
+            while ((p = strstr(p, lib_funcs[lf])) != NULL) {
+                char *paren = strchr(p, '(');
+                if (!paren) {
+                    p++;
+                    continue;
+                }
+
+                /* Find matching close paren (simple, not nested) */
+                char *close = strchr(paren, ')');
+                if (!close) {
+                    p++;
+                    continue;
+                }
+
+                /* Extract quoted .c filenames */
+                char *s = paren;
+                while (s < close) {
+                    char *q = strchr(s, '\'');
+                    if (!q || q >= close)
+                        break;
+                    char *q2 = strchr(q + 1, '\'');
+                    if (!q2 || q2 >= close)
+                        break;
+
+                    size_t slen = (size_t)(q2 - q - 1);
+                    char fname[MAX_PATH_LEN];
+                    if (slen > 0 && slen < sizeof(fname)) {
+                        memcpy(fname, q + 1, slen);
+                        fname[slen] = '\0';
+
+                        const char *ext = strrchr(fname, '.');
+                        if (ext && strcmp(ext, ".c") == 0) {
+                            const char *base = strrchr(fname, '/');
+                            base = base ? base + 1 : fname;
+                            add_files_by_basename(result, &seen, all_c, base);
+                        }
+                    }
+                    s = q2 + 1;
+                }
+                p = close + 1;
+            }
+        }
+        free(content);
+    }
+
+done:
+    strset_free(&seen);
+    arena_free(&seen_arena);
+}
+
+/* Strategy 2: Match .c files to .h files by basename */
+void filter_by_header_match(FileList *c_files, FileList *h_files,
+                            FileList *result) {
+    Arena stem_arena = {0};
+    StrSet h_stems;
+    strset_init(&h_stems, &stem_arena);
+
+    for (int j = 0; j < h_files->count; j++) {
+        const char *h_base = strrchr(h_files->paths[j], '/');
+        h_base = h_base ? h_base + 1 : h_files->paths[j];
+
+        char h_stem[MAX_PATH_LEN];
+        strncpy(h_stem, h_base, sizeof(h_stem) - 1);
+        h_stem[sizeof(h_stem) - 1] = '\0';
+        char *hdot = strrchr(h_stem, '.');
+        if (hdot)
+            *hdot = '\0';
+        strset_add(&h_stems, h_stem);
+    }
+
+    for (int i = 0; i < c_files->count; i++) {
+        const char *c_base = strrchr(c_files->paths[i], '/');
+        c_base = c_base ? c_base + 1 : c_files->paths[i];
+
+        /* Get stem (basename without extension) */
+        char c_stem[MAX_PATH_LEN];
+        strncpy(c_stem, c_base, sizeof(c_stem) - 1);
+        c_stem[sizeof(c_stem) - 1] = '\0';
+        char *dot = strrchr(c_stem, '.');
+        if (dot)
+            *dot = '\0';
+
+        if (strset_contains(&h_stems, c_stem))
+            filelist_add(result, c_files->paths[i]);
+    }
+
+    strset_free(&h_stems);
+    arena_free(&stem_arena);
+}
+
+/* Remove .c files that define an unconditional main() */
+void strip_main_files(SourceCache *sources, FileList *list) {
+    int i = 0;
+    while (i < list->count) {
+        SourceFile *src = source_cache_get(sources, list->paths[i]);
+        if (src && source_defines_main(src)) {
+            log_progress("excluded (has main): %s", list->paths[i]);
+            remove_from_filelist(list, list->paths[i]);
+        } else {
+            i++;
+        }
+    }
+}
+
+void make_guard_name(const char *repo_name, char *guard, size_t guard_size) {
+    size_t j = 0;
+    for (size_t i = 0; repo_name[i] && j < guard_size - 1; i++) {
+        char c = repo_name[i];
+        if (c >= 'a' && c <= 'z')
+            guard[j++] = c - 32;
+        else if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+            guard[j++] = c;
+        else
+            guard[j++] = '_';
+    }
+    guard[j] = '\0';
+}
+
+/* Segments are found by the file, its contents and everything else its
+   generation depends on outside the headers it reaches: the converter, the
+   set of files includes can resolve to and the statics it renames or
+   prunes. */
+void segment_key(SourceCache *cache, SourceFile *sf, const char *rel,
+                 uint64_t id, char *key, size_t key_size) {
+    uint64_t hash = hash_bytes(FNV_OFFSET, CONVERTER_VERSION,
+                               sizeof(CONVERTER_VERSION));
+    hash = hash_bytes(hash, &cache->headers.file_set_id,
+                      sizeof(cache->headers.file_set_id));
+    hash = hash_bytes(hash, &id, sizeof(id));
+    hash = hash_bytes(hash, rel, strlen(rel) + 1);
+    for (int i = 0; sf && i < sf->rename_count * 2; i++)
+        hash = hash_bytes(hash, sf->renames[i], strlen(sf->renames[i]) + 1);
+    if (sf && sf->drop_count)
+        hash = hash_bytes(hash, sf->drops, 2 * sf->drop_count *
+                                               sizeof(*sf->drops));
+    snprintf(key, key_size, "%016llx", (unsigned long long)hash);
+}
+
+/* Parse a segment file written by segment_store into a chain of variants
+   allocated in the cache's arena. */
+Segment *segment_parse(SourceCache *cache, const char *data, size_t size) {
+    const char *p = data, *end = data + size;
+    int variants, consumed;
+    if (sscanf(p, "giga-segment %d\n%n", &variants, &consumed) != 1)
+        return NULL;
+    p += consumed;
+
+    Segment *head = NULL, **tail = &head;
+    for (int v = 0; v < variants; v++) {
+        Segment *seg = arena_alloc(&cache->arena, sizeof(*seg));
+        int deps, systems;
+        size_t len;
+        if (!seg || sscanf(p, "%d %d %zu\n%n", &deps, &systems, &len,
+                           &consumed) != 3 ||
+            deps < 0 || systems < 0)
+            return head;
+        p += consumed;
+        memset(seg, 0, sizeof(*seg));
+        seg->deps = arena_alloc(&cache->arena, (deps + 1) * sizeof(char *));
+        seg->dep_ids = arena_alloc(&cache->arena, (deps + 1) * sizeof(uint64_t));
+        seg->dep_inlined = arena_alloc(&cache->arena, (size_t)deps + 1);
+        seg->system = arena_alloc(&cache->arena, (systems + 1) * sizeof(char *));
+        if (!seg->deps || !seg->dep_ids || !seg->dep_inlined || !seg->system)
+            return head;
+
+        for (int i = 0; i < deps + systems; i++) {
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            if (!nl)
+                return head;
+            char line[MAX_PATH_LEN + 32];
+            size_t line_len = (size_t)(nl - p);
+            if (line_len >= sizeof(line))
+                return head;
+            memcpy(line, p, line_len);
+            line[line_len] = '\0';
+            p = nl + 1;
+
+            if (i < deps) {
+                int inlined;
+                unsigned long long id;
+                if (sscanf(line, "%d %llx %n", &inlined, &id, &consumed) != 2)
+                    return head;
+                seg->dep_inlined[i] = (unsigned char)inlined;
+                seg->dep_ids[i] = id;
+                seg->deps[i] = arena_strdup(&cache->arena, line + consumed);
+                if (!seg->deps[i])
+                    return head;
+            } else {
+                seg->system[i - deps] = arena_strdup(&cache->arena, line);
+                if (!seg->system[i - deps])
+                    return head;
+            }
+        }
+        if ((size_t)(end - p) < len + 1)
+            return head;
+        char *text = arena_alloc(&cache->arena, len + 1);
+        if (!text)
+            return head;
+        memcpy(text, p, len);
+        p += len + 1;
+        seg->text = text;
+        seg->len = len;
+        seg->dep_count = deps;
+        seg->system_count = systems;
+        *tail = seg;
+        tail = &seg->next;
+    }
+    return head;
+}
+
+/* Returns the chain of known variants for key, consulting the segment
+   directory on first use. *index receives the key's position. */
+Segment *segment_lookup(SourceCache *cache, const char *key, int *index) {
+    *index = strset_index(&cache->segment_keys, key);
+    if (*index >= 0)
+        return cache->segments[*index];
+    if (!strset_add(&cache->segment_keys, key))
+        return NULL;
+    *index = cache->segment_keys.count - 1;
+    if (*index >= cache->segment_capacity) {
+        int capacity =
+            cache->segment_capacity ? cache->segment_capacity * 2 : 256;
+        Segment **grown = realloc(cache->segments, capacity * sizeof(*grown));
+        if (!grown) {
+            cache->segment_keys.count--; /* keep the arrays in step */
+            *index = -1;
+            return NULL;
+        }
+        cache->segments = grown;
+        cache->segment_capacity = capacity;
+    }
+
+    /* Segment text is spliced into headers as it is, so only entries of
+       ours in the private cache root are read. */
+    char dir[MAX_PATH_LEN], path[MAX_PATH_LEN];
+    size_t size;
+    char *data = NULL;
+    if (cache_directory("segments", dir, sizeof(dir))) {
+        snprintf(path, sizeof(path), "%s/%s.seg", dir, key);
+        if (file_trusted(path))
+            data = read_file_bytes(path, &size);
+    }
+    cache->segments[*index] = data ? segment_parse(cache, data, size) : NULL;
+    free(data);
+    return cache->segments[*index];
+}
+
+/* Write every variant in the chain for key, newest first, under a temporary
+   name renamed into place so concurrent jobs never see a partial file. */
+void segment_store(const char *key, Segment *chain) {
+    char dir[MAX_PATH_LEN], tmp[MAX_PATH_LEN], path[MAX_PATH_LEN];
+    if (!cache_directory("segments", dir, sizeof(dir)))
+        return;
+    snprintf(tmp, sizeof(tmp), "%s/.%s.seg.XXXXXX", dir, key);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return;
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        remove(tmp);
+        return;
+    }
+
+    int variants = 0;
+    for (Segment *seg = chain; seg; seg = seg->next)
+        variants++;
+    fprintf(out, "giga-segment %d\n", variants);
+    for (Segment *seg = chain; seg; seg = seg->next) {
+        fprintf(out, "%d %d %zu\n", seg->dep_count, seg->system_count,
+                seg->len);
+        for (int i = 0; i < seg->dep_count; i++)
+            fprintf(out, "%d %016llx %s\n", seg->dep_inlined[i],
+                    (unsigned long long)seg->dep_ids[i], seg->deps[i]);
+        for (int i = 0; i < seg->system_count; i++)
+            fprintf(out, "%s\n", seg->system[i]);
+        fwrite(seg->text, 1, seg->len, out);
+        fputc('\n', out);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s.seg", dir, key);
+    if (fclose(out) != 0 || rename(tmp, path) != 0)
+        remove(tmp);
+}
+
+/* A segment applies if every header it reached is inlined now exactly when
+   it was skipped then, and those it inlined are unchanged. */
+int segment_matches(ConversionContext *ctx, const Segment *seg) {
+    SourceCache *cache = ctx->sources;
+    for (int i = 0; i < seg->dep_count; i++) {
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", cache->headers.root,
+                 seg->deps[i]);
+        if (is_file_inlined(ctx, path) ==
+            (seg->dep_inlined[i] != DEP_SKIPPED))
+            return 0;
+        if (seg->dep_inlined[i] &&
+            source_blob_id(cache, seg->deps[i]) != seg->dep_ids[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* Apply a matching segment: the same headers become inlined and the same
+   includes reach the preamble as if the file had been generated. */
+void segment_replay(ConversionContext *ctx, const Segment *seg, Emitter *em) {
+    for (int i = 0; i < seg->dep_count; i++) {
+        if (seg->dep_inlined[i] != DEP_INLINED)
+            continue;
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", ctx->sources->headers.root,
+                 seg->deps[i]);
+        mark_file_inlined(ctx, path);
+    }
+    for (int i = 0; i < seg->system_count; i++)
+        strset_add(header_exists_on_system(seg->system[i]) ? &ctx->standard
+                                                           : &ctx->external,
+                   seg->system[i]);
+    emit_write(em, seg->text, seg->len);
+}
+
+/* Keep a freshly generated segment as the newest variant for its key. */
+void segment_add(ConversionContext *ctx, const char *key, int index,
+                 SegmentRecord *record, const char *text, size_t len) {
+    SourceCache *cache = ctx->sources;
+    Arena *arena = &cache->arena;
+    Segment *seg = arena_alloc(arena, sizeof(*seg));
+    if (!seg)
+        return;
+    memset(seg, 0, sizeof(*seg));
+    int deps = record->deps.count, systems = record->system.count;
+    char *copy = arena_alloc(arena, len + 1);
+    seg->deps = arena_alloc(arena, (deps + 1) * sizeof(char *));
+    seg->dep_ids = arena_alloc(arena, (deps + 1) * sizeof(uint64_t));
+    seg->dep_inlined = arena_alloc(arena, (size_t)deps + 1);
+    seg->system = arena_alloc(arena, (systems + 1) * sizeof(char *));
+    if (!copy || !seg->deps || !seg->dep_ids || !seg->dep_inlined ||
+        !seg->system)
+        return;
+    memcpy(copy, text, len);
+    seg->text = copy;
+    seg->len = len;
+
+    for (int i = 0; i < deps; i++) {
+        seg->deps[i] = arena_strdup(arena, record->deps.items[i]);
+        seg->dep_inlined[i] = record->dep_inlined[i];
+        seg->dep_ids[i] =
+            record->dep_inlined[i] ? source_blob_id(cache, seg->deps[i]) : 0;
+        if (!seg->deps[i] || (record->dep_inlined[i] && !seg->dep_ids[i]))
+            return;
+    }
+    for (int i = 0; i < systems; i++) {
+        seg->system[i] = arena_strdup(arena, record->system.items[i]);
+        if (!seg->system[i])
+            return;
+    }
+    seg->dep_count = deps;
+    seg->system_count = systems;
+
+    /* Newest first, dropping the oldest variant beyond the limit. */
+    seg->next = cache->segments[index];
+    cache->segments[index] = seg;
+    Segment *last = seg;
+    for (int n = 1; last->next && n < MAX_SEGMENT_VARIANTS; n++)
+        last = last->next;
+    last->next = NULL;
+    segment_store(key, seg);
+}
+
+/* Emit a top-level file, reusing its stored segment when one applies and
+   storing a new one when none does. */
+void emit_file_segment(ConversionContext *ctx, const char *path, Emitter *em) {
+    SourceCache *cache = ctx->sources;
+    const char *rel = source_relative(cache, path);
+    uint64_t id = rel && !strchr(rel, '\n') ? source_blob_id(cache, rel) : 0;
+    int index = -1;
+    char key[32];
+    Segment *seg = NULL;
+    if (id) {
+        segment_key(cache, source_cache_get(cache, path), rel, id, key,
+                    sizeof(key));
+        seg = segment_lookup(cache, key, &index);
+    }
+    for (; seg; seg = seg->next) {
+        if (segment_matches(ctx, seg)) {
+            segment_replay(ctx, seg, em);
+            cache->segments_reused++;
+            return;
+        }
+    }
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *capture = index >= 0 ? open_memstream(&text, &len) : NULL;
+    if (!capture) {
+        process_file_with_context(ctx, path, em, 0);
+        return;
+    }
+
+    SegmentRecord record;
+    memset(&record, 0, sizeof(record));
+    strset_init(&record.deps, &ctx->arena);
+    strset_init(&record.system, &ctx->arena);
+    Emitter captured = {capture, 0, 0, 0};
+    ctx->record = &record;
+    process_file_with_context(ctx, path, &captured, 0);
+    ctx->record = NULL;
+
+    if (fclose(capture) == 0 && !captured.failed) {
+        emit_write(em, text, len);
+        if (!record.uncacheable)
+            segment_add(ctx, key, index, &record, text, len);
+        cache->segments_built++;
+    } else {
+        em->failed = 1;
+    }
+    free(text);
+    free(record.dep_inlined);
+    strset_free(&record.deps);
+    strset_free(&record.system);
+}
+
+int is_sample_path(const char *rel) {
+    return strncmp(rel, "test/", 5) == 0 || strncmp(rel, "tests/", 6) == 0 ||
+           strncmp(rel, "example/", 8) == 0 ||
+           strncmp(rel, "examples/", 9) == 0 || strncmp(rel, "bench/", 6) == 0 ||
+           strncmp(rel, "benchmark/", 10) == 0 || strstr(rel, "/test/") ||
+           strstr(rel, "/tests/") || strstr(rel, "/example/") ||
+           strstr(rel, "/examples/");
+}
+
+/* Whether a #define of name only selects system interfaces (_GNU_SOURCE,
+   _POSIX_C_SOURCE, ...), which cannot change what a repository header
+   means once the system headers are in the preamble. */
+int is_feature_macro(const char *name) {
+    size_t len = strlen(name);
+    return strcmp(name, "_FILE_OFFSET_BITS") == 0 ||
+           (name[0] == '_' && len > 7 &&
+            strcmp(name + len - 7, "_SOURCE") == 0);
+}
+
+/* Index of the first directive of sf after which its includes may see
+   macros it set up for them: a #define other than its include guard's or a
+   feature macro. directive_count if there is none. */
+int first_configuring_define(SourceFile *sf) {
+    char keyword[16], text[4096], name[256];
+    for (int i = 0; i < sf->directive_count; i++) {
+        Directive *d = &sf->directives[i];
+        if (d->type != INCLUDE_DEFINE || d->reach == REACH_DEAD)
+            continue;
+        if (i == 1 && sf->directives[0].type == INCLUDE_IF)
+            continue; /* the guard */
+        PPParser pp = {text, NULL, 0, 0};
+        if (directive_text(sf->data + d->start, sf->data + d->next, keyword,
+                           sizeof(keyword), text, sizeof(text)) &&
+            pp_identifier(&pp, name, sizeof(name)) && is_feature_macro(name))
+            continue;
+        return i;
+    }
+    return sf->directive_count;
+}
+
+/* The include graph of a set of top-level files, as far as it decides
+   which headers can be emitted ahead of all of them. */
+typedef struct {
+    ConversionContext *ctx;
+    StrSet top;      /* the top-level files */
+    StrSet headers;  /* repository files reached, in post-order */
+    int *users;      /* top-level files reaching headers.items[i] */
+    int capacity;
+    StrSet visited;  /* reached from the current top-level file */
+    StrSet blocked;  /* may depend on macros set up by an includer */
+    StrSet checked;  /* looked at by defines_code */
+    StrSet code;     /* define something the linker sees, see below */
+    Arena arena;
+} IncludeGraph;
+
+/* Whether path, or a header it includes, defines a function or object
+   with external linkage. Such a header cannot go in the part of an STB
+   header that every includer compiles. Answers are kept in checked and
+   code. */
+int defines_code(ConversionContext *ctx, const char *path, StrSet *checked,
+                 StrSet *code) {
+    SourceFile *sf = source_cache_get(ctx->sources, path);
+    if (!sf)
+        return 0;
+    if (!strset_add(checked, sf->path))
+        return strset_contains(code, sf->path);
+    Symbol *symbols;
+    int n = source_symbols(ctx->sources, sf, &symbols), found = 0;
+    for (int i = 0; i < n && !found; i++)
+        found = symbols[i].external;
+    for (int i = 0; i < sf->directive_count && !found; i++) {
+        Directive *d = &sf->directives[i];
+        if (d->type == INCLUDE_LOCAL && d->reach != REACH_DEAD &&
+            source_resolve_include(ctx, sf, d) == TARGET_REPO)
+            found = defines_code(ctx, d->resolved, checked, code);
+    }
+    if (found)
+        strset_add(code, sf->path);
+    return found;
+}
+
+void graph_block(IncludeGraph *graph, const char *path) {
+    SourceFile *sf = source_cache_get(graph->ctx->sources, path);
+    if (!sf || !strset_add(&graph->blocked, sf->path))
+        return;
+    for (int i = 0; i < sf->directive_count; i++) {
+        Directive *d = &sf->directives[i];
+        if (d->type == INCLUDE_LOCAL && d->reach != REACH_DEAD &&
+            source_resolve_include(graph->ctx, sf, d) == TARGET_REPO)
+            graph_block(graph, d->resolved);
+    }
+}
+
+/* Walk the headers path includes, counting the current top-level file as a
+   user of each and adding each to headers after everything it includes.
+   Includes under undecided conditions or after a configuring #define block
+   their target from being emitted early. */
+void graph_visit(IncludeGraph *graph, const char *path) {
+    SourceFile *sf = source_cache_get(graph->ctx->sources, path);
+    if (!sf || !strset_add(&graph->visited, sf->path))
+        return;
+    int configured = first_configuring_define(sf);
+    for (int i = 0; i < sf->directive_count; i++) {
+        Directive *d = &sf->directives[i];
+        if (d->type != INCLUDE_LOCAL || d->reach == REACH_DEAD ||
+            source_resolve_include(graph->ctx, sf, d) != TARGET_REPO)
+            continue;
+        if (d->reach != REACH_LIVE || i > configured)
+            graph_block(graph, d->resolved);
+        if (d->reach == REACH_LIVE)
+            graph_visit(graph, d->resolved);
+    }
+
+    if (strset_contains(&graph->top, sf->path))
+        return;
+    int h = strset_index(&graph->headers, sf->path);
+    if (h < 0) {
+        if (!strset_add(&graph->headers, sf->path))
+            return;
+        h = graph->headers.count - 1;
+        if (h >= graph->capacity) {
+            int capacity = graph->capacity ? graph->capacity * 2 : 64;
+            int *users = realloc(graph->users, capacity * sizeof(*users));
+            if (!users) {
+                graph->headers.count--; /* keep the arrays in step */
+                return;
+            }
+            graph->users = users;
+            graph->capacity = capacity;
+        }
+        graph->users[h] = 0;
+    }
+    graph->users[h]++;
+}
+
+/* Add to shared the repository headers that two or more of c_files reach,
+   each after the headers it includes, so they can be emitted before any
+   translation unit. Headers whose meaning may depend on the file that
+   includes them are left where they are first included. The order only
+   depends on the file list and the sources, so it is stable.
+   For an STB header these are the declarations, so every header a .c file
+   reaches is taken, as long as it defines no code. */
+void shared_headers(ConversionContext *ctx, FileList *c_files,
+                    FileList *shared) {
+    int stb = ctx->options && ctx->options->stb;
+    IncludeGraph graph;
+    memset(&graph, 0, sizeof(graph));
+    graph.ctx = ctx;
+    strset_init(&graph.top, &graph.arena);
+    strset_init(&graph.headers, &graph.arena);
+    strset_init(&graph.blocked, &graph.arena);
+    strset_init(&graph.checked, &graph.arena);
+    strset_init(&graph.code, &graph.arena);
+    for (int i = 0; i < c_files->count; i++)
+        strset_add(&graph.top, c_files->paths[i]);
+
+    for (int i = 0; i < c_files->count; i++) {
+        strset_init(&graph.visited, &graph.arena);
+        graph_visit(&graph, c_files->paths[i]);
+        strset_free(&graph.visited);
+    }
+    for (int i = 0; i < graph.headers.count; i++) {
+        const char *path = graph.headers.items[i];
+        if (graph.users[i] > (stb ? 0 : 1) &&
+            !strset_contains(&graph.blocked, path) &&
+            !(stb && defines_code(ctx, path, &graph.checked, &graph.code)))
+            filelist_add(shared, path);
+    }
+
+    strset_free(&graph.top);
+    strset_free(&graph.headers);
+    strset_free(&graph.blocked);
+    strset_free(&graph.checked);
+    strset_free(&graph.code);
+    free(graph.users);
+    arena_free(&graph.arena);
+}
+
+/* Add to reached path and every repository file its includes would inline
+   that is not inlined yet, in inlining order. */
+void reach_files(ConversionContext *ctx, const char *path, StrSet *reached) {
+    SourceFile *sf = source_cache_get(ctx->sources, path);
+    if (!sf || is_file_inlined(ctx, sf->path) ||
+        !strset_add(reached, sf->path))
+        return;
+    for (int i = 0; i < sf->directive_count; i++) {
+        Directive *d = &sf->directives[i];
+        if (d->type == INCLUDE_LOCAL && d->reach != REACH_DEAD &&
+            source_resolve_include(ctx, sf, d) == TARGET_REPO)
+            reach_files(ctx, d->resolved, reached);
+    }
+}
+
+#define MAX_SHARDS 64
+
+/* How the .c files of a sharded header are split up: shard_of[i] is the
+   shard of c_files->paths[i]. Each shard's system includes are gathered
+   while it is emitted, so its preamble only has what it adds to the
+   declarations'. */
+typedef struct {
+    int count;
+    int *shard_of;
+    StrSet *standard;
+    StrSet *external;
+    Arena arena;
+} ShardPlan;
+
+/* A set of .c files that has to stay in one shard, with its weight. */
+typedef struct {
+    int root;
+    size_t bytes;
+} ShardGroup;
+
+int shard_group_heavier(const void *a, const void *b) {
+    const ShardGroup *x = a, *y = b;
+    if (x->bytes != y->bytes)
+        return x->bytes < y->bytes ? 1 : -1;
+    return x->root - y->root;
+}
+
+int group_find(int *parent, int i) {
+    while (parent[i] != i)
+        i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+/* Split c_files into count shards. Files that would inline the same
+   repository file (a header not hoisted into the declarations, or a .c
+   file) must share a shard, since only the first one inlines it; such
+   files form a group, weighed by the source bytes it emits. Groups are
+   dealt out heaviest first, each to the lightest shard so far. Returns 0
+   on allocation failure. */
+int plan_shards(ConversionContext *ctx, FileList *c_files, int count,
+                ShardPlan *plan) {
+    int n = c_files->count, ok = 0, owner_capacity = 0, group_count = 0;
+    memset(plan, 0, sizeof(*plan));
+    plan->count = count;
+    plan->shard_of = arena_alloc(&plan->arena, (n + 1) * sizeof(int));
+    plan->standard = arena_alloc(&plan->arena, count * sizeof(StrSet));
+    plan->external = arena_alloc(&plan->arena, count * sizeof(StrSet));
+    int *parent = malloc((n + 1) * sizeof(*parent));
+    int *slot = malloc((n + 1) * sizeof(*slot)); /* group of a root file */
+    int *owner = NULL; /* first file to reach seen.items[i] */
+    size_t *bytes = calloc(n + 1, sizeof(*bytes));
+    size_t *load = calloc(count, sizeof(*load));
+    ShardGroup *groups = malloc((n + 1) * sizeof(*groups));
+    Arena seen_arena = {0};
+    StrSet seen;
+    strset_init(&seen, &seen_arena);
+    for (int k = 0; plan->standard && plan->external && k < count; k++) {
+        strset_init(&plan->standard[k], &plan->arena);
+        strset_init(&plan->external[k], &plan->arena);
+    }
+    if (!plan->shard_of || !plan->standard || !plan->external || !parent ||
+        !slot || !bytes || !load || !groups)
+        goto done;
+
+    FileList shared = {0};
+    shared_headers(ctx, c_files, &shared);
+    for (int i = 0; i < shared.count; i++)
+        mark_file_inlined(ctx, shared.paths[i]);
+    filelist_free(&shared);
+
+    for (int i = 0; i < n; i++) {
+        parent[i] = i;
+        Arena reached_arena = {0};
+        StrSet reached;
+        strset_init(&reached, &reached_arena);
+        reach_files(ctx, c_files->paths[i], &reached);
+        int failed = 0;
+        for (int r = 0; r < reached.count && !failed; r++) {
+            int first = strset_index(&seen, reached.items[r]);
+            if (first >= 0) {
+                parent[group_find(parent, i)] =
+                    group_find(parent, owner[first]);
+                continue;
+            }
+            if (seen.count == owner_capacity) {
+                int capacity = owner_capacity ? owner_capacity * 2 : 256;
+                int *grown = realloc(owner, capacity * sizeof(*owner));
+                if (!grown) {
+                    failed = 1;
+                    break;
+                }
+                owner = grown;
+                owner_capacity = capacity;
+            }
+            failed = !strset_add(&seen, reached.items[r]);
+            owner[seen.count - 1] = i;
+            SourceFile *sf = source_cache_get(ctx->sources, reached.items[r]);
+            if (!sf)
+                continue;
+            bytes[i] += sf->size;
+            for (int d = 0; d < sf->drop_count; d++)
+                bytes[i] -= sf->drops[2 * d + 1] - sf->drops[2 * d];
+        }
+        strset_free(&reached);
+        arena_free(&reached_arena);
+        if (failed)
+            goto done;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (group_find(parent, i) == i) {
+            slot[i] = group_count;
+            groups[group_count++] = (ShardGroup){i, 0};
+        }
+    }
+    for (int i = 0; i < n; i++)
+        groups[slot[group_find(parent, i)]].bytes += bytes[i];
+    qsort(groups, group_count, sizeof(*groups), shard_group_heavier);
+    for (int g = 0; g < group_count; g++) {
+        int lightest = 0;
+        for (int k = 1; k < count; k++)
+            if (load[k] < load[lightest])
+                lightest = k;
+        load[lightest] += groups[g].bytes;
+        plan->shard_of[groups[g].root] = lightest;
+    }
+    for (int i = 0; i < n; i++)
+        plan->shard_of[i] = plan->shard_of[group_find(parent, i)];
+    for (int k = 0; k < count; k++) {
+        int files = 0;
+        for (int i = 0; i < n; i++)
+            files += plan->shard_of[i] == k;
+        log_progress("shard %d: %d files, %zu bytes", k, files, load[k]);
+    }
+    ok = 1;
+
+done:
+    /* Emitting starts from nothing inlined. */
+    strset_free(&ctx->inlined);
+    strset_init(&ctx->inlined, &ctx->arena);
+    free(parent);
+    free(slot);
+    free(owner);
+    free(bytes);
+    free(load);
+    free(groups);
+    strset_free(&seen);
+    arena_free(&seen_arena);
+    return ok;
+}
+
+void shard_plan_free(ShardPlan *plan) {
+    for (int k = 0; plan->standard && plan->external && k < plan->count;
+         k++) {
+        strset_free(&plan->standard[k]);
+        strset_free(&plan->external[k]);
+    }
+    arena_free(&plan->arena);
+}
+
+/* Emit each header of sweep that nothing has inlined yet, skipping those
+   in test and example directories and those in pending (a .c file will
+   inline them where it includes them). With code_only set, only headers
+   that define code are taken (and the others with it clear). */
+void emit_sweep(ConversionContext *ctx, Emitter *em, FileList *h_files,
+                StrSet *pending, StrSet *checked, StrSet *code,
+                int code_only) {
+    size_t repo_len = strlen(ctx->repo_dir);
+    for (int i = 0; i < h_files->count; i++) {
+        if (is_file_inlined(ctx, h_files->paths[i]) ||
+            (pending && strset_contains(pending, h_files->paths[i])))
+            continue;
+
+        /* Skip headers in test/example directories */
+        const char *rel = h_files->paths[i] + repo_len;
+        if (*rel == '/')
+            rel++;
+        if (is_sample_path(rel))
+            continue;
+        if (code &&
+            defines_code(ctx, h_files->paths[i], checked, code) != code_only)
+            continue;
+
+        mark_file_inlined(ctx, h_files->paths[i]);
+        emit_printf(em, "\n/* %s */\n", rel);
+        emit_file_segment(ctx, h_files->paths[i], em);
+    }
+}
+
+/* Emit the .c files of c_files that are in shard (every one if shard_of
+   is NULL). If line_map is non-NULL, records the output line range of
+   each. */
+void emit_sources(ConversionContext *ctx, Emitter *em, FileList *c_files,
+                  const int *shard_of, int shard, LineMap *line_map) {
+    size_t repo_len = strlen(ctx->repo_dir);
+    for (int i = 0; i < c_files->count; i++) {
+        if ((shard_of && shard_of[i] != shard) ||
+            is_file_inlined(ctx, c_files->paths[i]))
+            continue;
+        mark_file_inlined(ctx, c_files->paths[i]);
+
+        const char *rel = c_files->paths[i] + repo_len;
+        if (*rel == '/')
+            rel++;
+        emit_printf(em, "\n/* %s */\n", rel);
+
+        int start_line = em->lines + 1;
+        emit_file_segment(ctx, c_files->paths[i], em);
+
+        if (line_map)
+            linemap_add(line_map, c_files->paths[i], shard, start_line,
+                        em->lines);
+    }
+}
+
+/* #include lines for the headers of shard that base does not have. */
+void emit_shard_includes(Emitter *em, StrSet *shard, StrSet *base) {
+    for (int i = 0; i < shard->count; i++)
+        if (!strset_contains(base, shard->items[i]))
+            emit_printf(em, "#include <%s>\n", shard->items[i]);
+}
+
+/* Emit the code body: the headers several .c files share, then every .c
+   file with its remaining local headers inlined, then (if
+   sweep_remaining_headers) any header that was never reached. If line_map
+   is non-NULL, records the output line range of each .c file.
+   For an STB header the body is split at the end of the include guard:
+   the shared headers and the swept ones that define no code come first,
+   and the .c files only under <GUARD>_IMPLEMENTATION. With a shard plan,
+   each shard of .c files also compiles on its own under
+   <GUARD>_IMPLEMENTATION_SHARD_<k>, after the system includes only it
+   needs; the swept headers that define code go in the first shard. */
+void emit_body(ConversionContext *ctx, Emitter *em, const char *guard,
+               FileList *c_files, FileList *h_files, LineMap *line_map,
+               int sweep_remaining_headers, ShardPlan *plan) {
+    int stb = ctx->options && ctx->options->stb;
+    Arena code_arena = {0};
+    StrSet checked, code;
+    strset_init(&checked, &code_arena);
+    strset_init(&code, &code_arena);
+
+    FileList shared = {0};
+    shared_headers(ctx, c_files, &shared);
+    for (int i = 0; i < shared.count; i++) {
+        if (is_file_inlined(ctx, shared.paths[i]))
+            continue;
+        mark_file_inlined(ctx, shared.paths[i]);
+        const char *rel = source_relative(ctx->sources, shared.paths[i]);
+        emit_printf(em, "\n/* %s */\n", rel ? rel : shared.paths[i]);
+        emit_file_segment(ctx, shared.paths[i], em);
+    }
+    filelist_free(&shared);
+
+    if (stb) {
+        /* Headers left to the .c files may depend on what they define
+           first, so they stay out of the declarations. */
+        StrSet pending;
+        strset_init(&pending, &code_arena);
+        for (int i = 0; sweep_remaining_headers && i < c_files->count; i++)
+            reach_files(ctx, c_files->paths[i], &pending);
+        if (sweep_remaining_headers)
+            emit_sweep(ctx, em, h_files, &pending, &checked, &code, 0);
+        strset_free(&pending);
+        emit_printf(em, "\n#endif /* %s_COMBINED_H */\n", guard);
+    }
+
+    for (int k = 0; plan && k < plan->count; k++) {
+        emit_printf(em,
+                    "\n#if defined(%s_IMPLEMENTATION) || "
+                    "defined(%s_IMPLEMENTATION_SHARD_%d)\n",
+                    guard, guard, k);
+        emit_printf(em, "#ifndef %s_IMPLEMENTATION_SHARD_%d_INCLUDED\n",
+                    guard, k);
+        emit_printf(em, "#define %s_IMPLEMENTATION_SHARD_%d_INCLUDED\n",
+                    guard, k);
+        emit_shard_includes(em, &plan->standard[k], &ctx->standard);
+        emit_shard_includes(em, &plan->external[k], &ctx->external);
+
+        /* Gather the shard's system includes apart from the others. */
+        StrSet standard = ctx->standard, external = ctx->external;
+        ctx->standard = plan->standard[k];
+        ctx->external = plan->external[k];
+        emit_sources(ctx, em, c_files, plan->shard_of, k, line_map);
+        if (k == 0 && sweep_remaining_headers)
+            emit_sweep(ctx, em, h_files, NULL, &checked, &code, 1);
+        plan->standard[k] = ctx->standard;
+        plan->external[k] = ctx->external;
+        ctx->standard = standard;
+        ctx->external = external;
+
+        emit_printf(em, "\n#endif /* %s_IMPLEMENTATION_SHARD_%d_INCLUDED */\n",
+                    guard, k);
+        emit_printf(em, "#endif /* %s_IMPLEMENTATION_SHARD_%d */\n", guard,
+                    k);
+    }
+
+    if (!plan) {
+        if (stb) {
+            emit_printf(em, "\n#ifdef %s_IMPLEMENTATION\n", guard);
+            emit_printf(em, "#ifndef %s_IMPLEMENTATION_INCLUDED\n", guard);
+            emit_printf(em, "#define %s_IMPLEMENTATION_INCLUDED\n", guard);
+        }
+        emit_sources(ctx, em, c_files, NULL, 0, line_map);
+        if (sweep_remaining_headers)
+            emit_sweep(ctx, em, h_files, NULL, &checked, stb ? &code : NULL,
+                       1);
+        if (stb) {
+            emit_printf(em, "\n#endif /* %s_IMPLEMENTATION_INCLUDED */\n",
+                        guard);
+            emit_printf(em, "#endif /* %s_IMPLEMENTATION */\n", guard);
+        } else {
+            emit_printf(em, "\n#endif /* %s_COMBINED_H */\n", guard);
+        }
+    }
+    strset_free(&checked);
+    strset_free(&code);
+    arena_free(&code_arena);
+}
+
+/* Stream the combined header for the given file lists to out.
+ *
+ * The deduplicated #include preamble has to come first but is only known
+ * once every file has been walked, so a first pass runs the inliner with
+ * output discarded to collect it. The second pass writes the preamble and
+ * streams the body straight to out, so the header is never held in memory.
+ * Returns the number of bytes written, or 0 on failure. */
+size_t generate_header(FILE *out, SourceCache *sources, const char *repo_dir,
+                       const char *repo_name, FileList *c_files,
+                       FileList *h_files, LineMap *line_map,
+                       int sweep_remaining_headers,
+                       const ConvertOptions *options) {
+    double started = monotonic_seconds();
+    ConversionContext *ctx = context_create(repo_dir, sources);
+    if (!ctx)
+        return 0;
+    ctx->options = options;
+
+    char guard[256];
+    make_guard_name(repo_name, guard, sizeof(guard));
+
+    ShardPlan plan, *shards = NULL;
+    if (options->shards > 1) {
+        if (!plan_shards(ctx, c_files, options->shards, &plan)) {
+            shard_plan_free(&plan);
+            context_free(ctx);
+            return 0;
+        }
+        shards = &plan;
+    }
+
+    Emitter collect = {0};
+    emit_body(ctx, &collect, guard, c_files, h_files, NULL,
+              sweep_remaining_headers, shards);
+
+    /* The include lists are complete; start inlining from scratch. */
+    strset_free(&ctx->inlined);
+    strset_init(&ctx->inlined, &ctx->arena);
+
+    Emitter em = {out, 0, 0, 0};
+    emit_printf(&em, "#ifndef %s_COMBINED_H\n", guard);
+    emit_printf(&em, "#define %s_COMBINED_H\n\n", guard);
+    emit_printf(&em,
+                "/*\n * Auto-generated header-only file\n"
+                " * Repository: %s\n */\n\n",
+                repo_name);
+
+    if (ctx->standard.count > 0) {
+        for (int i = 0; i < ctx->standard.count; i++)
+            emit_printf(&em, "#include <%s>\n", ctx->standard.items[i]);
+        emit_write(&em, "\n", 1);
+    }
+
+    if (ctx->external.count > 0) {
+        for (int i = 0; i < ctx->external.count; i++)
+            emit_printf(&em, "#include <%s>\n", ctx->external.items[i]);
+        emit_write(&em, "\n", 1);
+    }
+
+    emit_body(ctx, &em, guard, c_files, h_files, line_map,
+              sweep_remaining_headers, shards);
+
+    stats_record(PHASE_GENERATE, started, ctx->inlined.count,
+                 (long long)em.bytes);
+    metrics_count(COUNTER_FILES_INLINED, (unsigned long long)ctx->inlined.count);
+    metrics_count(COUNTER_BYTES_EMITTED, em.bytes);
+    if (shards)
+        shard_plan_free(shards);
+    context_free(ctx);
+    return ferror(out) || em.failed ? 0 : em.bytes;
+}
+
+/* Write the combined header to path. Returns 1 on success. */
+int generate_header_file(const char *path, SourceCache *sources,
+                         const char *repo_dir, const char *repo_name,
+                         FileList *c_files, FileList *h_files,
+                         LineMap *line_map, int sweep_remaining_headers,
+                         const ConvertOptions *options) {
+    FILE *out = fopen(path, "w");
+    if (!out)
+        return 0;
+    size_t written =
+        generate_header(out, sources, repo_dir, repo_name, c_files, h_files,
+                        line_map, sweep_remaining_headers, options);
+    if (fclose(out) != 0 || written == 0) {
+        remove(path);
+        return 0;
+    }
+    return 1;
+}
+
+#define MAX_PARALLEL_COMPILES 8
+
+/* One exclusion set tried during a compile-feedback round. */
+typedef struct {
+    FileList files; /* .c files kept in this candidate */
+    int excluded;   /* how many files it drops from the round's list */
+    int generated;
+    LineMap lmap;
+    char path[MAX_PATH_LEN]; /* generated header, removed on free */
+    char *errors;
+    int rc;
+    int error_count;
+} FeedbackCandidate;
+
+void candidate_free(FeedbackCandidate *cand) {
+    filelist_free(&cand->files);
+    linemap_free(&cand->lmap);
+    if (cand->path[0])
+        remove(cand->path);
+    free(cand->errors);
+    memset(cand, 0, sizeof(*cand));
+}
+
+/* Set cand up as base without the files in drop[0..drop_count). */
+void candidate_init(FeedbackCandidate *cand, FileList *base,
+                    const char **drop, int drop_count) {
+    memset(cand, 0, sizeof(*cand));
+    for (int i = 0; i < base->count; i++) {
+        int dropped = 0;
+        for (int j = 0; j < drop_count && !dropped; j++)
+            dropped = strcmp(base->paths[i], drop[j]) == 0;
+        if (!dropped)
+            filelist_add(&cand->files, base->paths[i]);
+    }
+    cand->excluded = base->count - cand->files.count;
+}
+
+/* Generate and syntax-check every candidate, running the gcc processes
+   concurrently. */
+void evaluate_candidates(FeedbackCandidate *cands, int count,
+                         SourceCache *sources, const char *repo_dir,
+                         const char *repo_name, FileList *h_files,
+                         const char *work_dir, const ConvertOptions *options) {
+    FILE *pipes[MAX_PARALLEL_COMPILES] = {0};
+    char define[256 + 16] = "";
+    if (options->stb) {
+        make_guard_name(repo_name, define, 256);
+        strcat(define, "_IMPLEMENTATION");
+    }
+
+    for (int i = 0; i < count; i++) {
+        FeedbackCandidate *cand = &cands[i];
+        cand->rc = -1;
+
+        snprintf(cand->path, sizeof(cand->path), "%s/.giga_test_XXXXXX",
+                 work_dir);
+        int fd = mkstemp(cand->path);
+        if (fd < 0) {
+            cand->path[0] = '\0';
+            continue;
+        }
+        close(fd);
+        /* A slice only has the headers its code includes. */
+        cand->generated = generate_header_file(
+            cand->path, sources, repo_dir, repo_name, &cand->files, h_files,
+            &cand->lmap, options->root_count == 0, options);
+    }
+
+    /* All headers are written before gcc starts so the compile phase
+       measures only the checks. */
+    double started = monotonic_seconds();
+    int runs = 0;
+    for (int i = 0; i < count; i++) {
+        if (cands[i].generated &&
+            (pipes[i] = start_compile(cands[i].path,
+                                      define[0] ? define : NULL)))
+            runs++;
+    }
+
+    for (int i = 0; i < count; i++) {
+        FeedbackCandidate *cand = &cands[i];
+        if (pipes[i])
+            cand->rc = finish_compile(pipes[i], &cand->errors);
+        if (!cand->errors)
+            cand->errors = strdup("");
+    }
+    if (runs > 0) {
+        stats_record(PHASE_COMPILE, started, runs, 0);
+        metrics_count(COUNTER_GCC_RUNS, (unsigned long long)runs);
+    }
+}
+
+/* Order candidates: clean compiles first, then fewer errors, then fewer
+   excluded files. Candidates that failed to generate sort last. */
+int candidate_better(FeedbackCandidate *a, FeedbackCandidate *b) {
+    if (!a->generated || !b->generated)
+        return a->generated;
+    if ((a->rc == 0) != (b->rc == 0))
+        return a->rc == 0;
+    if (a->rc != 0 && a->error_count != b->error_count)
+        return a->error_count < b->error_count;
+    return a->excluded < b->excluded;
+}
+
+/* File-scope names defined so far in a combined header being predicted,
+   keyed by symbol space and name. owners[i] is the file that defined
+   keys.items[i]. */
+typedef struct {
+    StrSet keys;
+    const char **owners;
+    uint64_t *text_ids;
+    int capacity;
+    Arena arena;
+} SymbolTable;
+
+void symbol_key(const Symbol *sym, char *key, size_t key_size) {
+    snprintf(key, key_size, "%c:%s", "otm"[sym->space], sym->name);
+}
+
+void symbol_table_add(SymbolTable *table, const Symbol *sym,
+                      const char *owner) {
+    char key[300];
+    symbol_key(sym, key, sizeof(key));
+    if (!strset_add(&table->keys, key))
+        return;
+    int i = table->keys.count - 1;
+    if (i >= table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 256;
+        const char **owners =
+            realloc(table->owners, capacity * sizeof(*owners));
+        if (owners)
+            table->owners = owners;
+        uint64_t *ids = realloc(table->text_ids, capacity * sizeof(*ids));
+        if (ids)
+            table->text_ids = ids;
+        if (!owners || !ids) {
+            table->keys.count--; /* keep the arrays in step */
+            return;
+        }
+        table->capacity = capacity;
+    }
+    table->owners[i] = owner;
+    table->text_ids[i] = sym->text_id;
+}
+
+/* The file that already defines sym differently, if any. */
+const char *symbol_table_clash(SymbolTable *table, const Symbol *sym,
+                               const char *owner) {
+    char key[300];
+    symbol_key(sym, key, sizeof(key));
+    int i = strset_index(&table->keys, key);
+    if (i < 0 || strcmp(table->owners[i], owner) == 0 ||
+        (sym->text_id && sym->text_id == table->text_ids[i]))
+        return NULL;
+    return table->owners[i];
+}
+
+/* sym as it appears in the output, after any rename by sf. */
+Symbol symbol_emitted(SourceFile *sf, const Symbol *sym) {
+    Symbol out = *sym;
+    const char *renamed = sym->space == SYMBOL_ORDINARY
+                              ? source_renamed(sf, sym->name, strlen(sym->name))
+                              : NULL;
+    if (renamed)
+        out.name = renamed;
+    return out;
+}
+
+/* Whether sym's definition was pruned from sf. */
+int symbol_pruned(SourceFile *sf, const Symbol *sym) {
+    int lo = 0, hi = sf->drop_count - 1;
+    while (lo <= hi && sym->end > sym->start) {
+        int mid = lo + (hi - lo) / 2;
+        if (sym->start < sf->drops[2 * mid])
+            hi = mid - 1;
+        else if (sym->start > sf->drops[2 * mid])
+            lo = mid + 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether name is free for sf to use at file scope. */
+int symbol_name_free(SymbolTable *table, SourceFile *sf, Symbol *symbols,
+                     int n, const char *name) {
+    Symbol probe = {name, SYMBOL_ORDINARY, 0, 0, 0, 0, 0};
+    char key[300];
+    symbol_key(&probe, key, sizeof(key));
+    if (strset_contains(&table->keys, key))
+        return 0;
+    for (int i = 0; i < n; i++)
+        if (symbols[i].space == SYMBOL_ORDINARY &&
+            strcmp(symbols[i].name, name) == 0)
+            return 0;
+    return source_renamed(sf, name, strlen(name)) == NULL;
+}
+
+/* Give every static of the .c file sf that clashes with table a name of
+   its own: the file's path relative to the repository, as an identifier,
+   joined to the old name. */
+void plan_renames(SourceCache *sources, SourceFile *sf, SymbolTable *table) {
+    Symbol *symbols;
+    int n = source_symbols(sources, sf, &symbols), count = 0;
+    for (int i = 0; i < n; i++)
+        count += symbols[i].space == SYMBOL_ORDINARY && symbols[i].is_static &&
+                 symbol_table_clash(table, &symbols[i], sf->path) != NULL;
+    const char **renames =
+        count ? arena_alloc(&sources->arena, 2 * count * sizeof(*renames))
+              : NULL;
+    if (!renames)
+        return;
+
+    char prefix[MAX_PATH_LEN];
+    const char *rel = source_relative(sources, sf->path);
+    if (!rel)
+        rel = strrchr(sf->path, '/') ? strrchr(sf->path, '/') + 1 : sf->path;
+    size_t len = 0;
+    if (isdigit((unsigned char)*rel))
+        prefix[len++] = '_';
+    for (; *rel && strcmp(rel, ".c") != 0 && len + 1 < sizeof(prefix); rel++)
+        prefix[len++] = isalnum((unsigned char)*rel) ? *rel : '_';
+    prefix[len] = '\0';
+
+    for (int i = 0; i < n && sf->rename_count < count; i++) {
+        if (symbols[i].space != SYMBOL_ORDINARY || !symbols[i].is_static ||
+            !symbol_table_clash(table, &symbols[i], sf->path))
+            continue;
+        char name[MAX_PATH_LEN + 300];
+        snprintf(name, sizeof(name), "%s_%s", prefix, symbols[i].name);
+        for (int k = 2; !symbol_name_free(table, sf, symbols, n, name); k++)
+            snprintf(name, sizeof(name), "%s_%s_%d", prefix, symbols[i].name,
+                     k);
+        const char *copy = arena_strdup(&sources->arena, name);
+        if (!copy)
+            break;
+        renames[2 * sf->rename_count] = symbols[i].name;
+        renames[2 * sf->rename_count + 1] = copy;
+        /* Published one at a time so each new name is checked against the
+           ones chosen before it. */
+        sf->renames = renames;
+        sf->rename_count++;
+        log_progress("renamed: %s to %s in %s", symbols[i].name, copy,
+                     sf->path);
+    }
+}
+
+/* Add every symbol of the files in reached to table and count them as
+   inlined. */
+void symbols_commit(ConversionContext *ctx, SymbolTable *table,
+                    StrSet *reached) {
+    for (int f = 0; f < reached->count; f++) {
+        SourceFile *sf = source_cache_get(ctx->sources, reached->items[f]);
+        Symbol *symbols;
+        int n = sf ? source_symbols(ctx->sources, sf, &symbols) : 0;
+        for (int s = 0; s < n; s++) {
+            if (symbols[s].space == SYMBOL_MACRO ||
+                symbol_pruned(sf, &symbols[s]))
+                continue;
+            Symbol sym = symbol_emitted(sf, &symbols[s]);
+            symbol_table_add(table, &sym, sf->path);
+        }
+        mark_file_inlined(ctx, reached->items[f]);
+    }
+}
+
+/* Whether name appears as an identifier in [p, end), outside comments
+   and literals. */
+int text_mentions(const char *p, const char *end, const char *name) {
+    size_t name_len = strlen(name);
+    while (p < end) {
+        char c = *p;
+        if (c == '/' && p + 1 < end && p[1] == '*') {
+            const char *close = memmem(p + 2, (size_t)(end - p - 2), "*/", 2);
+            p = close ? close + 2 : end;
+        } else if (c == '/' && p + 1 < end && p[1] == '/') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (c == '"' || c == '\'') {
+            p++;
+            while (p < end && *p != c && *p != '\n')
+                p += *p == '\\' && p + 1 < end ? 2 : 1;
+            if (p < end && *p == c)
+                p++;
+        } else if (isalnum((unsigned char)c) || c == '_') {
+            const char *start = p;
+            while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+                p++;
+            if ((size_t)(p - start) == name_len &&
+                memcmp(start, name, name_len) == 0)
+                return 1;
+        } else {
+            p++;
+        }
+    }
+    return 0;
+}
+
+/* Whether a macro defined in a repository header that path includes,
+   directly or not, mentions name. A static of path's with that name
+   cannot be renamed: the header is emitted once, unchanged, so the macro
+   would still expand to the old name. */
+int header_macros_mention(ConversionContext *ctx, const char *path,
+                          const char *name, StrSet *visited) {
+    SourceFile *sf = source_cache_get(ctx->sources, path);
+    if (!sf || !strset_add(visited, sf->path))
+        return 0;
+    int top = visited->count == 1;
+    for (int i = 0; i < sf->directive_count; i++) {
+        Directive *d = &sf->directives[i];
+        if (d->reach == REACH_DEAD)
+            continue;
+        if (d->type == INCLUDE_DEFINE && !top &&
+            text_mentions(sf->data + d->start, sf->data + d->next, name))
+            return 1;
+        if (d->type == INCLUDE_LOCAL &&
+            source_resolve_include(ctx, sf, d) == TARGET_REPO &&
+            header_macros_mention(ctx, d->resolved, name, visited))
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether the static name of the .c file path can be renamed. */
+int static_renamable(ConversionContext *ctx, const char *path,
+                     const char *name) {
+    Arena visited_arena = {0};
+    StrSet visited;
+    strset_init(&visited, &visited_arena);
+    int mentioned = header_macros_mention(ctx, path, name, &visited);
+    strset_free(&visited);
+    arena_free(&visited_arena);
+    return !mentioned;
+}
+
+/* Predict, without compiling, which of c_files would redefine a name that
+   an earlier file in the combined header already defines. The shared
+   headers emit_body puts first are taken as they are; then each file is
+   checked together with the headers it would be first to inline. When
+   only the file's own statics clash, and no header macro refers to them,
+   they are renamed (see plan_renames); otherwise the file is added to
+   offenders, if given, and left out of the simulation so the headers it
+   reaches stay available to later files.
+   Macros are not compared: gcc only warns when one is redefined, and the
+   new definition applies to the text after it. Returns the number of
+   offenders. */
+int predict_collisions(SourceCache *sources, const char *repo_dir,
+                       FileList *c_files, StrSet *offenders,
+                       const ConvertOptions *options) {
+    ConversionContext *ctx = context_create(repo_dir, sources);
+    if (!ctx)
+        return 0;
+    ctx->options = options;
+    SymbolTable table;
+    memset(&table, 0, sizeof(table));
+    strset_init(&table.keys, &table.arena);
+    int offender_count = 0;
+
+    FileList shared = {0};
+    shared_headers(ctx, c_files, &shared);
+    for (int i = 0; i < shared.count; i++) {
+        Arena reached_arena = {0};
+        StrSet reached;
+        strset_init(&reached, &reached_arena);
+        reach_files(ctx, shared.paths[i], &reached);
+        symbols_commit(ctx, &table, &reached);
+        strset_free(&reached);
+        arena_free(&reached_arena);
+    }
+    filelist_free(&shared);
+
+    for (int i = 0; i < c_files->count; i++) {
+        if (is_file_inlined(ctx, c_files->paths[i]))
+            continue;
+        Arena reached_arena = {0};
+        StrSet reached;
+        strset_init(&reached, &reached_arena);
+        reach_files(ctx, c_files->paths[i], &reached);
+
+        const char *clash = NULL, *owner = NULL;
+        int renamable = 0;
+        for (int f = 0; f < reached.count && !clash; f++) {
+            SourceFile *sf = source_cache_get(sources, reached.items[f]);
+            Symbol *symbols;
+            int n = sf ? source_symbols(sources, sf, &symbols) : 0;
+            for (int s = 0; s < n && !clash; s++) {
+                if (symbols[s].space == SYMBOL_MACRO ||
+                    symbol_pruned(sf, &symbols[s]))
                     continue;
-                /* Skip to after '=' */
-                char *eq = strchr(var, '=');
-                if (!eq)
+                Symbol sym = symbol_emitted(sf, &symbols[s]);
+                const char *other = symbol_table_clash(&table, &sym, sf->path);
+                if (!other)
                     continue;
-                eq++;
-                while (*eq == ' ' || *eq == '\t')
-                    eq++;
+                /* reached.items[0] is the .c file itself. */
+                if (f == 0 && sym.is_static && !sf->rename_count &&
+                    static_renamable(ctx, sf->path, symbols[s].name)) {
+                    renamable++;
+                } else {
+                    clash = sym.name;
+                    owner = other;
+                }
+            }
+        }
 
-                /* Extract filenames from this line */
-                char *tok = eq;
-                while (*tok) {
-                    while (*tok == ' ' || *tok == '\t' || *tok == '\\')
-                        tok++;
-                    if (!*tok)
-                        break;
-                    char *end = tok;
-                    while (*end && *end != ' ' && *end != '\t' && *end != '\\')
-                        end++;
-                    size_t tlen = (size_t)(end - tok);
-                    char fname[MAX_PATH_LEN];
-                    if (tlen > 0 && tlen < sizeof(fname)) {
-                        memcpy(fname, tok, tlen);
-                        fname[tlen] = '\0';
+        if (clash) {
+            log_progress("conflict: %s redefines %s from %s",
+                         c_files->paths[i], clash, owner);
+            offender_count++;
+        }
+        if (clash && offenders) {
+            strset_add(offenders, c_files->paths[i]);
+        } else {
+            if (renamable)
+                plan_renames(sources, source_cache_get(sources,
+                                                       reached.items[0]),
+                             &table);
+            symbols_commit(ctx, &table, &reached);
+        }
+        strset_free(&reached);
+        arena_free(&reached_arena);
+    }
 
-                        /* Convert .o to .c */
-                        char *ext = strrchr(fname, '.');
-                        if (ext && strcmp(ext, ".o") == 0) {
-                            ext[1] = 'c';
-                            ext[2] = '\0';
-                        }
+    strset_free(&table.keys);
+    free(table.owners);
+    free(table.text_ids);
+    arena_free(&table.arena);
+    context_free(ctx);
+    return offender_count;
+}
 
-                        if (ext && (strcmp(strrchr(fname, '.'), ".c") == 0)) {
-                            const char *base = strrchr(fname, '/');
-                            base = base ? base + 1 : fname;
-                            for (int i = 0; i < all_c->count; i++) {
-                                const char *cbase =
-                                    strrchr(all_c->paths[i], '/');
-                                cbase = cbase ? cbase + 1 : all_c->paths[i];
-                                if (strcmp(cbase, base) == 0 &&
-                                    result.count < MAX_FILES) {
-                                    /* Avoid duplicates */
-                                    int dup = 0;
-                                    for (int d = 0; d < result.count; d++) {
-                                        if (strcmp(result.paths[d],
-                                                   all_c->paths[i]) == 0) {
-                                            dup = 1;
-                                            break;
-                                        }
-                                    }
-                                    if (!dup) {
-                                        strncpy(result.paths[result.count],
-                                                all_c->paths[i],
-                                                MAX_PATH_LEN - 1);
-                                        result.count++;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                    tok = end;
-                }
+/* Add to names the identifiers in sf's bytes [from, to), skipping comments
+   and literals, each as "<file> <name>" so a name can be looked up from the
+   file that mentions it. Unless calls is set, a name followed by '('
+   outside a preprocessor line is taken to be a declaration or macro use
+   and left out, so a static's own prototype does not count as a use of
+   it. */
+void collect_names(StrSet *names, int file, SourceFile *sf, size_t from,
+                   size_t to, int calls) {
+    const char *p = sf->data + from, *end = sf->data + to;
+    int line_start = 1, directive = 0;
+    char name[256], key[300];
+    while (p < end) {
+        char c = *p;
+        if (c == '\n') {
+            directive &= p > sf->data && p[-1] == '\\';
+            line_start = 1;
+            p++;
+            continue;
+        }
+        if (c == '#' && line_start)
+            directive = 1;
+        if (!isspace((unsigned char)c))
+            line_start = 0;
+        if (c == '/' && p + 1 < end && p[1] == '/') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (c == '/' && p + 1 < end && p[1] == '*') {
+            const char *close = memmem(p + 2, (size_t)(end - p - 2), "*/", 2);
+            p = close ? close + 2 : end;
+        } else if (c == '"' || c == '\'') {
+            p++;
+            while (p < end && *p != c && *p != '\n')
+                p += *p == '\\' && p + 1 < end ? 2 : 1;
+            if (p < end && *p == c)
+                p++;
+        } else if (isdigit((unsigned char)c)) {
+            while (p < end && (isalnum((unsigned char)*p) || *p == '.' ||
+                               *p == '_'))
+                p++;
+        } else if (isalpha((unsigned char)c) || c == '_') {
+            const char *start = p;
+            while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+                p++;
+            size_t len = (size_t)(p - start);
+            const char *after = p;
+            while (after < end && (*after == ' ' || *after == '\t'))
+                after++;
+            if (len >= sizeof(name) ||
+                (!calls && !directive && after < end && *after == '('))
+                continue;
+            memcpy(name, start, len);
+            name[len] = '\0';
+            snprintf(key, sizeof(key), "%d %s", file, name);
+            strset_add(names, key);
+        } else {
+            p++;
+        }
+    }
+}
+
+/* A function or object defined at file scope, as pruning sees it. */
+int symbol_is_definition(const Symbol *sym) {
+    return sym->space == SYMBOL_ORDINARY && (sym->is_static || sym->external);
+}
+
+/* Whether symbols[i], a static definition (or any definition, with
+   externals set), can be cut from sf on its own: everything else its
+   declaration declares could be too (those share its start and sit next
+   to it) and none of sf's preprocessor lines falls inside it. */
+int definition_droppable(SourceFile *sf, Symbol *symbols, int n, int i,
+                         int externals) {
+    Symbol *sym = &symbols[i];
+    int first = i, last = i;
+    while (first > 0 && symbols[first - 1].start == sym->start)
+        first--;
+    while (last + 1 < n && symbols[last + 1].start == sym->start)
+        last++;
+    for (int j = first; j <= last; j++)
+        if (!symbol_is_definition(&symbols[j]) ||
+            !(symbols[j].is_static || externals) ||
+            symbols[j].end <= symbols[j].start)
+            return 0;
+
+    int lo = 0, hi = sf->directive_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (sf->directives[mid].start < sym->start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo == sf->directive_count || sf->directives[lo].start >= sym->end;
+}
+
+/* One definition in the reference graph; next chains the definitions of
+   the same name. */
+typedef struct {
+    int file;
+    int symbol;
+    int next;
+} PruneDef;
+
+/* Which definitions in the chain from head a mention of a name in file
+   (-1 for a root) refers to: that file's own statics, which hide the
+   rest; failing those, the external definitions; failing those, any, as
+   when a .c file includes another. */
+int mention_target(PruneDef *defs, int head, Symbol **symbols, int file) {
+    int target = 2;
+    for (int d = head; d >= 0 && target > 0; d = defs[d].next) {
+        Symbol *sym = &symbols[defs[d].file][defs[d].symbol];
+        if (sym->is_static && defs[d].file == file)
+            target = 0;
+        else if (sym->external)
+            target = 1;
+    }
+    return target;
+}
+
+/* Record the start and end of every droppable definition of sf that live
+   does not mark, unless it is declared together with one it does. */
+void plan_drops(SourceCache *sources, SourceFile *sf, Symbol *symbols, int n,
+                const unsigned char *live, int externals) {
+    int count = 0;
+    size_t *drops = NULL;
+    for (int i = 0; i < n; i++) {
+        Symbol *sym = &symbols[i];
+        if (live[i] || !definition_droppable(sf, symbols, n, i, externals) ||
+            (count && drops[2 * count - 2] == sym->start))
+            continue;
+        int keep = 0;
+        for (int j = i + 1; j < n && symbols[j].start == sym->start; j++)
+            keep |= live[j];
+        if (keep)
+            continue;
+        if (!drops) {
+            drops = arena_alloc(&sources->arena, 2 * n * sizeof(*drops));
+            if (!drops)
+                return;
+        }
+        /* A definition on lines of its own takes its line break along. */
+        size_t end = sym->end;
+        if (end < sf->size && sf->data[end] == '\n' &&
+            (sym->start == 0 || sf->data[sym->start - 1] == '\n'))
+            end++;
+        drops[2 * count] = sym->start;
+        drops[2 * count + 1] = end;
+        count++;
+    }
+    if (count)
+        log_progress("pruned: %d definitions from %s", count, sf->path);
+    sf->drops = drops;
+    sf->drop_count = count;
+}
+
+/* Leave out of the output the code nothing public reaches. The names the
+   repository's headers mention (outside test and example directories) are
+   the roots; if none of them is defined in c_files, every external
+   definition is. A .c file stays if one of its external definitions is
+   needed, and then all of them are. Its statics are cut when nothing
+   needed mentions them; forward declarations are kept. Mentions are
+   matched by name (see mention_target), so a local variable named like a
+   static keeps it, but nothing used is dropped. .c files left with
+   nothing needed are removed from c_files.
+   Given roots, only what they need is kept (a slice): the roots replace
+   the headers' names, and external definitions are cut like statics.
+   Returns how many of the roots c_files defines. */
+int prune_unreachable(SourceCache *sources, FileList *c_files,
+                      FileList *h_files, const char *const *roots,
+                      int root_count) {
+    double started = monotonic_seconds();
+    int files = c_files->count;
+    SourceFile **units = calloc(files ? files : 1, sizeof(*units));
+    Symbol **symbols = calloc(files ? files : 1, sizeof(*symbols));
+    int *counts = calloc(files ? files : 1, sizeof(*counts));
+    unsigned char **live = calloc(files ? files : 1, sizeof(*live));
+    unsigned char *reached = calloc(files ? files : 1, 1);
+    Arena arena = {0};
+    StrSet defined, needed;
+    strset_init(&defined, &arena);
+    strset_init(&needed, &arena);
+    PruneDef *defs = NULL;
+    int *heads = NULL, def_count = 0, def_capacity = 0, head_capacity = 0;
+    int slice = root_count > 0, found = 0;
+    if (!units || !symbols || !counts || !live || !reached)
+        goto done;
+
+    for (int f = 0; f < files; f++) {
+        units[f] = source_cache_get(sources, c_files->paths[f]);
+        if (!units[f])
+            continue;
+        counts[f] = source_symbols(sources, units[f], &symbols[f]);
+        live[f] = calloc(counts[f] ? counts[f] : 1, 1);
+        if (!live[f])
+            goto done;
+        for (int s = 0; s < counts[f]; s++) {
+            if (!symbol_is_definition(&symbols[f][s]))
+                continue;
+            strset_add(&defined, symbols[f][s].name);
+            int h = strset_index(&defined, symbols[f][s].name);
+            if (h < 0)
+                goto done;
+            if (h >= head_capacity) {
+                int capacity = head_capacity ? head_capacity * 2 : 256;
+                int *grown = realloc(heads, capacity * sizeof(*heads));
+                if (!grown)
+                    goto done;
+                for (int i = head_capacity; i < capacity; i++)
+                    grown[i] = -1;
+                heads = grown;
+                head_capacity = capacity;
             }
-            line = nl ? nl + 1 : line + llen;
+            if (def_count == def_capacity) {
+                int capacity = def_capacity ? def_capacity * 2 : 256;
+                PruneDef *grown = realloc(defs, capacity * sizeof(*defs));
+                if (!grown)
+                    goto done;
+                defs = grown;
+                def_capacity = capacity;
+            }
+            defs[def_count] = (PruneDef){f, s, heads[h]};
+            heads[h] = def_count++;
         }
-        free(content);
-        if (result.count > 0)
-            return result;
     }
 
-    /* Try meson.build */
-    snprintf(path, sizeof(path), "%s/meson.build", repo_dir);
-    content = read_file_content(path);
-    if (content) {
-        const char *lib_funcs[] = {"library(", "static_library(",
-                                   "shared_library(", NULL};
-        for (int lf = 0; lib_funcs[lf]; lf++) {
-            char *p = content;
-            while ((p = strstr(p, lib_funcs[lf])) != NULL) {
-                char *paren = strchr(p, '(');
-                if (!paren) {
-                    p++;
-                    continue;
-                }
+    char key[300];
+    for (int i = 0; i < root_count; i++) {
+        snprintf(key, sizeof(key), "-1 %s", roots[i]);
+        strset_add(&needed, key);
+        if (strset_contains(&defined, roots[i]))
+            found++;
+        else
+            log_progress("slice: %s is not defined by any source", roots[i]);
+    }
+    for (int i = 0; i < h_files->count && !slice; i++) {
+        const char *rel = source_relative(sources, h_files->paths[i]);
+        SourceFile *sf = source_cache_get(sources, h_files->paths[i]);
+        if (sf && !(rel && is_sample_path(rel)))
+            collect_names(&needed, -1, sf, 0, sf->size, 1);
+    }
+    int rooted = slice;
+    for (int i = 0; i < def_count && !rooted; i++) {
+        Symbol *sym = &symbols[defs[i].file][defs[i].symbol];
+        snprintf(key, sizeof(key), "-1 %s", sym->name);
+        rooted = sym->external && strset_contains(&needed, key);
+    }
+    for (int i = 0; i < def_count && !rooted; i++) {
+        Symbol *sym = &symbols[defs[i].file][defs[i].symbol];
+        snprintf(key, sizeof(key), "-1 %s", sym->name);
+        if (sym->external)
+            strset_add(&needed, key);
+    }
 
-                /* Find matching close paren (simple, not nested) */
-                char *close = strchr(paren, ')');
-                if (!close) {
-                    p++;
-                    continue;
+    /* needed grows while it is walked: each mention brings in what the
+       code it refers to mentions. */
+    for (int k = 0; k < needed.count; k++) {
+        int from = -1, offset = 0;
+        sscanf(needed.items[k], "%d %n", &from, &offset);
+        int h = strset_index(&defined, needed.items[k] + offset);
+        int target = h < 0 ? 0 : mention_target(defs, heads[h], symbols, from);
+        for (int d = h < 0 ? -1 : heads[h]; d >= 0; d = defs[d].next) {
+            int f = defs[d].file;
+            Symbol *sym = &symbols[f][defs[d].symbol];
+            if ((target == 0 && (f != from || !sym->is_static)) ||
+                (target == 1 && !sym->external))
+                continue;
+            live[f][defs[d].symbol] = 1;
+            collect_names(&needed, f, units[f], sym->start, sym->end, 1);
+            if ((!sym->external && !slice) || reached[f])
+                continue;
+            reached[f] = 1;
+            /* Everything outside the definitions it may cut stays with
+               it. */
+            size_t start = 0;
+            for (int s = 0; s < counts[f]; s++) {
+                Symbol *other = &symbols[f][s];
+                if (other->start >= start &&
+                    definition_droppable(units[f], symbols[f], counts[f], s,
+                                         slice)) {
+                    collect_names(&needed, f, units[f], start, other->start,
+                                  0);
+                    start = other->end;
+                } else if (symbol_is_definition(other) &&
+                           (other->is_static || slice)) {
+                    collect_names(&needed, f, units[f], other->start,
+                                  other->end, 1);
                 }
+                if (other->external && !slice) {
+                    snprintf(key, sizeof(key), "%d %s", f, other->name);
+                    strset_add(&needed, key);
+                }
+            }
+            collect_names(&needed, f, units[f], start, units[f]->size, 0);
+        }
+    }
 
-                /* Extract quoted .c filenames */
-                char *s = paren;
-                while (s < close) {
-                    char *q = strchr(s, '\'');
-                    if (!q || q >= close)
-                        break;
-                    char *q2 = strchr(q + 1, '\'');
-                    if (!q2 || q2 >= close)
-                        break;
+    for (int f = 0; f < files; f++)
+        if (units[f] && reached[f])
+            plan_drops(sources, units[f], symbols[f], counts[f], live[f],
+                       slice);
+    for (int f = 0; f < files; f++) {
+        if (units[f] && !reached[f]) {
+            log_progress("pruned: %s", units[f]->path);
+            remove_from_filelist(c_files, units[f]->path);
+        }
+    }
 
-                    size_t slen = (size_t)(q2 - q - 1);
-                    char fname[MAX_PATH_LEN];
-                    if (slen > 0 && slen < sizeof(fname)) {
-                        memcpy(fname, q + 1, slen);
-                        fname[slen] = '\0';
+done:
+    stats_record(PHASE_STRATEGY, started, files, 0);
+    for (int f = 0; live && f < files; f++)
+        free(live[f]);
+    free(units);
+    free(symbols);
+    free(counts);
+    free(live);
+    free(reached);
+    free(defs);
+    free(heads);
+    strset_free(&defined);
+    strset_free(&needed);
+    arena_free(&arena);
+    return found;
+}
 
-                        const char *ext = strrchr(fname, '.');
-                        if (ext && strcmp(ext, ".c") == 0) {
-                            const char *base = strrchr(fname, '/');
-                            base = base ? base + 1 : fname;
-                            for (int i = 0; i < all_c->count; i++) {
-                                const char *cbase =
-                                    strrchr(all_c->paths[i], '/');
-                                cbase = cbase ? cbase + 1 : all_c->paths[i];
-                                if (strcmp(cbase, base) == 0 &&
-                                    result.count < MAX_FILES) {
-                                    strncpy(result.paths[result.count],
-                                            all_c->paths[i], MAX_PATH_LEN - 1);
-                                    result.count++;
-                                }
-                            }
-                        }
-                    }
-                    s = q2 + 1;
-                }
-                p = close + 1;
+/* Strategy 3: rename the statics the symbol scan predicts would clash and
+   leave out the .c files whose other definitions would, then compile the
+   combined header to confirm. Whatever the scan missed
+   is found by repeatedly compiling and dropping the .c files gcc blames
+   for redefinitions. Each round reads every conflicting source
+   from one gcc run, then tries several exclusion sets in parallel: all of
+   them, each half (so repeated rounds bisect the set), and single files when
+   there are spare cores. The best candidate seeds the next round, and the
+   final one is moved to header_path. */
+int compile_feedback(SourceCache *sources, const char *repo_dir,
+                     const char *repo_name, const char *work_dir,
+                     const char *header_path, FileList *c_files,
+                     FileList *h_files, const ConvertOptions *options) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int parallel = cpus < 1 ? 1
+                   : cpus > MAX_PARALLEL_COMPILES ? MAX_PARALLEL_COMPILES
+                                                  : (int)cpus;
+
+    Arena predicted_arena = {0};
+    StrSet predicted;
+    strset_init(&predicted, &predicted_arena);
+    double started = monotonic_seconds();
+    int k =
+        predict_collisions(sources, repo_dir, c_files, &predicted, options);
+    stats_record(PHASE_STRATEGY, started, c_files->count, 0);
+    if (k == c_files->count)
+        k = 0; /* nothing would be left; let gcc decide */
+    metrics_count(COUNTER_PREDICTED_CONFLICTS, (unsigned long long)k);
+
+    FeedbackCandidate cands[MAX_PARALLEL_COMPILES];
+    FeedbackCandidate current;
+    candidate_init(&current, c_files, predicted.items, k);
+    strset_free(&predicted);
+    arena_free(&predicted_arena);
+    evaluate_candidates(&current, 1, sources, repo_dir, repo_name, h_files,
+                        work_dir, options);
+
+    for (int retry = 0; retry < MAX_RETRY && current.rc != 0; retry++) {
+        metrics_count(COUNTER_RETRIES, 1);
+        Arena conflict_arena = {0};
+        StrSet conflicts;
+        strset_init(&conflicts, &conflict_arena);
+        if (current.generated)
+            current.error_count = find_conflicting_sources(
+                current.errors, current.path, &current.lmap, &conflicts);
+
+        int k = conflicts.count;
+        if (k == 0 || k == current.files.count) {
+            /* Nothing identifiable, or dropping it would leave nothing. */
+            strset_free(&conflicts);
+            arena_free(&conflict_arena);
+            break;
+        }
+
+        const char **bad = conflicts.items;
+        int count = 0;
+        candidate_init(&cands[count++], &current.files, bad, k);
+        if (k > 1 && count + 2 <= parallel) {
+            candidate_init(&cands[count++], &current.files, bad, k / 2);
+            candidate_init(&cands[count++], &current.files, bad + k / 2,
+                           k - k / 2);
+        }
+        for (int i = 0; k > 1 && i < k && count < parallel; i++)
+            candidate_init(&cands[count++], &current.files, bad + i, 1);
+
+        evaluate_candidates(cands, count, sources, repo_dir, repo_name,
+                            h_files, work_dir, options);
+        int best = 0;
+        for (int i = 0; i < count; i++) {
+            if (cands[i].generated && cands[i].rc != 0) {
+                Arena scratch_arena = {0};
+                StrSet scratch;
+                strset_init(&scratch, &scratch_arena);
+                cands[i].error_count = find_conflicting_sources(
+                    cands[i].errors, cands[i].path, &cands[i].lmap, &scratch);
+                strset_free(&scratch);
+                arena_free(&scratch_arena);
             }
+            if (i > 0 && candidate_better(&cands[i], &cands[best]))
+                best = i;
         }
-        free(content);
-        if (result.count > 0)
-            return result;
+
+        if (!cands[best].generated) {
+            for (int i = 0; i < count; i++)
+                candidate_free(&cands[i]);
+            strset_free(&conflicts);
+            arena_free(&conflict_arena);
+            break;
+        }
+
+        Arena kept_arena = {0};
+        StrSet kept;
+        strset_init(&kept, &kept_arena);
+        for (int i = 0; i < cands[best].files.count; i++)
+            strset_add(&kept, cands[best].files.paths[i]);
+        for (int i = 0; i < current.files.count; i++) {
+            if (!strset_contains(&kept, current.files.paths[i]))
+                log_progress("removed: %s", current.files.paths[i]);
+        }
+        strset_free(&kept);
+        arena_free(&kept_arena);
+
+        candidate_free(&current);
+        current = cands[best];
+        for (int i = 0; i < count; i++) {
+            if (i != best)
+                candidate_free(&cands[i]);
+        }
+        strset_free(&conflicts);
+        arena_free(&conflict_arena);
     }
 
-    return result;
+    int ok = current.generated && move_file(current.path, header_path);
+    if (ok)
+        current.path[0] = '\0';
+    candidate_free(&current);
+    return ok;
+}
+
+/* Pick a set of sources from scan with the strategies below and write the
+   combined header to header_path. work_dir holds scratch files. */
+int create_header_only_file(RepoScan *scan, const char *repo_dir,
+                            const char *repo_name, const char *work_dir,
+                            const char *header_path,
+                            const ConvertOptions *options,
+                            const char **strategy) {
+    FileList filtered = {0};
+    FileList *c_files = &scan->c_files, *h_files = &scan->h_files;
+    SourceCache *sources = &scan->sources;
+    int ok = 0;
+
+    double started = monotonic_seconds();
+    size_t loaded = sources->bytes_loaded;
+    strip_main_files(sources, c_files);
+
+    /* A slice starts from every source and keeps what the roots need;
+       whatever still clashes is left to compile feedback. */
+    if (options->root_count > 0) {
+        *strategy = "slice";
+        if (prune_unreachable(sources, c_files, h_files, options->roots,
+                              options->root_count) == 0) {
+            log_progress("slice: none of the roots is defined");
+            goto done;
+        }
+        log_progress("strategy: slice (%d files)", c_files->count);
+        ok = compile_feedback(sources, repo_dir, repo_name, work_dir,
+                              header_path, c_files, h_files, options);
+        goto done;
+    }
+
+    /* Strategy 1: Try build system parsing */
+    filter_by_build_system(repo_dir, c_files, &filtered);
+    stats_record(PHASE_STRATEGY, started, c_files->count,
+                 (long long)(sources->bytes_loaded - loaded));
+    if (filtered.count > 0) {
+        log_progress("strategy: build system (%d files)", filtered.count);
+        *strategy = "build system";
+        if (options->prune)
+            prune_unreachable(sources, &filtered, h_files, NULL, 0);
+        started = monotonic_seconds();
+        predict_collisions(sources, repo_dir, &filtered, NULL, options);
+        stats_record(PHASE_STRATEGY, started, filtered.count, 0);
+        ok = generate_header_file(header_path, sources, repo_dir, repo_name,
+                                  &filtered, h_files, NULL, 0, options);
+        goto done;
+    }
+
+    /* Strategy 2: Try header-name matching */
+    started = monotonic_seconds();
+    filter_by_header_match(c_files, h_files, &filtered);
+    stats_record(PHASE_STRATEGY, started, c_files->count + h_files->count, 0);
+    if (filtered.count > 0) {
+        log_progress("strategy: header match (%d files)", filtered.count);
+        *strategy = "header match";
+        if (options->prune)
+            prune_unreachable(sources, &filtered, h_files, NULL, 0);
+        started = monotonic_seconds();
+        predict_collisions(sources, repo_dir, &filtered, NULL, options);
+        stats_record(PHASE_STRATEGY, started, filtered.count, 0);
+        ok = generate_header_file(header_path, sources, repo_dir, repo_name,
+                                  &filtered, h_files, NULL, 0, options);
+        goto done;
+    }
+
+    /* Strategy 3: Compile feedback loop */
+    log_progress("strategy: compile feedback");
+    *strategy = "compile feedback";
+    if (options->prune)
+        prune_unreachable(sources, c_files, h_files, NULL, 0);
+    ok = compile_feedback(sources, repo_dir, repo_name, work_dir, header_path,
+                          c_files, h_files, options);
+
+done:
+    if (sources->segments_reused > 0)
+        log_progress("reused %d of %d file segments", sources->segments_reused,
+                     sources->segments_reused + sources->segments_built);
+    filelist_free(&filtered);
+    return ok;
+}
+
+/* Whether name is a C identifier, as slice roots must be. */
+int is_identifier(const char *name) {
+    if (!isalpha((unsigned char)*name) && *name != '_')
+        return 0;
+    while (isalnum((unsigned char)*name) || *name == '_')
+        name++;
+    return *name == '\0';
+}
+
+/* Append the comma-separated names in list (split in place) to roots.
+   Returns 0 if one is not an identifier or there are too many. */
+int parse_roots(char *list, const char **roots, int *count) {
+    for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        if (!is_identifier(name) || *count == MAX_SLICE_ROOTS)
+            return 0;
+        roots[(*count)++] = name;
+    }
+    return 1;
+}
+
+/* Cache entries are addressed by the commit being converted plus a hash of
+   everything else that affects the output: the URL, the options and the
+   converter version. */
+void conversion_cache_key(const char *git_url, const char *sha,
+                          const ConvertOptions *options, char *key,
+                          size_t key_size) {
+    uint64_t hash = hash_string(git_url);
+    hash = hash_bytes(hash, &options->stb, sizeof(options->stb));
+    hash = hash_bytes(hash, &options->prune, sizeof(options->prune));
+    hash = hash_bytes(hash, &options->shards, sizeof(options->shards));
+    /* The same roots in another order or repeated give the same slice. */
+    const char *roots[MAX_SLICE_ROOTS];
+    int root_count = options->root_count;
+    if (root_count > 0) {
+        memcpy(roots, options->roots, root_count * sizeof(*roots));
+        qsort(roots, (size_t)root_count, sizeof(*roots), compare_paths);
+    }
+    for (int i = 0; i < root_count; i++)
+        if (i == 0 || strcmp(roots[i], roots[i - 1]) != 0)
+            hash = hash_bytes(hash, roots[i], strlen(roots[i]) + 1);
+    hash = hash_bytes(hash, CONVERTER_VERSION, sizeof(CONVERTER_VERSION));
+    snprintf(key, key_size, "%s-%016llx", sha, (unsigned long long)hash);
 }
 
-/* Strategy 2: Match .c files to .h files by basename */
-FileList filter_by_header_match(FileList *c_files, FileList *h_files) {
-    FileList result;
-    memset(&result, 0, sizeof(result));
+/* On a hit, fill result from the cached metadata and place the cached header
+   in result->work_dir. */
+int conversion_cache_load(const char *key, ConversionResult *result) {
+    char dir[MAX_PATH_LEN], meta_path[MAX_PATH_LEN], header_path[MAX_PATH_LEN];
+    if (!cache_directory("headers", dir, sizeof(dir)))
+        return 0;
+    snprintf(meta_path, sizeof(meta_path), "%s/%s.json", dir, key);
+    snprintf(header_path, sizeof(header_path), "%s/%s.h", dir, key);
+    if (!file_trusted(meta_path) || !file_trusted(header_path))
+        return 0;
+
+    json_object *meta = json_object_from_file(meta_path);
+    if (!meta)
+        return 0;
+
+    json_object *filename, *strategy, *c_count, *h_count;
+    if (!json_object_object_get_ex(meta, "filename", &filename) ||
+        !json_object_object_get_ex(meta, "strategy", &strategy) ||
+        !json_object_object_get_ex(meta, "c_files_count", &c_count) ||
+        !json_object_object_get_ex(meta, "header_files_count", &h_count)) {
+        json_object_put(meta);
+        return 0;
+    }
+
+    char dest[MAX_PATH_LEN];
+    snprintf(dest, sizeof(dest), "%s/%s", result->work_dir,
+             json_object_get_string(filename));
+    /* A copy, so nothing done to the result can reach the entry. */
+    if (!copy_file(header_path, dest)) {
+        json_object_put(meta);
+        return 0;
+    }
+
+    result->header_filename = strdup(json_object_get_string(filename));
+    result->strategy = strdup(json_object_get_string(strategy));
+    result->c_files_count = json_object_get_int(c_count);
+    result->header_files_count = json_object_get_int(h_count);
+    result->is_c_project = 1;
+    result->cached = 1;
+    result->success = 1;
+    json_object_put(meta);
+    return 1;
+}
+
+/* Entries are written under temporary names and renamed into place, header
+   first, so readers never see a partial entry. */
+void conversion_cache_store(const char *key, ConversionResult *result) {
+    char dir[MAX_PATH_LEN], src[MAX_PATH_LEN], tmp[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    if (!cache_directory("headers", dir, sizeof(dir)))
+        return;
+
+    snprintf(src, sizeof(src), "%s/%s", result->work_dir,
+             result->header_filename);
+    snprintf(tmp, sizeof(tmp), "%s/.%s.h.XXXXXX", dir, key);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return;
+    close(fd);
+    remove(tmp);
+    /* A copy, not a link: the result is moved out to the user, who may
+       edit it in place. */
+    if (!copy_file(src, tmp))
+        return;
+    snprintf(path, sizeof(path), "%s/%s.h", dir, key);
+    if (chmod(tmp, 0600) != 0 || rename(tmp, path) != 0) {
+        remove(tmp);
+        return;
+    }
+
+    json_object *meta = json_object_new_object();
+    json_object_object_add(meta, "git_url",
+                           json_object_new_string(result->git_url));
+    json_object_object_add(meta, "repository",
+                           json_object_new_string(result->repo_name));
+    json_object_object_add(meta, "filename",
+                           json_object_new_string(result->header_filename));
+    json_object_object_add(
+        meta, "strategy",
+        json_object_new_string(result->strategy ? result->strategy : ""));
+    json_object_object_add(meta, "c_files_count",
+                           json_object_new_int(result->c_files_count));
+    json_object_object_add(meta, "header_files_count",
+                           json_object_new_int(result->header_files_count));
+
+    snprintf(tmp, sizeof(tmp), "%s/.%s.json.XXXXXX", dir, key);
+    fd = mkstemp(tmp);
+    if (fd >= 0) {
+        close(fd);
+        snprintf(path, sizeof(path), "%s/%s.json", dir, key);
+        if (json_object_to_file(tmp, meta) != 0 || rename(tmp, path) != 0)
+            remove(tmp);
+    }
+    json_object_put(meta);
+}
+
+ConversionResult *convert_git_repository(const char *git_url,
+                                         const ConvertOptions *options) {
+    ConversionResult *result = calloc(1, sizeof(ConversionResult));
+    if (!result)
+        return NULL;
+
+    result->git_url = strdup(git_url);
+
+    if (!validate_github_url(git_url)) {
+        result->error = strdup(
+            "Invalid GitHub URL. Expected: https://github.com/<owner>/<repo>");
+        return result;
+    }
+
+    log_progress("Verifying repository: %s", git_url);
+    char head_sha[GIT_SHA_LEN + 1];
+    if (!verify_github_repo(git_url, head_sha)) {
+        result->error =
+            strdup("Repository not found or not accessible on GitHub");
+        return result;
+    }
+
+    result->repo_name = extract_repo_name(git_url);
+
+    if (!result->repo_name) {
+        result->error = strdup("Failed to extract repository name from URL");
+        return result;
+    }
+
+    char work_dir[MAX_PATH_LEN];
+    if (!create_job_directory(work_dir, sizeof(work_dir))) {
+        result->error = strdup("Failed to create working directory");
+        return result;
+    }
+    result->work_dir = strdup(work_dir);
+
+    char cache_key[MAX_PATH_LEN];
+    conversion_cache_key(git_url, head_sha, options, cache_key,
+                         sizeof(cache_key));
+    if (conversion_cache_load(cache_key, result)) {
+        log_progress("Cache hit for %s at %.12s", result->repo_name, head_sha);
+        metrics_count(COUNTER_CACHE_HITS, 1);
+        log_progress("Conversion completed successfully!");
+        return result;
+    }
+
+    char repo_dir[MAX_PATH_LEN];
+    snprintf(repo_dir, sizeof(repo_dir), "%s/%s", work_dir, result->repo_name);
+
+    log_progress("Fetching repository: %s", git_url);
+    double started = monotonic_seconds();
+    char git_dir[MAX_PATH_LEN];
+    const char *treeish = head_sha;
+    if (!mirror_checkout(git_url, head_sha, repo_dir) ||
+        !mirror_path(git_url, git_dir, sizeof(git_dir))) {
+        /* Fall back to a one-off clone if the mirror is unusable. */
+        cleanup_directory(repo_dir);
+        log_progress("Cloning repository: %s", git_url);
+        if (!clone_repository(git_url, repo_dir)) {
+            result->error = strdup("Failed to clone repository");
+            cleanup_directory(repo_dir);
+            return result;
+        }
+        snprintf(git_dir, sizeof(git_dir), "%s/.git", repo_dir);
+        treeish = "HEAD";
+    }
+    stats_record(PHASE_CLONE, started, 0, 0);
+
+    log_progress("Scanning for C files...");
+    RepoScan scan;
+    repo_scan(&scan, repo_dir);
+    source_cache_load_blobs(&scan.sources, git_dir, treeish);
+
+    result->c_files_count = scan.c_files.count;
+    result->header_files_count = scan.h_files.count;
+    result->is_c_project = (scan.c_files.count > 0);
+
+    log_progress("Found %d C files and %d header files", scan.c_files.count,
+                 scan.h_files.count);
 
-    for (int i = 0; i < c_files->count; i++) {
-        const char *c_base = strrchr(c_files->paths[i], '/');
-        c_base = c_base ? c_base + 1 : c_files->paths[i];
+    if (!result->is_c_project) {
+        result->error = strdup("No C files found in repository");
+        repo_scan_free(&scan);
+        cleanup_directory(repo_dir);
+        return result;
+    }
 
-        /* Get stem (basename without extension) */
-        char c_stem[MAX_PATH_LEN];
-        strncpy(c_stem, c_base, sizeof(c_stem) - 1);
-        c_stem[sizeof(c_stem) - 1] = '\0';
-        char *dot = strrchr(c_stem, '.');
-        if (dot)
-            *dot = '\0';
+    log_progress("Creating header-only file...");
+    char header_filename[256];
+    snprintf(header_filename, sizeof(header_filename), "%s_combined.h",
+             result->repo_name);
+    char header_path[MAX_PATH_LEN];
+    snprintf(header_path, sizeof(header_path), "%s/%s", work_dir,
+             header_filename);
 
-        for (int j = 0; j < h_files->count; j++) {
-            const char *h_base = strrchr(h_files->paths[j], '/');
-            h_base = h_base ? h_base + 1 : h_files->paths[j];
-
-            char h_stem[MAX_PATH_LEN];
-            strncpy(h_stem, h_base, sizeof(h_stem) - 1);
-            h_stem[sizeof(h_stem) - 1] = '\0';
-            char *hdot = strrchr(h_stem, '.');
-            if (hdot)
-                *hdot = '\0';
-
-            if (strcmp(c_stem, h_stem) == 0 && result.count < MAX_FILES) {
-                strncpy(result.paths[result.count], c_files->paths[i],
-                        MAX_PATH_LEN - 1);
-                result.count++;
-                break;
-            }
-        }
+    const char *strategy = NULL;
+    int created =
+        create_header_only_file(&scan, repo_dir, result->repo_name, work_dir,
+                                header_path, options, &strategy);
+    repo_scan_free(&scan);
+    if (strategy)
+        result->strategy = strdup(strategy);
+
+    if (!created) {
+        result->error = strdup("Failed to create header-only file");
+        cleanup_directory(repo_dir);
+        return result;
     }
 
+    cleanup_directory(repo_dir);
+    result->header_filename = strdup(header_filename);
+    result->success = 1;
+    started = monotonic_seconds();
+    conversion_cache_store(cache_key, result);
+    stats_record(PHASE_WRITE, started, 1, path_size(header_path));
+
+    log_progress("Conversion completed successfully!");
     return result;
 }
 
-/* Check if a main() definition at position p in content is inside an #if/#ifdef
-   block. Simple heuristic: count #if/#ifdef vs #endif lines before the
-   position. */
-int main_is_ifdef_guarded(const char *content, const char *main_pos) {
-    int depth = 0;
-    const char *line = content;
-    while (line < main_pos) {
-        while (*line == ' ' || *line == '\t')
-            line++;
-        if (*line == '#') {
-            const char *dir = line + 1;
-            while (*dir == ' ' || *dir == '\t')
-                dir++;
-            if (strncmp(dir, "if", 2) == 0)
-                depth++;
-            else if (strncmp(dir, "endif", 5) == 0 && depth > 0)
-                depth--;
-        }
-        const char *nl = strchr(line, '\n');
-        if (!nl)
-            break;
-        line = nl + 1;
+json_object *create_json_response(ConversionResult *result) {
+    json_object *response = json_object_new_object();
+
+    json_object_object_add(response, "success",
+                           json_object_new_boolean(result->success));
+
+    if (result->success) {
+        json_object_object_add(response, "repository",
+                               json_object_new_string(result->repo_name));
+        json_object_object_add(response, "c_files_count",
+                               json_object_new_int(result->c_files_count));
+        json_object_object_add(response, "header_files_count",
+                               json_object_new_int(result->header_files_count));
+        json_object_object_add(response, "filename",
+                               json_object_new_string(result->header_filename));
+        if (result->strategy)
+            json_object_object_add(response, "strategy",
+                                   json_object_new_string(result->strategy));
+        json_object_object_add(response, "cached",
+                               json_object_new_boolean(result->cached));
+    } else {
+        json_object_object_add(response, "error",
+                               json_object_new_string(result->error
+                                                          ? result->error
+                                                          : "Unknown error"));
     }
-    return depth > 0;
+
+    return response;
 }
 
-/* Remove .c files that define an unconditional main() */
-void strip_main_files(FileList *list) {
-    int i = 0;
-    while (i < list->count) {
-        char *content = read_file_content(list->paths[i]);
-        if (!content) {
-            i++;
-            continue;
-        }
+typedef void (*TaskFn)(void *arg);
 
-        int has_unguarded_main = 0;
-        char *p = content;
-        while ((p = strstr(p, "main")) != NULL) {
-            /* Check it looks like a function definition: main\s*( */
-            char *after = p + 4;
-            while (*after == ' ' || *after == '\t')
-                after++;
-            if (*after == '(') {
-                /* Check preceding char is plausible for a definition */
-                if (p == content || *(p - 1) == '\n' || *(p - 1) == ' ' ||
-                    *(p - 1) == '\t' || *(p - 1) == '*') {
-                    if (!main_is_ifdef_guarded(content, p)) {
-                        has_unguarded_main = 1;
-                        break;
-                    }
-                }
-            }
-            p = after;
-        }
-        free(content);
+typedef struct {
+    TaskFn fn;
+    void *arg;
+} Task;
 
-        if (has_unguarded_main) {
-            printf("excluded (has main): %s\n", list->paths[i]);
-            remove_from_filelist(list, list->paths[i]);
-        } else {
-            i++;
-        }
+/* Fixed set of threads draining a bounded ring of tasks. Submitting to a full
+   queue fails instead of blocking so callers can shed load. */
+typedef struct {
+    pthread_t threads[WORKER_THREADS];
+    int thread_count;
+    Task tasks[WORKER_QUEUE_SIZE];
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} WorkerPool;
+
+void *worker_main(void *arg) {
+    WorkerPool *pool = arg;
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        Task task = pool->tasks[pool->head];
+        pool->head = (pool->head + 1) % WORKER_QUEUE_SIZE;
+        pool->count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        task.fn(task.arg);
     }
+    return NULL;
 }
 
-void make_guard_name(const char *repo_name, char *guard, size_t guard_size) {
-    size_t j = 0;
-    for (size_t i = 0; repo_name[i] && j < guard_size - 1; i++) {
-        char c = repo_name[i];
-        if (c >= 'a' && c <= 'z')
-            guard[j++] = c - 32;
-        else if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
-            guard[j++] = c;
-        else
-            guard[j++] = '_';
+int pool_init(WorkerPool *pool, int thread_count) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    if (thread_count > WORKER_THREADS)
+        thread_count = WORKER_THREADS;
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0)
+            break;
+        pool->thread_count++;
     }
-    guard[j] = '\0';
+    return pool->thread_count > 0;
 }
 
-/* Generate header content from given file lists.
- * Returns malloc'd string with the full header content.
- * If line_map is non-NULL, populates it with source file -> line range
- * mappings. If sweep_remaining_headers is set, also includes .h files not yet
- * inlined. */
-char *generate_header_content(const char *repo_dir, const char *repo_name,
-                              FileList *c_files, FileList *h_files,
-                              LineMap *line_map, int sweep_remaining_headers) {
-    ConversionContext *ctx = calloc(1, sizeof(ConversionContext));
-    if (!ctx)
-        return NULL;
-    strncpy(ctx->repo_dir, repo_dir, MAX_PATH_LEN - 1);
-
-    /* Generate the code body into a memstream so we can track line numbers */
-    char *code_buf = NULL;
-    size_t code_size = 0;
-    FILE *code_stream = open_memstream(&code_buf, &code_size);
-    if (!code_stream) {
-        free(ctx);
-        return NULL;
+int pool_submit(WorkerPool *pool, TaskFn fn, void *arg) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count >= WORKER_QUEUE_SIZE) {
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
     }
+    int tail = (pool->head + pool->count) % WORKER_QUEUE_SIZE;
+    pool->tasks[tail].fn = fn;
+    pool->tasks[tail].arg = arg;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
 
-    /* We'll track lines per source file for the line map.
-     * We count lines in the code body (not the final output header/includes).
-     */
-    int current_line = 1; /* line counter within the code body */
+typedef enum { JOB_QUEUED = 0, JOB_RUNNING, JOB_DONE, JOB_FAILED } JobStatus;
 
-    for (int i = 0; i < c_files->count; i++) {
-        if (is_file_inlined(ctx, c_files->paths[i]))
-            continue;
-        mark_file_inlined(ctx, c_files->paths[i]);
+struct Job {
+    char id[17];
+    char *git_url;
+    ConvertOptions options;
+    char **roots; /* owned copy of options.roots */
+    JobStatus status;
+    char *progress[MAX_JOB_PROGRESS];
+    int progress_count;
+    ConversionResult *result;
+    time_t created;
+};
+
+/* Content codings the server can send. DEFLATE is the zlib format, which
+   is what HTTP calls deflate. */
+typedef enum {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,
+    ENCODING_COUNT
+} ContentEncoding;
+
+static const char *const g_encoding_names[ENCODING_COUNT] = {
+    "identity", "gzip", "deflate"};
+/* Suffix of the pre-compressed copy written next to a generated header. */
+static const char *const g_encoding_suffixes[ENCODING_COUNT] = {"", ".gz",
+                                                                ".zz"};
+
+/* Compress len bytes in one pass. Returns a malloc'd buffer, or NULL if
+   compression fails or would not make the data smaller. */
+char *compress_bytes(const char *data, size_t len, ContentEncoding encoding,
+                     int level, size_t *out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int window_bits = encoding == ENCODING_GZIP ? MAX_WBITS + 16 : MAX_WBITS;
+    if (deflateInit2(&zs, level, Z_DEFLATED, window_bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
 
-        const char *rel = c_files->paths[i] + strlen(repo_dir);
-        if (*rel == '/')
-            rel++;
-        fprintf(code_stream, "\n/* %s */\n", rel);
-        current_line += 2; /* blank line + comment line */
+    size_t bound = deflateBound(&zs, (uLong)len);
+    char *out = malloc(bound);
+    if (!out) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = (uInt)len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = (uInt)bound;
+    int rc = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END || *out_len >= len) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
 
-        int start_line = current_line;
+/* Hex digest of content, used to build its validators. */
+void content_hash_hex(const char *content, size_t len, char hex[17]) {
+    snprintf(hex, 17, "%016llx",
+             (unsigned long long)hash_bytes(FNV_OFFSET, content, len));
+}
 
-        /* Count lines written by process_file_with_context */
-        long pos_before = (long)code_size;
-        fflush(code_stream);
-        pos_before = (long)code_size;
-        process_file_with_context(ctx, c_files->paths[i], code_stream);
-        fflush(code_stream);
-        long pos_after = (long)code_size;
+/* Strong validator for one encoding of a representation. Each encoding is
+   its own byte sequence, so each gets its own tag. */
+void format_etag(char *etag, size_t etag_size, const char *content_hash,
+                 ContentEncoding encoding) {
+    snprintf(etag, etag_size, "\"%s%s\"", content_hash,
+             encoding == ENCODING_IDENTITY ? ""
+             : encoding == ENCODING_GZIP   ? "-gz"
+                                           : "-zz");
+}
 
-        /* Count newlines in what was just written */
-        int lines_written = 0;
-        for (long p = pos_before; p < pos_after; p++) {
-            if (code_buf[p] == '\n')
-                lines_written++;
-        }
-        current_line += lines_written;
+/* Write gzip and deflate copies of a finished header next to it and record
+   its content hash, so downloads never compress on the event loop. Runs on
+   the conversion worker. */
+void result_precompress(ConversionResult *result) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", result->work_dir,
+             result->header_filename);
+    size_t len;
+    char *content = read_file_bytes(path, &len);
+    if (!content)
+        return;
 
-        if (line_map && line_map->count < MAX_FILES) {
-            SourceMapping *sm = &line_map->entries[line_map->count];
-            strncpy(sm->source, c_files->paths[i], MAX_PATH_LEN - 1);
-            sm->source[MAX_PATH_LEN - 1] = '\0';
-            sm->start_line = start_line;
-            sm->end_line = current_line - 1;
-            line_map->count++;
+    for (int e = ENCODING_GZIP; e < ENCODING_COUNT; e++) {
+        size_t packed_len;
+        char *packed = compress_bytes(content, len, (ContentEncoding)e,
+                                      Z_DEFAULT_COMPRESSION, &packed_len);
+        if (!packed)
+            continue;
+        char packed_path[MAX_PATH_LEN];
+        snprintf(packed_path, sizeof(packed_path), "%s%s", path,
+                 g_encoding_suffixes[e]);
+        FILE *file = fopen(packed_path, "wb");
+        if (file) {
+            int ok = fwrite(packed, 1, packed_len, file) == packed_len;
+            if (fclose(file) != 0 || !ok)
+                remove(packed_path);
         }
+        free(packed);
     }
 
-    if (sweep_remaining_headers) {
-        for (int i = 0; i < h_files->count; i++) {
-            if (is_file_inlined(ctx, h_files->paths[i]))
-                continue;
-
-            /* Skip headers in test/example directories */
-            const char *rel = h_files->paths[i] + strlen(repo_dir);
-            if (*rel == '/')
-                rel++;
-            if (strncmp(rel, "test/", 5) == 0 ||
-                strncmp(rel, "tests/", 6) == 0 ||
-                strncmp(rel, "example/", 8) == 0 ||
-                strncmp(rel, "examples/", 9) == 0 ||
-                strncmp(rel, "bench/", 6) == 0 ||
-                strncmp(rel, "benchmark/", 10) == 0 || strstr(rel, "/test/") ||
-                strstr(rel, "/tests/") || strstr(rel, "/example/") ||
-                strstr(rel, "/examples/"))
-                continue;
+    content_hash_hex(content, len, result->content_hash);
+    free(content);
+}
 
-            mark_file_inlined(ctx, h_files->paths[i]);
-            fprintf(code_stream, "\n/* %s */\n", rel);
-            current_line += 2;
-            process_file_with_context(ctx, h_files->paths[i], code_stream);
-            fflush(code_stream);
-            /* No need to track these in line_map - they're headers, not
-             * conflict sources */
-        }
+/* Every job lives in this table until it is evicted to make room for a new
+   one. All reads and writes of job state happen under g_jobs_lock. */
+static Job *g_jobs[MAX_JOBS];
+static pthread_mutex_t g_jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static WorkerPool g_convert_pool;
+
+const char *job_status_name(JobStatus status) {
+    switch (status) {
+    case JOB_QUEUED:
+        return "queued";
+    case JOB_RUNNING:
+        return "running";
+    case JOB_DONE:
+        return "done";
+    case JOB_FAILED:
+        return "failed";
     }
+    return "unknown";
+}
 
-    fclose(code_stream);
+void job_free(Job *job) {
+    if (!job)
+        return;
+    for (int i = 0; i < job->progress_count; i++)
+        free(job->progress[i]);
+    if (job->result && job->result->work_dir)
+        cleanup_directory(job->result->work_dir);
+    free_result(job->result);
+    free(job->git_url);
+    for (int i = 0; job->roots && i < job->options.root_count; i++)
+        free(job->roots[i]);
+    free(job->roots);
+    free(job);
+}
 
-    /* Assemble the final header: guard + includes + code body + end guard */
-    char guard[256];
-    make_guard_name(repo_name, guard, sizeof(guard));
+void job_make_id(char *id, size_t id_size) {
+    static unsigned int counter = 0;
+    unsigned char bytes[8] = {0};
 
-    char *result_buf = NULL;
-    size_t result_size = 0;
-    FILE *result_stream = open_memstream(&result_buf, &result_size);
-    if (!result_stream) {
-        free(code_buf);
-        free(ctx);
-        return NULL;
+    FILE *rnd = fopen("/dev/urandom", "rb");
+    if (!rnd || fread(bytes, 1, sizeof(bytes), rnd) != sizeof(bytes)) {
+        unsigned int seed = (unsigned int)time(NULL) ^ (counter++ << 16);
+        for (size_t i = 0; i < sizeof(bytes); i++)
+            bytes[i] = (unsigned char)rand_r(&seed);
     }
+    if (rnd)
+        fclose(rnd);
 
-    fprintf(result_stream, "#ifndef %s_COMBINED_H\n", guard);
-    fprintf(result_stream, "#define %s_COMBINED_H\n\n", guard);
-    fprintf(result_stream,
-            "/*\n * Auto-generated header-only file\n"
-            " * Repository: %s\n */\n\n",
-            repo_name);
-
-    /* Count how many lines the header preamble takes:
-       #ifndef, #define, blank, comment-open, comment-body, comment-close+blank
-     */
-    int preamble_lines = 6;
+    size_t j = 0;
+    for (size_t i = 0; i < sizeof(bytes) && j + 2 < id_size; i++, j += 2)
+        snprintf(id + j, id_size - j, "%02x", bytes[i]);
+}
 
-    if (ctx->standard_count > 0) {
-        for (int i = 0; i < ctx->standard_count; i++) {
-            fprintf(result_stream, "#include <%s>\n", ctx->standard[i]);
-            preamble_lines++;
+/* Register a queued job, evicting the oldest finished job when the table is
+   full. Returns NULL if every slot holds a job that is still in flight. */
+Job *job_create(const char *git_url, const ConvertOptions *options) {
+    Job *job = calloc(1, sizeof(Job));
+    if (!job)
+        return NULL;
+    job->git_url = strdup(git_url);
+    job->options = *options;
+    if (options->root_count > 0) {
+        job->roots = calloc(options->root_count, sizeof(*job->roots));
+        if (!job->roots) {
+            free(job->git_url);
+            free(job);
+            return NULL;
         }
-        fprintf(result_stream, "\n");
-        preamble_lines++;
+        for (int i = 0; i < options->root_count; i++)
+            job->roots[i] = strdup(options->roots[i]);
+        job->options.roots = (const char *const *)job->roots;
     }
-
-    if (ctx->external_count > 0) {
-        for (int i = 0; i < ctx->external_count; i++) {
-            fprintf(result_stream, "#include <%s>\n", ctx->external[i]);
-            preamble_lines++;
+    job->status = JOB_QUEUED;
+    job->created = time(NULL);
+    job_make_id(job->id, sizeof(job->id));
+
+    Job *evicted = NULL;
+    pthread_mutex_lock(&g_jobs_lock);
+    int slot = -1;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (!g_jobs[i]) {
+            slot = i;
+            break;
         }
-        fprintf(result_stream, "\n");
-        preamble_lines++;
+        if ((g_jobs[i]->status == JOB_DONE ||
+             g_jobs[i]->status == JOB_FAILED) &&
+            (slot < 0 || g_jobs[i]->created < g_jobs[slot]->created))
+            slot = i;
     }
-
-    /* Adjust line_map entries to account for preamble lines */
-    if (line_map) {
-        for (int i = 0; i < line_map->count; i++) {
-            line_map->entries[i].start_line += preamble_lines;
-            line_map->entries[i].end_line += preamble_lines;
-        }
+    if (slot >= 0) {
+        evicted = g_jobs[slot];
+        g_jobs[slot] = job;
     }
+    pthread_mutex_unlock(&g_jobs_lock);
 
-    if (code_buf)
-        fwrite(code_buf, 1, code_size, result_stream);
-
-    fprintf(result_stream, "\n#endif /* %s_COMBINED_H */\n", guard);
-
-    fclose(result_stream);
-    free(code_buf);
-    free(ctx);
-
-    return result_buf;
-}
-
-char *create_header_only_file(const char *repo_dir, const char *repo_name) {
-    FileList *c_files = calloc(1, sizeof(FileList));
-    FileList *h_files = calloc(1, sizeof(FileList));
-    if (!c_files || !h_files) {
-        free(c_files);
-        free(h_files);
+    if (slot < 0) {
+        job_free(job);
         return NULL;
     }
+    job_free(evicted);
+    return job;
+}
 
-    collect_source_files(repo_dir, c_files, h_files);
-    strip_main_files(c_files);
-
-    char *content = NULL;
-
-    /* Strategy 1: Try build system parsing */
-    FileList filtered = filter_by_build_system(repo_dir, c_files);
-    if (filtered.count > 0) {
-        printf("strategy: build system (%d files)\n", filtered.count);
-        content = generate_header_content(repo_dir, repo_name, &filtered,
-                                          h_files, NULL, 0);
-        goto write_output;
+/* Caller must hold g_jobs_lock. */
+Job *job_find(const char *id) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (g_jobs[i] && strcmp(g_jobs[i]->id, id) == 0)
+            return g_jobs[i];
     }
+    return NULL;
+}
 
-    /* Strategy 2: Try header-name matching */
-    filtered = filter_by_header_match(c_files, h_files);
-    if (filtered.count > 0) {
-        printf("strategy: header match (%d files)\n", filtered.count);
-        content = generate_header_content(repo_dir, repo_name, &filtered,
-                                          h_files, NULL, 0);
-        goto write_output;
-    }
+void job_add_progress(Job *job, const char *message) {
+    pthread_mutex_lock(&g_jobs_lock);
+    if (job->progress_count < MAX_JOB_PROGRESS)
+        job->progress[job->progress_count++] = strdup(message);
+    pthread_mutex_unlock(&g_jobs_lock);
+}
 
-    /* Strategy 3: Compile feedback loop */
-    printf("strategy: compile feedback\n");
-    {
-        char temp_path[MAX_PATH_LEN];
-        snprintf(temp_path, sizeof(temp_path), "%s/.giga_test.h", TEMP_DIR);
-
-        for (int retry = 0; retry < MAX_RETRY; retry++) {
-            LineMap lmap;
-            memset(&lmap, 0, sizeof(lmap));
-
-            free(content);
-            content = generate_header_content(repo_dir, repo_name, c_files,
-                                              h_files, &lmap, 1);
-            if (!content)
-                break;
+void job_fail(Job *job, const char *error) {
+    pthread_mutex_lock(&g_jobs_lock);
+    if (!job->result)
+        job->result = calloc(1, sizeof(ConversionResult));
+    if (job->result && !job->result->error)
+        job->result->error = strdup(error);
+    job->status = JOB_FAILED;
+    pthread_mutex_unlock(&g_jobs_lock);
+}
 
-            /* Write to temp file for compilation test */
-            FILE *tmp = fopen(temp_path, "w");
-            if (!tmp)
-                break;
-            fputs(content, tmp);
-            fclose(tmp);
+void run_conversion_job(void *arg) {
+    Job *job = arg;
 
-            char errors[4096];
-            int rc = try_compile(temp_path, errors, sizeof(errors));
-            remove(temp_path);
+    pthread_mutex_lock(&g_jobs_lock);
+    job->status = JOB_RUNNING;
+    pthread_mutex_unlock(&g_jobs_lock);
 
-            if (rc == 0)
-                break; /* Clean compile */
+    t_current_job = job;
+    ConversionResult *result =
+        convert_git_repository(job->git_url, &job->options);
+    t_current_job = NULL;
 
-            char bad_source[MAX_PATH_LEN];
-            if (!find_conflicting_source(errors, &lmap, bad_source,
-                                         sizeof(bad_source)))
-                break; /* Can't identify the problem */
+    /* Nothing will be served for a failed job; drop its scratch space. */
+    if (result && !result->success && result->work_dir)
+        cleanup_directory(result->work_dir);
+    else if (result && result->success)
+        result_precompress(result);
 
-            remove_from_filelist(c_files, bad_source);
-            printf("removed: %s\n", bad_source);
+    pthread_mutex_lock(&g_jobs_lock);
+    job->result = result;
+    job->status = (result && result->success) ? JOB_DONE : JOB_FAILED;
+    pthread_mutex_unlock(&g_jobs_lock);
+}
 
-            if (c_files->count == 0)
-                break;
-        }
+/* Caller must hold g_jobs_lock. */
+json_object *job_to_json(Job *job) {
+    json_object *response = job->result && job->status != JOB_RUNNING &&
+                                    job->status != JOB_QUEUED
+                                ? create_json_response(job->result)
+                                : json_object_new_object();
+
+    json_object_object_add(response, "job_id", json_object_new_string(job->id));
+    json_object_object_add(response, "status",
+                           json_object_new_string(job_status_name(job->status)));
+    json_object_object_add(response, "git_url",
+                           json_object_new_string(job->git_url));
+
+    json_object *progress = json_object_new_array();
+    for (int i = 0; i < job->progress_count; i++)
+        json_object_array_add(progress,
+                              json_object_new_string(job->progress[i]));
+    json_object_object_add(response, "progress", progress);
+
+    if (job->status == JOB_DONE) {
+        char result_url[64];
+        snprintf(result_url, sizeof(result_url), "/jobs/%s/result", job->id);
+        json_object_object_add(response, "result_url",
+                               json_object_new_string(result_url));
     }
+    return response;
+}
 
-write_output:
-    if (!content) {
-        free(c_files);
-        free(h_files);
-        return NULL;
+/* One client connection of the event loop. Responses are queued in out
+   (and, for a file body, file_fd) and flushed as the socket allows;
+   requests that arrive meanwhile wait in in, so pipelined requests are
+   answered in order. */
+typedef struct Connection {
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    size_t out_sent;
+    int file_fd; /* -1 unless a file body follows out */
+    off_t file_offset;
+    off_t file_end;
+    int keep_alive; /* of the request being answered */
+    int closing;    /* close once everything queued is sent */
+    time_t last_active;
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+/* A parsed request. body points into the connection's input buffer and is
+   NUL-terminated while the request is handled. */
+typedef struct {
+    char method[16];
+    char url[256];
+    const char *body;
+    size_t body_len;
+    int keep_alive;
+    unsigned accept_encodings; /* bit per ContentEncoding */
+    char if_none_match[256];
+} HttpRequest;
+
+const char *status_text(int status_code) {
+    switch (status_code) {
+    case 200:
+        return "OK";
+    case 202:
+        return "Accepted";
+    case 304:
+        return "Not Modified";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 409:
+        return "Conflict";
+    case 413:
+        return "Payload Too Large";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 500:
+        return "Internal Server Error";
+    case 501:
+        return "Not Implemented";
+    case 503:
+        return "Service Unavailable";
     }
+    return "OK";
+}
 
-    char header_filename[256];
-    snprintf(header_filename, sizeof(header_filename), "%s_combined.h",
-             repo_name);
-
-    char header_path[512];
-    snprintf(header_path, sizeof(header_path), "%s/%s", TEMP_DIR,
-             header_filename);
+/* Queue len bytes for the client. */
+void conn_append(Connection *conn, const char *data, size_t len) {
+    if (conn->out_len + len > conn->out_cap) {
+        size_t cap = conn->out_cap ? conn->out_cap : BUFFER_SIZE;
+        while (cap < conn->out_len + len)
+            cap *= 2;
+        char *grown = realloc(conn->out, cap);
+        if (!grown) {
+            conn->closing = 1;
+            return;
+        }
+        conn->out = grown;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+}
 
-    FILE *output = fopen(header_path, "w");
-    if (!output) {
-        free(content);
-        free(c_files);
-        free(h_files);
-        return NULL;
+/* Queue a status line and headers for a body of length bytes.
+   extra_headers, if not empty, is a block of complete header lines. */
+void send_head(Connection *conn, int status_code, const char *content_type,
+               long long length, const char *extra_headers) {
+    char response_header[1024];
+    int len = snprintf(response_header, sizeof(response_header),
+                       "HTTP/1.1 %d %s\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Length: %lld\r\n"
+                       "Connection: %s\r\n"
+                       "%s"
+                       "Access-Control-Allow-Origin: *\r\n"
+                       "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
+                       "Access-Control-Allow-Headers: Content-Type\r\n"
+                       "\r\n",
+                       status_code, status_text(status_code), content_type,
+                       length, conn->keep_alive ? "keep-alive" : "close",
+                       extra_headers);
+    if (len < 0 || (size_t)len >= sizeof(response_header)) {
+        conn->closing = 1;
+        return;
     }
+    conn_append(conn, response_header, (size_t)len);
+}
 
-    fputs(content, output);
-    fclose(output);
-    free(content);
-    free(c_files);
-    free(h_files);
+void send_response(Connection *conn, const char *content,
+                   const char *content_type, int status_code) {
+    size_t len = strlen(content);
+    send_head(conn, status_code, content_type, (long long)len, "");
+    conn_append(conn, content, len);
+}
 
-    return strdup(header_filename);
+void send_json(Connection *conn, json_object *json, int status_code) {
+    send_response(conn, json_object_to_json_string(json), "application/json",
+                  status_code);
 }
 
-ConversionResult *convert_git_repository(const char *git_url) {
-    ConversionResult *result = calloc(1, sizeof(ConversionResult));
-    if (!result)
-        return NULL;
+void send_error(Connection *conn, const char *error, int status_code) {
+    json_object *response = json_object_new_object();
+    json_object_object_add(response, "success", json_object_new_boolean(0));
+    json_object_object_add(response, "error", json_object_new_string(error));
+    send_json(conn, response, status_code);
+    json_object_put(response);
+}
 
-    result->git_url = strdup(git_url);
+/* Stream an open file to the client with sendfile instead of loading it into
+   memory. Takes ownership of fd. */
+void send_file_response(Connection *conn, int fd, off_t size,
+                        const char *content_type, const char *headers) {
+    send_head(conn, 200, content_type, (long long)size, headers);
+    conn->file_fd = fd;
+    conn->file_offset = 0;
+    conn->file_end = size;
+}
 
-    if (!validate_github_url(git_url)) {
-        result->error = strdup(
-            "Invalid GitHub URL. Expected: https://github.com/<owner>/<repo>");
-        return result;
+/* Pick the first available coding the client accepts, gzip before deflate
+   since some clients mishandle the latter. len[e] is 0 where a variant was
+   not worth keeping. */
+ContentEncoding choose_encoding(unsigned accepted, const size_t len[]) {
+    for (int e = ENCODING_GZIP; e < ENCODING_COUNT; e++) {
+        if ((accepted & (1u << e)) && len[e])
+            return (ContentEncoding)e;
     }
+    return ENCODING_IDENTITY;
+}
 
-    printf("Verifying repository: %s\n", git_url);
-    if (!verify_github_repo(git_url)) {
-        result->error =
-            strdup("Repository not found or not accessible on GitHub");
-        return result;
+/* Does an If-None-Match list name etag? Comparison is weak, as RFC 9110
+   requires for this header. */
+int etag_matches(const char *if_none_match, const char *etag) {
+    const char *p = if_none_match;
+    size_t etag_len = strlen(etag);
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '*')
+            return 1;
+        if (strncmp(p, "W/", 2) == 0)
+            p += 2;
+        const char *end = p;
+        while (*end && *end != ',')
+            end++;
+        const char *tag_end = end;
+        while (tag_end > p && (tag_end[-1] == ' ' || tag_end[-1] == '\t'))
+            tag_end--;
+        if ((size_t)(tag_end - p) == etag_len &&
+            memcmp(p, etag, etag_len) == 0)
+            return 1;
+        p = end;
     }
+    return 0;
+}
 
-    result->repo_name = extract_repo_name(git_url);
+/* Validator and coding headers for one encoding of a representation. */
+void representation_headers(char *headers, size_t headers_size,
+                            const char *etag, ContentEncoding encoding,
+                            const char *extra) {
+    char coding[64] = "";
+    if (encoding != ENCODING_IDENTITY)
+        snprintf(coding, sizeof(coding), "Content-Encoding: %s\r\n",
+                 g_encoding_names[encoding]);
+    snprintf(headers, headers_size, "ETag: %s\r\nVary: Accept-Encoding\r\n%s%s",
+             etag, coding, extra);
+}
 
-    if (!result->repo_name) {
-        result->error = strdup("Failed to extract repository name from URL");
-        return result;
+/* A file served from memory, loaded once with every encoding precomputed. */
+typedef struct {
+    char *data[ENCODING_COUNT];
+    size_t len[ENCODING_COUNT];
+    char etag[ENCODING_COUNT][32];
+    const char *content_type;
+} StaticAsset;
+
+static StaticAsset g_index_page;
+
+int static_asset_load(StaticAsset *asset, const char *path,
+                      const char *content_type) {
+    memset(asset, 0, sizeof(*asset));
+    asset->data[ENCODING_IDENTITY] =
+        read_file_bytes(path, &asset->len[ENCODING_IDENTITY]);
+    if (!asset->data[ENCODING_IDENTITY])
+        return 0;
+    asset->content_type = content_type;
+
+    char hash[17];
+    content_hash_hex(asset->data[ENCODING_IDENTITY],
+                     asset->len[ENCODING_IDENTITY], hash);
+    for (int e = 0; e < ENCODING_COUNT; e++) {
+        if (e != ENCODING_IDENTITY)
+            asset->data[e] = compress_bytes(
+                asset->data[ENCODING_IDENTITY], asset->len[ENCODING_IDENTITY],
+                (ContentEncoding)e, Z_BEST_COMPRESSION, &asset->len[e]);
+        if (!asset->data[e])
+            asset->len[e] = 0;
+        format_etag(asset->etag[e], sizeof(asset->etag[e]), hash,
+                    (ContentEncoding)e);
     }
+    return 1;
+}
 
-    create_directory(TEMP_DIR);
+void send_static_asset(Connection *conn, HttpRequest *req,
+                       const StaticAsset *asset) {
+    ContentEncoding encoding =
+        choose_encoding(req->accept_encodings, asset->len);
+    char headers[512];
+    representation_headers(headers, sizeof(headers), asset->etag[encoding],
+                           encoding, "Cache-Control: no-cache\r\n");
+    int not_modified = etag_matches(req->if_none_match, asset->etag[encoding]);
+    send_head(conn, not_modified ? 304 : 200, asset->content_type,
+              (long long)asset->len[encoding], headers);
+    if (!not_modified)
+        conn_append(conn, asset->data[encoding], asset->len[encoding]);
+}
 
-    char repo_dir[512];
-    snprintf(repo_dir, sizeof(repo_dir), "%s/%s", TEMP_DIR, result->repo_name);
-    cleanup_directory(repo_dir);
+void handle_convert(Connection *conn, const char *body) {
+    printf("Received conversion request\n");
 
-    printf("Cloning repository: %s\n", git_url);
-    if (!clone_repository(git_url, repo_dir)) {
-        result->error = strdup("Failed to clone repository");
-        cleanup_directory(repo_dir);
-        return result;
+    json_object *request_json = json_tokener_parse(body);
+    if (!request_json) {
+        send_error(conn, "Invalid JSON", 400);
+        return;
     }
 
-    printf("Scanning for C files...\n");
-    int c_files = 0, header_files = 0;
-    scan_directory(repo_dir, &c_files, &header_files);
-
-    result->c_files_count = c_files;
-    result->header_files_count = header_files;
-    result->is_c_project = (c_files > 0);
+    json_object *git_url_obj;
+    if (!json_object_object_get_ex(request_json, "git_url", &git_url_obj)) {
+        send_error(conn, "Missing git_url field", 400);
+        json_object_put(request_json);
+        return;
+    }
 
-    printf("Found %d C files and %d header files\n", c_files, header_files);
+    const char *git_url = json_object_get_string(git_url_obj);
+    printf("Processing URL: %s\n", git_url);
+
+    ConvertOptions options = {0};
+    json_object *mode_obj;
+    if (json_object_object_get_ex(request_json, "mode", &mode_obj)) {
+        const char *mode = json_object_is_type(mode_obj, json_type_string)
+                               ? json_object_get_string(mode_obj)
+                               : "";
+        if (strcmp(mode, "stb") == 0) {
+            options.stb = 1;
+        } else if (strcmp(mode, "combined") != 0) {
+            send_error(conn, "mode must be \"combined\" or \"stb\"", 400);
+            json_object_put(request_json);
+            return;
+        }
+    }
+    json_object *prune_obj;
+    if (json_object_object_get_ex(request_json, "prune", &prune_obj))
+        options.prune = json_object_get_boolean(prune_obj);
+    json_object *shards_obj;
+    if (json_object_object_get_ex(request_json, "shards", &shards_obj)) {
+        options.shards = json_object_get_int(shards_obj);
+        options.stb = 1;
+        if (!json_object_is_type(shards_obj, json_type_int) ||
+            options.shards < 2 || options.shards > MAX_SHARDS) {
+            char message[64];
+            snprintf(message, sizeof(message),
+                     "shards must be between 2 and %d", MAX_SHARDS);
+            send_error(conn, message, 400);
+            json_object_put(request_json);
+            return;
+        }
+    }
 
-    if (!result->is_c_project) {
-        result->error = strdup("No C files found in repository");
-        cleanup_directory(repo_dir);
-        return result;
+    const char *roots[MAX_SLICE_ROOTS];
+    json_object *roots_obj;
+    if (json_object_object_get_ex(request_json, "roots", &roots_obj)) {
+        int valid = json_object_is_type(roots_obj, json_type_array) &&
+                    json_object_array_length(roots_obj) <= MAX_SLICE_ROOTS;
+        int count = valid ? (int)json_object_array_length(roots_obj) : 0;
+        for (int i = 0; i < count && valid; i++) {
+            json_object *root = json_object_array_get_idx(roots_obj, i);
+            roots[i] = json_object_get_string(root);
+            valid = json_object_is_type(root, json_type_string) &&
+                    is_identifier(roots[i]);
+        }
+        if (!valid) {
+            send_error(conn, "roots must be a list of C identifiers", 400);
+            json_object_put(request_json);
+            return;
+        }
+        options.roots = roots;
+        options.root_count = count;
     }
 
-    printf("Creating header-only file...\n");
-    result->header_filename =
-        create_header_only_file(repo_dir, result->repo_name);
+    if (!validate_github_url(git_url)) {
+        send_error(conn,
+                   "Invalid GitHub URL. Expected: "
+                   "https://github.com/<owner>/<repo>",
+                   400);
+        json_object_put(request_json);
+        return;
+    }
 
-    if (!result->header_filename) {
-        result->error = strdup("Failed to create header-only file");
-        cleanup_directory(repo_dir);
-        return result;
+    Job *job = job_create(git_url, &options);
+    json_object_put(request_json);
+    if (!job) {
+        send_error(conn, "Too many jobs in flight", 503);
+        return;
     }
 
-    cleanup_directory(repo_dir);
-    result->success = 1;
+    char job_id[sizeof(job->id)];
+    memcpy(job_id, job->id, sizeof(job_id));
+
+    if (!pool_submit(&g_convert_pool, run_conversion_job, job)) {
+        job_fail(job, "Server busy");
+        send_error(conn, "Server busy", 503);
+        return;
+    }
 
-    printf("Conversion completed successfully!\n");
-    return result;
+    char url_buf[64];
+    json_object *response = json_object_new_object();
+    json_object_object_add(response, "success", json_object_new_boolean(1));
+    json_object_object_add(response, "job_id", json_object_new_string(job_id));
+    json_object_object_add(response, "status",
+                           json_object_new_string("queued"));
+    snprintf(url_buf, sizeof(url_buf), "/jobs/%s", job_id);
+    json_object_object_add(response, "status_url",
+                           json_object_new_string(url_buf));
+    snprintf(url_buf, sizeof(url_buf), "/jobs/%s/result", job_id);
+    json_object_object_add(response, "result_url",
+                           json_object_new_string(url_buf));
+
+    send_json(conn, response, 202);
+    json_object_put(response);
 }
 
-json_object *create_json_response(ConversionResult *result) {
-    json_object *response = json_object_new_object();
+void handle_job_status(Connection *conn, const char *job_id) {
+    pthread_mutex_lock(&g_jobs_lock);
+    Job *job = job_find(job_id);
+    json_object *response = job ? job_to_json(job) : NULL;
+    pthread_mutex_unlock(&g_jobs_lock);
 
-    json_object_object_add(response, "success",
-                           json_object_new_boolean(result->success));
+    if (!response) {
+        send_error(conn, "Unknown job", 404);
+        return;
+    }
+    send_json(conn, response, 200);
+    json_object_put(response);
+}
 
-    if (result->success) {
-        json_object_object_add(response, "repository",
-                               json_object_new_string(result->repo_name));
-        json_object_object_add(response, "c_files_count",
-                               json_object_new_int(result->c_files_count));
-        json_object_object_add(response, "header_files_count",
-                               json_object_new_int(result->header_files_count));
-        json_object_object_add(response, "filename",
-                               json_object_new_string(result->header_filename));
-    } else {
-        json_object_object_add(response, "error",
-                               json_object_new_string(result->error
-                                                          ? result->error
-                                                          : "Unknown error"));
+void handle_job_result(Connection *conn, HttpRequest *req,
+                       const char *job_id) {
+    char filename[256] = "";
+    char content_hash[17] = "";
+    ContentEncoding encoding = ENCODING_IDENTITY;
+    int fd = -1;
+    int status = 404;
+
+    /* Open the header while holding the lock so a concurrent eviction can
+       only unlink it, never pull it out from under the stream. */
+    pthread_mutex_lock(&g_jobs_lock);
+    Job *job = job_find(job_id);
+    if (job && job->status == JOB_DONE) {
+        char path[MAX_PATH_LEN];
+        strncpy(filename, job->result->header_filename, sizeof(filename) - 1);
+        memcpy(content_hash, job->result->content_hash, sizeof(content_hash));
+        /* Prefer gzip, then deflate; a copy that was not worth writing
+           simply fails to open. */
+        for (int e = ENCODING_GZIP; fd < 0 && e < ENCODING_COUNT; e++) {
+            if (!content_hash[0] || !(req->accept_encodings & (1u << e)))
+                continue;
+            snprintf(path, sizeof(path), "%s/%s%s", job->result->work_dir,
+                     filename, g_encoding_suffixes[e]);
+            fd = open(path, O_RDONLY);
+            encoding = (ContentEncoding)e;
+        }
+        if (fd < 0) {
+            snprintf(path, sizeof(path), "%s/%s", job->result->work_dir,
+                     filename);
+            fd = open(path, O_RDONLY);
+            encoding = ENCODING_IDENTITY;
+        }
+        status = fd >= 0 ? 200 : 500;
+    } else if (job) {
+        status = 409;
     }
+    pthread_mutex_unlock(&g_jobs_lock);
 
-    return response;
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        char disposition[512], headers[1024] = "";
+        snprintf(disposition, sizeof(disposition),
+                 "Content-Disposition: attachment; filename=\"%s\"\r\n",
+                 filename);
+        if (!content_hash[0]) {
+            send_file_response(conn, fd, st.st_size, "text/x-c", disposition);
+            return;
+        }
+        char etag[32];
+        format_etag(etag, sizeof(etag), content_hash, encoding);
+        representation_headers(headers, sizeof(headers), etag, encoding,
+                               disposition);
+        if (etag_matches(req->if_none_match, etag)) {
+            close(fd);
+            send_head(conn, 304, "text/x-c", (long long)st.st_size, headers);
+            return;
+        }
+        send_file_response(conn, fd, st.st_size, "text/x-c", headers);
+        return;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (status == 409)
+        send_error(conn, "Job has not finished", 409);
+    else if (status == 500)
+        send_error(conn, "Generated header is no longer available", 500);
+    else
+        send_error(conn, "Unknown job", 404);
 }
 
-char *read_html_file(void) { return read_file_content("index.html"); }
+/* GET /metrics in the Prometheus text format. */
+void handle_metrics(Connection *conn) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    if (!out) {
+        send_error(conn, "Out of memory", 500);
+        return;
+    }
+    metrics_write(out);
+    fclose(out);
+    send_response(conn, text, "text/plain; version=0.0.4", 200);
+    free(text);
+}
 
-void send_response(int client_fd, const char *content, const char *content_type,
-                   int status_code) {
-    char response_header[1024];
-    snprintf(response_header, sizeof(response_header),
-             "HTTP/1.1 %d OK\r\n"
-             "Content-Type: %s\r\n"
-             "Content-Length: %zu\r\n"
-             "Access-Control-Allow-Origin: *\r\n"
-             "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
-             "Access-Control-Allow-Headers: Content-Type\r\n"
-             "\r\n",
-             status_code, content_type, strlen(content));
-
-    write(client_fd, response_header, strlen(response_header));
-    write(client_fd, content, strlen(content));
-}
-
-void handle_request(int client_fd, const char *method, const char *url,
-                    const char *body) {
+void handle_request(Connection *conn, HttpRequest *req) {
+    const char *method = req->method, *url = req->url, *body = req->body;
+    metrics_count(COUNTER_REQUESTS, 1);
     if (strcmp(method, "GET") == 0 && strcmp(url, "/") == 0) {
-        char *html_content = read_html_file();
-        if (html_content) {
-            send_response(client_fd, html_content, "text/html", 200);
-            free(html_content);
+        if (g_index_page.data[ENCODING_IDENTITY]) {
+            send_static_asset(conn, req, &g_index_page);
         } else {
             const char *err = "<html><body><h1>Giga-Header</h1>"
                               "<p>Error loading page</p></body></html>";
-            send_response(client_fd, err, "text/html", 500);
+            send_response(conn, err, "text/html", 500);
         }
     } else if (strcmp(method, "POST") == 0 && strcmp(url, "/convert") == 0) {
-        printf("Received conversion request\n");
-
-        json_object *request_json = json_tokener_parse(body);
-        if (!request_json) {
-            const char *e = "{\"success\":false,\"error\":\"Invalid JSON\"}";
-            send_response(client_fd, e, "application/json", 400);
-            return;
-        }
-
-        json_object *git_url_obj;
-        if (!json_object_object_get_ex(request_json, "git_url", &git_url_obj)) {
-            const char *e =
-                "{\"success\":false,\"error\":\"Missing git_url field\"}";
-            send_response(client_fd, e, "application/json", 400);
-            json_object_put(request_json);
+        handle_convert(conn, body);
+    } else if (strcmp(method, "GET") == 0 && strcmp(url, "/metrics") == 0) {
+        handle_metrics(conn);
+    } else if (strcmp(method, "GET") == 0 && strncmp(url, "/jobs/", 6) == 0) {
+        char job_id[64];
+        const char *id = url + 6;
+        const char *slash = strchr(id, '/');
+        size_t id_len = slash ? (size_t)(slash - id) : strlen(id);
+        if (id_len == 0 || id_len >= sizeof(job_id)) {
+            send_error(conn, "Not found", 404);
             return;
         }
+        memcpy(job_id, id, id_len);
+        job_id[id_len] = '\0';
 
-        const char *git_url = json_object_get_string(git_url_obj);
-        printf("Processing URL: %s\n", git_url);
-
-        ConversionResult *result = convert_git_repository(git_url);
-
-        json_object *response_json = create_json_response(result);
-        const char *response_string = json_object_to_json_string(response_json);
-
-        printf("Sending response: %s\n", response_string);
-        send_response(client_fd, response_string, "application/json", 200);
-
-        json_object_put(response_json);
-        json_object_put(request_json);
-
-        free_result(result);
+        if (!slash)
+            handle_job_status(conn, job_id);
+        else if (strcmp(slash, "/result") == 0)
+            handle_job_result(conn, req, job_id);
+        else
+            send_error(conn, "Not found", 404);
     } else {
-        const char *e = "{\"success\":false,\"error\":\"Not found\"}";
-        send_response(client_fd, e, "application/json", 404);
+        send_error(conn, "Not found", 404);
     }
 }
 
@@ -1443,110 +6562,549 @@ void free_result(ConversionResult *result) {
     free(result->git_url);
     free(result->repo_name);
     free(result->header_filename);
+    free(result->work_dir);
+    free(result->strategy);
     free(result->error);
     free(result);
 }
 
-int run_cli(const char *input, const char *output_path) {
+/* Convert a local directory or repository URL and write the header to
+   output_path, or to <repo>_combined.h if it is NULL. Never returns NULL
+   unless out of memory; result->header_filename is the path written. */
+ConversionResult *convert_input(const char *input, const char *output_path,
+                                const ConvertOptions *options) {
     struct stat st;
     int is_local = (stat(input, &st) == 0 && S_ISDIR(st.st_mode));
 
     if (is_local) {
+        ConversionResult *result = calloc(1, sizeof(ConversionResult));
+        if (!result)
+            return NULL;
+        result->git_url = strdup(input);
+
         char real[PATH_MAX];
         if (!realpath(input, real)) {
-            fprintf(stderr, "error: could not resolve path %s\n", input);
-            return 1;
+            result->error = strdup("could not resolve path");
+            return result;
         }
 
         const char *repo_name = strrchr(real, '/');
         repo_name = repo_name ? repo_name + 1 : real;
+        result->repo_name = strdup(repo_name);
 
-        char *header_file = create_header_only_file(real, repo_name);
-        if (!header_file) {
-            fprintf(stderr, "error: failed to create header-only file\n");
-            return 1;
-        }
-
-        char src_path[512];
-        snprintf(src_path, sizeof(src_path), "%s/%s", TEMP_DIR, header_file);
-        free(header_file);
-
-        char *content = read_file_content(src_path);
-        remove(src_path);
-
-        if (!content) {
-            fprintf(stderr, "error: could not read generated file\n");
-            return 1;
+        char work_dir[MAX_PATH_LEN];
+        if (!create_job_directory(work_dir, sizeof(work_dir))) {
+            result->error = strdup("could not create working directory");
+            return result;
         }
 
-        const char *dest = output_path ? output_path : src_path;
-        FILE *out = fopen(dest, "w");
-        if (!out) {
-            fprintf(stderr, "error: could not write to %s\n", dest);
-            free(content);
-            return 1;
+        char header_file[256];
+        snprintf(header_file, sizeof(header_file), "%s_combined.h", repo_name);
+        const char *dest = output_path ? output_path : header_file;
+
+        /* The header is streamed straight to its destination. */
+        const char *strategy = NULL;
+        RepoScan scan;
+        int created = repo_scan(&scan, real) &&
+                      create_header_only_file(&scan, real, repo_name, work_dir,
+                                              dest, options, &strategy);
+        result->c_files_count = scan.c_files.count;
+        result->header_files_count = scan.h_files.count;
+        result->is_c_project = scan.c_files.count > 0;
+        repo_scan_free(&scan);
+        cleanup_directory(work_dir);
+        if (strategy)
+            result->strategy = strdup(strategy);
+        if (!created) {
+            result->error = strdup("failed to create header-only file");
+            return result;
         }
-        fputs(content, out);
-        fclose(out);
-        free(content);
-        printf("output:  %s\n", dest);
-        return 0;
+        result->header_filename = strdup(dest);
+        result->success = 1;
+        return result;
     }
 
-    ConversionResult *result = convert_git_repository(input);
-
+    ConversionResult *result = convert_git_repository(input, options);
     if (!result || !result->success) {
-        fprintf(stderr, "error: %s\n",
-                result && result->error ? result->error : "unknown error");
-        free_result(result);
-        return 1;
+        if (result && result->work_dir)
+            cleanup_directory(result->work_dir);
+        return result;
     }
 
-    char src_path[512];
-    snprintf(src_path, sizeof(src_path), "%s/%s", TEMP_DIR,
+    char src_path[MAX_PATH_LEN];
+    snprintf(src_path, sizeof(src_path), "%s/%s", result->work_dir,
              result->header_filename);
 
-    char *content = read_file_content(src_path);
-    remove(src_path);
+    const char *dest = output_path ? output_path : result->header_filename;
+    double started = monotonic_seconds();
+    int moved = move_file(src_path, dest);
+    stats_record(PHASE_WRITE, started, 1, moved ? path_size(dest) : 0);
+    cleanup_directory(result->work_dir);
 
-    if (!content) {
-        fprintf(stderr, "error: could not read generated file\n");
-        free_result(result);
-        return 1;
+    char *written = strdup(dest);
+    free(result->header_filename);
+    result->header_filename = written;
+    if (!moved) {
+        char message[MAX_PATH_LEN + 32];
+        snprintf(message, sizeof(message), "could not write to %s", dest);
+        result->error = strdup(message);
+        result->success = 0;
     }
+    return result;
+}
 
-    const char *dest = output_path ? output_path : result->header_filename;
-
-    FILE *out = fopen(dest, "w");
-    if (!out) {
-        fprintf(stderr, "error: could not write to %s\n", dest);
-        free(content);
+int cli_convert(const char *input, const char *output_path,
+                const ConvertOptions *options) {
+    ConversionResult *result = convert_input(input, output_path, options);
+    if (!result || !result->success) {
+        fprintf(stderr, "error: %s\n",
+                result && result->error ? result->error : "unknown error");
         free_result(result);
         return 1;
     }
-    fputs(content, out);
-    fclose(out);
-    free(content);
 
     printf("repo:    %s\n", result->repo_name);
     printf("c files: %d\n", result->c_files_count);
     printf("h files: %d\n", result->header_files_count);
-    printf("output:  %s\n", dest);
+    printf("output:  %s\n", result->header_filename);
 
     free_result(result);
     return 0;
 }
 
+/* Per-phase timings as a JSON object keyed by phase name. */
+json_object *stats_to_json(ConversionStats *stats) {
+    json_object *phases = json_object_new_object();
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        double seconds = stats->seconds[i];
+        json_object *phase = json_object_new_object();
+        json_object_object_add(phase, "seconds",
+                               json_object_new_double(seconds));
+        json_object_object_add(phase, "calls",
+                               json_object_new_int(stats->calls[i]));
+        json_object_object_add(phase, "files",
+                               json_object_new_int64(stats->files[i]));
+        json_object_object_add(phase, "bytes",
+                               json_object_new_int64(stats->bytes[i]));
+        json_object_object_add(
+            phase, "files_per_sec",
+            json_object_new_double(seconds > 0 ? stats->files[i] / seconds
+                                               : 0));
+        json_object_object_add(
+            phase, "bytes_per_sec",
+            json_object_new_double(seconds > 0 ? stats->bytes[i] / seconds
+                                               : 0));
+        json_object_object_add(phases, g_phase_names[i], phase);
+    }
+    return phases;
+}
+
+/* Write a JSON summary of one CLI conversion: total wall time, peak RSS
+   and, per phase, time, calls and throughput. */
+void write_summary(const char *path, const char *input, int success,
+                   double wall_seconds, ConversionStats *stats) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    json_object *summary = json_object_new_object();
+    json_object_object_add(summary, "input", json_object_new_string(input));
+    json_object_object_add(summary, "success",
+                           json_object_new_boolean(success));
+    json_object_object_add(summary, "converter_version",
+                           json_object_new_string(CONVERTER_VERSION));
+    json_object_object_add(summary, "wall_seconds",
+                           json_object_new_double(wall_seconds));
+    json_object_object_add(summary, "peak_rss_kb",
+                           json_object_new_int64(usage.ru_maxrss));
+    json_object_object_add(summary, "phases", stats_to_json(stats));
+
+    if (json_object_to_file_ext(path, summary, JSON_C_TO_STRING_PRETTY) != 0)
+        fprintf(stderr, "error: could not write summary to %s\n", path);
+    json_object_put(summary);
+}
+
+/* Print this run's per-phase timings and the process counters. */
+void print_stats(FILE *out, ConversionStats *stats) {
+    fprintf(out, "%-10s %6s %10s %8s %12s\n", "phase", "calls", "seconds",
+            "files", "bytes");
+    for (int i = 0; i < PHASE_COUNT; i++)
+        fprintf(out, "%-10s %6d %10.4f %8ld %12lld\n", g_phase_names[i],
+                stats->calls[i], stats->seconds[i], stats->files[i],
+                stats->bytes[i]);
+    pthread_mutex_lock(&g_metrics_lock);
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        fprintf(out, "%s %llu\n", g_counter_names[i], g_counters[i]);
+    pthread_mutex_unlock(&g_metrics_lock);
+}
+
+/* Convert input (a git URL or a local directory). If summary_path is set,
+   record per-phase timings there; with show_stats, print them. */
+int run_cli(const char *input, const char *output_path,
+            const ConvertOptions *options, const char *summary_path,
+            int show_stats) {
+    ConversionStats stats = {0};
+    double started = monotonic_seconds();
+    t_stats = &stats;
+    int rc = cli_convert(input, output_path, options);
+    t_stats = NULL;
+    if (summary_path)
+        write_summary(summary_path, input, rc == 0,
+                      monotonic_seconds() - started, &stats);
+    if (show_stats)
+        print_stats(stderr, &stats);
+    return rc;
+}
+
+/* Connections of the event loop, for idle sweeps. */
+static Connection *g_connections = NULL;
+static int g_connection_count = 0;
+
+/* Set while accept is out of file descriptors. The level-triggered
+   listener is then taken out of the epoll set, or it would fire again at
+   once, until a connection closes or the next idle sweep. */
+static int g_listen_fd = -1;
+static int g_accept_paused = 0;
+
+void accept_pause(int epoll_fd) {
+    struct epoll_event ev = {.events = 0, .data.ptr = NULL};
+    if (!g_accept_paused &&
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, g_listen_fd, &ev) == 0)
+        g_accept_paused = 1;
+}
+
+void accept_resume(int epoll_fd) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (g_accept_paused &&
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, g_listen_fd, &ev) == 0)
+        g_accept_paused = 0;
+}
+
+void conn_close(int epoll_fd, Connection *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->file_fd >= 0)
+        close(conn->file_fd);
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        g_connections = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    g_connection_count--;
+    accept_resume(epoll_fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+/* Send as much queued output as the socket takes. Returns 1 once all of it
+   is out, 0 if the socket is full and -1 on error. */
+int conn_flush(Connection *conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_sent,
+                         conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        conn->out_sent += (size_t)n;
+    }
+    conn->out_len = conn->out_sent = 0;
+
+    while (conn->file_fd >= 0 && conn->file_offset < conn->file_end) {
+        ssize_t n = sendfile(conn->fd, conn->file_fd, &conn->file_offset,
+                             (size_t)(conn->file_end - conn->file_offset));
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        if (n == 0)
+            return -1; /* the file shrank under us */
+    }
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    return 1;
+}
+
+/* Case-insensitively match header line [line, end) against name and return
+   its trimmed value, or NULL. */
+const char *header_value(const char *line, const char *end, const char *name,
+                         size_t *value_len) {
+    size_t name_len = strlen(name);
+    if ((size_t)(end - line) <= name_len || line[name_len] != ':' ||
+        strncasecmp(line, name, name_len) != 0)
+        return NULL;
+    const char *value = line + name_len + 1;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    *value_len = (size_t)(end - value);
+    return value;
+}
+
+/* Codings an Accept-Encoding value allows, as a ContentEncoding bit mask.
+   A coding with q=0 is refused; "*" stands for any coding not listed. */
+unsigned parse_accept_encoding(const char *value, size_t len) {
+    unsigned accepted = 0, listed = 0, any = 0;
+    const char *p = value, *end = value + len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        size_t name_len = (size_t)(p - name);
+        int refused = 0;
+        while (p < end && *p != ',') {
+            if (*p == 'q' && p + 1 < end && p[1] == '=')
+                refused = strtod(p + 2, NULL) <= 0.0;
+            p++;
+        }
+        if (name_len == 0)
+            continue;
+
+        unsigned bit = 0;
+        if ((name_len == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+            (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0))
+            bit = 1u << ENCODING_GZIP;
+        else if (name_len == 7 && strncasecmp(name, "deflate", 7) == 0)
+            bit = 1u << ENCODING_DEFLATE;
+        else if (name_len == 1 && *name == '*')
+            any = refused ? 0 : ~0u;
+        listed |= bit;
+        if (!refused)
+            accepted |= bit;
+    }
+    return (accepted | (any & ~listed)) & ~(1u << ENCODING_IDENTITY);
+}
+
+/* Parse the request at the start of conn->in. Returns the request's total
+   length once it has fully arrived, 0 if more input is needed and -1 with
+   *error_status set if it must be rejected. */
+long conn_parse(Connection *conn, HttpRequest *req, int *error_status) {
+    const char *buf = conn->in;
+    const char *head_end = memmem(buf, conn->in_len, "\r\n\r\n", 4);
+    if (!head_end) {
+        if (conn->in_len > MAX_REQUEST_HEADER) {
+            *error_status = 431;
+            return -1;
+        }
+        return 0;
+    }
+    size_t head_len = (size_t)(head_end - buf) + 4;
+    if (head_len > MAX_REQUEST_HEADER) {
+        *error_status = 431;
+        return -1;
+    }
+
+    memset(req, 0, sizeof(*req));
+    char version[16] = "";
+    const char *line_end = memmem(buf, head_len, "\r\n", 2);
+    char request_line[sizeof(req->method) + sizeof(req->url) + 32];
+    size_t line_len = (size_t)(line_end - buf);
+    if (line_len >= sizeof(request_line)) {
+        *error_status = line_len > MAX_REQUEST_HEADER ? 431 : 400;
+        return -1;
+    }
+    memcpy(request_line, buf, line_len);
+    request_line[line_len] = '\0';
+    if (sscanf(request_line, "%15s %255s %15s", req->method, req->url,
+               version) != 3 ||
+        strncmp(version, "HTTP/1.", 7) != 0) {
+        *error_status = 400;
+        return -1;
+    }
+    req->keep_alive = strcmp(version, "HTTP/1.0") != 0;
+
+    size_t content_length = 0;
+    const char *line = line_end + 2;
+    while (line < head_end) {
+        const char *end = memmem(line, (size_t)(head_end + 2 - line), "\r\n", 2);
+        size_t value_len;
+        const char *value;
+        if ((value = header_value(line, end, "Content-Length", &value_len))) {
+            content_length = 0;
+            for (size_t i = 0; i < value_len; i++) {
+                if (!isdigit((unsigned char)value[i]) ||
+                    content_length > MAX_REQUEST_BODY) {
+                    *error_status = isdigit((unsigned char)value[i]) ? 413 : 400;
+                    return -1;
+                }
+                content_length = content_length * 10 + (size_t)(value[i] - '0');
+            }
+        } else if ((value = header_value(line, end, "Connection", &value_len))) {
+            if (value_len == 5 && strncasecmp(value, "close", 5) == 0)
+                req->keep_alive = 0;
+            else if (value_len == 10 && strncasecmp(value, "keep-alive", 10) == 0)
+                req->keep_alive = 1;
+        } else if ((value = header_value(line, end, "Accept-Encoding",
+                                         &value_len))) {
+            req->accept_encodings = parse_accept_encoding(value, value_len);
+        } else if ((value = header_value(line, end, "If-None-Match",
+                                         &value_len))) {
+            if (value_len < sizeof(req->if_none_match))
+                memcpy(req->if_none_match, value, value_len);
+        } else if ((value = header_value(line, end, "Transfer-Encoding",
+                                         &value_len))) {
+            *error_status = 501; /* chunked bodies are not accepted */
+            return -1;
+        }
+        line = end + 2;
+    }
+    if (content_length > MAX_REQUEST_BODY) {
+        *error_status = 413;
+        return -1;
+    }
+
+    if (conn->in_len < head_len + content_length)
+        return 0;
+    req->body = buf + head_len;
+    req->body_len = content_length;
+    return (long)(head_len + content_length);
+}
+
+/* Answer every complete request in the input buffer, in order, stopping
+   while a response is still being sent. Returns 0 if the connection should
+   be dropped now. */
+int conn_process(int epoll_fd, Connection *conn) {
+    for (;;) {
+        int flushed = conn_flush(conn);
+        if (flushed < 0)
+            return 0;
+        if (flushed == 0) {
+            struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = conn};
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+            return 1;
+        }
+        if (conn->closing && conn->in_len == 0)
+            return 0;
+
+        HttpRequest req;
+        int error_status = 0;
+        long used = conn->in_len ? conn_parse(conn, &req, &error_status) : 0;
+        if (used < 0) {
+            conn->keep_alive = 0;
+            conn->closing = 1;
+            conn->in_len = 0;
+            send_error(conn, status_text(error_status), error_status);
+            continue;
+        }
+        if (used == 0) {
+            if (conn->closing)
+                return 0; /* peer is gone and no request is complete */
+            struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+            return 1;
+        }
+
+        /* The buffer always has room past the data; borrow the byte after
+           the body for its terminator. */
+        char saved = conn->in[used];
+        conn->in[used] = '\0';
+        conn->keep_alive = req.keep_alive;
+        handle_request(conn, &req);
+        conn->in[used] = saved;
+        if (!req.keep_alive)
+            conn->closing = 1;
+
+        memmove(conn->in, conn->in + used, conn->in_len - (size_t)used);
+        conn->in_len -= (size_t)used;
+        if (conn->closing)
+            conn->in_len = 0;
+    }
+}
+
+/* Read what the socket has, up to the request size limits. Returns 0 if
+   the connection should be dropped now. */
+int conn_read(int epoll_fd, Connection *conn) {
+    const size_t limit = MAX_REQUEST_HEADER + MAX_REQUEST_BODY;
+    while (conn->in_len < limit) {
+        if (conn->in_cap - conn->in_len < BUFFER_SIZE + 1) {
+            size_t cap = conn->in_cap ? conn->in_cap * 2 : 2 * BUFFER_SIZE;
+            char *grown = realloc(conn->in, cap);
+            if (!grown)
+                return 0;
+            conn->in = grown;
+            conn->in_cap = cap;
+        }
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+                         conn->in_cap - conn->in_len - 1, 0);
+        if (n == 0) {
+            conn->closing = 1;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return 0;
+        }
+        conn->in_len += (size_t)n;
+    }
+    conn->last_active = time(NULL);
+    return conn_process(epoll_fd, conn);
+}
+
+void accept_connections(int epoll_fd, int server_fd) {
+    for (;;) {
+        int client_fd = accept4(server_fd, NULL, NULL,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EMFILE || errno == ENFILE)
+                accept_pause(epoll_fd);
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
+        }
+
+        Connection *conn = NULL;
+        if (g_connection_count < MAX_CONNECTIONS)
+            conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+            static const char busy[] =
+                "HTTP/1.1 503 Service Unavailable\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n";
+            send(client_fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+            close(client_fd);
+            continue;
+        }
+        conn->fd = client_fd;
+        conn->file_fd = -1;
+        conn->last_active = time(NULL);
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+        conn->next = g_connections;
+        if (g_connections)
+            g_connections->prev = conn;
+        g_connections = conn;
+        g_connection_count++;
+    }
+}
+
+/* Drop connections that have been idle for longer than KEEPALIVE_TIMEOUT. */
+void close_idle_connections(int epoll_fd) {
+    time_t cutoff = time(NULL) - KEEPALIVE_TIMEOUT;
+    Connection *conn = g_connections;
+    while (conn) {
+        Connection *next = conn->next;
+        if (conn->last_active < cutoff)
+            conn_close(epoll_fd, conn);
+        conn = next;
+    }
+}
+
 int run_server(void) {
-    int server_fd, client_fd;
+    int server_fd;
     struct sockaddr_in address;
     int opt = 1;
-    socklen_t addrlen = sizeof(address);
-    char buffer[BUFFER_SIZE] = {0};
 
     create_directory(TEMP_DIR);
+    signal(SIGPIPE, SIG_IGN);
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
         perror("socket failed");
         return 1;
     }
@@ -1566,58 +7124,445 @@ int run_server(void) {
         return 1;
     }
 
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, LISTEN_BACKLOG) < 0) {
         perror("listen");
         return 1;
     }
 
-    printf("Giga-Header Server running on port %d\n", PORT);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_fd < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &listen_ev) < 0) {
+        perror("epoll");
+        return 1;
+    }
+    g_listen_fd = server_fd;
+
+    if (!static_asset_load(&g_index_page, "index.html", "text/html"))
+        fprintf(stderr, "warning: could not load index.html\n");
+
+    if (!pool_init(&g_convert_pool, WORKER_THREADS)) {
+        fprintf(stderr, "error: could not start worker threads\n");
+        return 1;
+    }
+
+    printf("Giga-Header Server running on port %d (%d workers)\n", PORT,
+           g_convert_pool.thread_count);
     printf("Open http://localhost:%d in your browser\n", PORT);
     printf("Press Ctrl+C to stop the server...\n");
 
+    /* One thread serves every connection without blocking; conversions run
+       on g_convert_pool, so pages and status polls never wait on them. */
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_sweep = time(NULL);
     while (1) {
-        if ((client_fd = accept(server_fd, (struct sockaddr *)&address,
-                                &addrlen)) < 0) {
-            perror("accept");
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+            if (!conn) {
+                accept_connections(epoll_fd, server_fd);
+                continue;
+            }
+            int alive;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) &&
+                !(events[i].events & EPOLLIN))
+                alive = 0;
+            else if (events[i].events & EPOLLIN)
+                alive = conn_read(epoll_fd, conn);
+            else
+                alive = conn_process(epoll_fd, conn);
+            if (alive && (events[i].events & EPOLLOUT))
+                conn->last_active = time(NULL);
+            if (!alive)
+                conn_close(epoll_fd, conn);
+        }
+        if (time(NULL) != last_sweep) {
+            last_sweep = time(NULL);
+            close_idle_connections(epoll_fd);
+            accept_resume(epoll_fd);
+        }
+    }
+
+    return 0;
+}
+
+#define MAX_BATCH_JOBS 32
+
+/* One manifest entry of a batch run. */
+typedef struct {
+    char *input;
+    char *output;
+    char name[256]; /* progress prefix */
+    ConversionResult *result;
+    ConversionStats stats;
+    double wall_seconds;
+} BatchItem;
+
+/* Entries are claimed in manifest order by whichever thread is free. */
+typedef struct {
+    BatchItem *items;
+    int count;
+    int next;
+    ConvertOptions options; /* the same for every entry */
+    pthread_mutex_t lock;
+} BatchRun;
+
+void *batch_worker(void *arg) {
+    BatchRun *run = arg;
+    for (;;) {
+        pthread_mutex_lock(&run->lock);
+        int i = run->next < run->count ? run->next++ : -1;
+        pthread_mutex_unlock(&run->lock);
+        if (i < 0)
+            return NULL;
+
+        BatchItem *item = &run->items[i];
+        double started = monotonic_seconds();
+        t_stats = &item->stats;
+        t_log_prefix = item->name;
+        item->result = convert_input(item->input, item->output, &run->options);
+        t_log_prefix = NULL;
+        t_stats = NULL;
+        item->wall_seconds = monotonic_seconds() - started;
+        log_progress("[%s] %s in %.2fs", item->name,
+                     item->result && item->result->success ? "done" : "failed",
+                     item->wall_seconds);
+    }
+}
+
+/* Read a manifest: one local path or repository URL per line, optionally
+   followed by the output path. Blank lines and lines starting with # are
+   skipped. Entries without an output go to out_dir/<name>_combined.h, with
+   a numeric suffix when two entries share a name. Returns the entry count
+   or -1 if the file cannot be read. */
+int batch_read_manifest(const char *path, const char *out_dir,
+                        BatchItem **items_out) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+
+    Arena names_arena = {0};
+    StrSet names;
+    strset_init(&names, &names_arena);
+    BatchItem *items = NULL;
+    int count = 0, capacity = 0;
+    char line[MAX_PATH_LEN * 2];
+    while (fgets(line, sizeof(line), file)) {
+        char input[MAX_PATH_LEN], output[MAX_PATH_LEN] = "";
+        if (sscanf(line, "%1023s %1023s", input, output) < 1 ||
+            input[0] == '#')
             continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            BatchItem *grown = realloc(items, capacity * sizeof(*grown));
+            if (!grown)
+                break;
+            items = grown;
         }
 
-        read(client_fd, buffer, BUFFER_SIZE);
+        BatchItem *item = &items[count++];
+        memset(item, 0, sizeof(*item));
+        item->input = strdup(input);
+
+        /* The name is the last path component without a .git suffix. */
+        char name[256];
+        size_t len = strlen(input);
+        while (len > 1 && input[len - 1] == '/')
+            len--;
+        const char *base = input + len;
+        while (base > input && base[-1] != '/')
+            base--;
+        snprintf(name, sizeof(name), "%.*s", (int)(input + len - base), base);
+        len = strlen(name);
+        if (len > 4 && strcmp(name + len - 4, ".git") == 0)
+            name[len - 4] = '\0';
+        snprintf(item->name, sizeof(item->name), "%s", name);
+        for (int n = 2; !strset_add(&names, item->name); n++)
+            snprintf(item->name, sizeof(item->name), "%s-%d", name, n);
+
+        if (output[0]) {
+            item->output = strdup(output);
+        } else {
+            char dest[MAX_PATH_LEN];
+            snprintf(dest, sizeof(dest), "%s/%s_combined.h", out_dir,
+                     item->name);
+            item->output = strdup(dest);
+        }
+    }
+    fclose(file);
+    strset_free(&names);
+    arena_free(&names_arena);
+    *items_out = items;
+    return count;
+}
 
-        char method[16], url[256], version[16];
-        sscanf(buffer, "%15s %255s %15s", method, url, version);
+void write_batch_summary(const char *path, BatchItem *items, int count,
+                         int jobs, double wall_seconds) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
 
-        char *body = strstr(buffer, "\r\n\r\n");
-        if (body)
-            body += 4;
+    int succeeded = 0;
+    json_object *repos = json_object_new_array();
+    for (int i = 0; i < count; i++) {
+        BatchItem *item = &items[i];
+        ConversionResult *result = item->result;
+        int success = result && result->success;
+        succeeded += success;
+
+        json_object *repo = json_object_new_object();
+        json_object_object_add(repo, "input",
+                               json_object_new_string(item->input));
+        json_object_object_add(repo, "output",
+                               json_object_new_string(item->output));
+        json_object_object_add(repo, "success",
+                               json_object_new_boolean(success));
+        json_object_object_add(
+            repo, "strategy",
+            result && result->strategy
+                ? json_object_new_string(result->strategy)
+                : NULL);
+        json_object_object_add(repo, "error",
+                               result && result->error
+                                   ? json_object_new_string(result->error)
+                                   : NULL);
+        json_object_object_add(
+            repo, "cached", json_object_new_boolean(result && result->cached));
+        json_object_object_add(
+            repo, "c_files_count",
+            json_object_new_int(result ? result->c_files_count : 0));
+        json_object_object_add(
+            repo, "header_files_count",
+            json_object_new_int(result ? result->header_files_count : 0));
+        json_object_object_add(repo, "wall_seconds",
+                               json_object_new_double(item->wall_seconds));
+        json_object_object_add(repo, "phases", stats_to_json(&item->stats));
+        json_object_array_add(repos, repo);
+    }
 
-        handle_request(client_fd, method, url, body ? body : "");
+    json_object *summary = json_object_new_object();
+    json_object_object_add(summary, "converter_version",
+                           json_object_new_string(CONVERTER_VERSION));
+    json_object_object_add(summary, "jobs", json_object_new_int(jobs));
+    json_object_object_add(summary, "succeeded",
+                           json_object_new_int(succeeded));
+    json_object_object_add(summary, "failed",
+                           json_object_new_int(count - succeeded));
+    json_object_object_add(summary, "wall_seconds",
+                           json_object_new_double(wall_seconds));
+    json_object_object_add(summary, "peak_rss_kb",
+                           json_object_new_int64(usage.ru_maxrss));
+    json_object_object_add(summary, "repos", repos);
+
+    if (json_object_to_file_ext(path, summary, JSON_C_TO_STRING_PRETTY) != 0)
+        fprintf(stderr, "error: could not write summary to %s\n", path);
+    json_object_put(summary);
+}
 
-        close(client_fd);
-        memset(buffer, 0, BUFFER_SIZE);
+/* Convert every entry of a manifest on jobs threads in one process, so the
+   system header probe, the header lookup cache, the mirrors and the output
+   caches are set up once and shared. Returns 0 if every entry succeeded. */
+int run_batch(const char *manifest, int jobs, const char *out_dir,
+              const ConvertOptions *options, const char *summary_path,
+              int show_stats) {
+    BatchRun run = {0};
+    run.options = *options;
+    run.count = batch_read_manifest(manifest, out_dir, &run.items);
+    if (run.count < 0) {
+        fprintf(stderr, "error: could not read %s\n", manifest);
+        return 1;
+    }
+    if (run.count > 0 && create_directory(out_dir) != 0 && errno != EEXIST) {
+        fprintf(stderr, "error: could not create %s\n", out_dir);
+        free(run.items);
+        return 1;
+    }
+    pthread_mutex_init(&run.lock, NULL);
+    if (jobs > run.count)
+        jobs = run.count > 0 ? run.count : 1;
+
+    double started = monotonic_seconds();
+    pthread_t threads[MAX_BATCH_JOBS];
+    int spawned = 0;
+    for (int i = 1; i < jobs; i++) {
+        if (pthread_create(&threads[spawned], NULL, batch_worker, &run) != 0)
+            break;
+        spawned++;
+    }
+    batch_worker(&run);
+    for (int i = 0; i < spawned; i++)
+        pthread_join(threads[i], NULL);
+    double wall = monotonic_seconds() - started;
+
+    int failed = 0;
+    ConversionStats total = {0};
+    for (int i = 0; i < run.count; i++) {
+        BatchItem *item = &run.items[i];
+        ConversionResult *result = item->result;
+        if (result && result->success) {
+            printf("ok      %-24s %-18s %s\n", item->name,
+                   result->strategy ? result->strategy : "-", item->output);
+        } else {
+            failed++;
+            printf("failed  %-24s %s\n", item->name,
+                   result && result->error ? result->error : "unknown error");
+        }
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            total.seconds[p] += item->stats.seconds[p];
+            total.calls[p] += item->stats.calls[p];
+            total.files[p] += item->stats.files[p];
+            total.bytes[p] += item->stats.bytes[p];
+        }
     }
+    printf("%d of %d converted in %.2fs with %d jobs\n", run.count - failed,
+           run.count, wall, jobs);
 
-    return 0;
+    write_batch_summary(summary_path, run.items, run.count, jobs, wall);
+    if (show_stats)
+        print_stats(stderr, &total);
+
+    for (int i = 0; i < run.count; i++) {
+        free(run.items[i].input);
+        free(run.items[i].output);
+        free_result(run.items[i].result);
+    }
+    free(run.items);
+    pthread_mutex_destroy(&run.lock);
+    return failed ? 1 : 0;
 }
 
 int main(int argc, char *argv[]) {
     init_system_paths();
+    const char *roots[MAX_SLICE_ROOTS];
+    const char *cache_dir = NULL;
 
     if (argc < 2) {
-        printf("usage: %s <git_url> [-o output.h]\n"
-               "       %s serve\n",
-               argv[0], argv[0]);
+        printf("usage: %s <git_url|dir> [-o output.h] [--stb] [--prune] "
+               "[--roots a,b] [--shards N] [--summary file.json] [--stats]\n"
+               "       %s batch manifest.txt [-j N] [-o dir] [--stb] "
+               "[--prune] [--roots a,b] [--shards N] [--summary file.json] "
+               "[--stats]\n"
+               "       %s serve\n"
+               "Every form also takes [--cache-dir dir].\n",
+               argv[0], argv[0], argv[0]);
         return 1;
     }
 
-    if (strcmp(argv[1], "serve") == 0)
+    if (strcmp(argv[1], "serve") == 0) {
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+                cache_dir = argv[++i];
+            } else {
+                fprintf(stderr, "error: unknown argument %s\n", argv[i]);
+                return 1;
+            }
+        }
+        cache_root_init(cache_dir);
         return run_server();
+    }
+
+    if (strcmp(argv[1], "batch") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "error: batch needs a manifest\n");
+            return 1;
+        }
+        const char *out_dir = ".";
+        const char *summary_path = NULL;
+        ConvertOptions options = {0};
+        options.roots = roots;
+        int jobs = WORKER_THREADS, show_stats = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                jobs = atoi(argv[++i]);
+                if (jobs < 1 || jobs > MAX_BATCH_JOBS) {
+                    fprintf(stderr, "error: -j must be between 1 and %d\n",
+                            MAX_BATCH_JOBS);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+                out_dir = argv[++i];
+            } else if (strcmp(argv[i], "--stb") == 0) {
+                options.stb = 1;
+            } else if (strcmp(argv[i], "--prune") == 0) {
+                options.prune = 1;
+            } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+                options.shards = atoi(argv[++i]);
+                options.stb = 1;
+                if (options.shards < 2 || options.shards > MAX_SHARDS) {
+                    fprintf(stderr,
+                            "error: --shards must be between 2 and %d\n",
+                            MAX_SHARDS);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--roots") == 0 && i + 1 < argc) {
+                if (!parse_roots(argv[++i], roots, &options.root_count)) {
+                    fprintf(stderr, "error: bad --roots %s\n", argv[i]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+                cache_dir = argv[++i];
+            } else if (strcmp(argv[i], "--summary") == 0 && i + 1 < argc) {
+                summary_path = argv[++i];
+            } else if (strcmp(argv[i], "--stats") == 0) {
+                show_stats = 1;
+            } else {
+                fprintf(stderr, "error: unknown argument %s\n", argv[i]);
+                return 1;
+            }
+        }
+        char default_summary[MAX_PATH_LEN];
+        if (!summary_path) {
+            snprintf(default_summary, sizeof(default_summary),
+                     "%s/batch_summary.json", out_dir);
+            summary_path = default_summary;
+        }
+        cache_root_init(cache_dir);
+        return run_batch(argv[2], jobs, out_dir, &options, summary_path,
+                         show_stats);
+    }
 
     const char *git_url = argv[1];
     const char *output_path = NULL;
+    const char *summary_path = NULL;
+    ConvertOptions options = {0};
+    options.roots = roots;
+    int show_stats = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--stb") == 0) {
+            options.stb = 1;
+        } else if (strcmp(argv[i], "--prune") == 0) {
+            options.prune = 1;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            options.shards = atoi(argv[++i]);
+            options.stb = 1;
+            if (options.shards < 2 || options.shards > MAX_SHARDS) {
+                fprintf(stderr, "error: --shards must be between 2 and %d\n",
+                        MAX_SHARDS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--roots") == 0 && i + 1 < argc) {
+            if (!parse_roots(argv[++i], roots, &options.root_count)) {
+                fprintf(stderr, "error: bad --roots %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--summary") == 0 && i + 1 < argc) {
+            summary_path = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        } else {
+            fprintf(stderr, "error: unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
 
-    if (argc >= 4 && strcmp(argv[2], "-o") == 0)
-        output_path = argv[3];
-
-    return run_cli(git_url, output_path);
+    cache_root_init(cache_dir);
+    return run_cli(git_url, output_path, &options, summary_path, show_stats);
 }